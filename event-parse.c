@@ -31,19 +31,25 @@
 #include <errno.h>
 #include <stdint.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <netinet/ip6.h>
 #include "event-parse.h"
 #include "event-utils.h"
 
-static const char *input_buf;
-static unsigned long long input_buf_ptr;
-static unsigned long long input_buf_siz;
+/*
+ * The tokenizer state is kept per thread, and set up again for each
+ * format or filter parsed, so that several threads can parse at once.
+ */
+static __thread const char *input_buf;
+static __thread unsigned long long input_buf_ptr;
+static __thread unsigned long long input_buf_siz;
 
-static int is_flag_field;
-static int is_symbolic_field;
+static __thread int is_flag_field;
+static __thread int is_symbolic_field;
 
-static int show_warning = 1;
+static __thread int show_warning = 1;
 
 #define do_warning(fmt, ...)				\
 	do {						\
@@ -134,54 +140,59 @@ struct print_arg *alloc_arg(void)
 }
 
 struct cmdline {
-	char *comm;
-	int pid;
+	struct cmdline	*next;		/* in pevent->cmdlist */
+	struct cmdline	*hash_next;	/* in a pevent->cmdline_hash bucket */
+	char		*comm;
+	int		pid;
 };
 
-static int cmdline_cmp(const void *a, const void *b)
+#define CMDLINE_HASH_BITS	10
+
+static unsigned int cmdline_hash(struct pevent *pevent, int pid)
 {
-	const struct cmdline *ca = a;
-	const struct cmdline *cb = b;
+	return ((unsigned int)pid * 2654435761U) >>
+		(32 - pevent->cmdline_hash_bits);
+}
 
-	if (ca->pid < cb->pid)
-		return -1;
-	if (ca->pid > cb->pid)
-		return 1;
+static struct cmdline *find_cmdline_pid(struct pevent *pevent, int pid)
+{
+	struct cmdline *cmdline;
 
-	return 0;
-}
+	if (!pevent->cmdline_hash)
+		return NULL;
 
-struct cmdline_list {
-	struct cmdline_list	*next;
-	char			*comm;
-	int			pid;
-};
+	cmdline = pevent->cmdline_hash[cmdline_hash(pevent, pid)];
+	while (cmdline && cmdline->pid != pid)
+		cmdline = cmdline->hash_next;
+
+	return cmdline;
+}
 
-static int cmdline_init(struct pevent *pevent)
+/* Makes room for one more cmdline, at most one per bucket on average */
+static int grow_cmdline_hash(struct pevent *pevent)
 {
-	struct cmdline_list *cmdlist = pevent->cmdlist;
-	struct cmdline_list *item;
-	struct cmdline *cmdlines;
-	int i;
+	struct cmdline **hash;
+	struct cmdline *cmdline;
+	int bits = pevent->cmdline_hash_bits;
+	unsigned int key;
 
-	cmdlines = malloc(sizeof(*cmdlines) * pevent->cmdline_count);
-	if (!cmdlines)
-		return -1;
+	if (pevent->cmdline_hash && pevent->cmdline_count < (1 << bits))
+		return 0;
 
-	i = 0;
-	while (cmdlist) {
-		cmdlines[i].pid = cmdlist->pid;
-		cmdlines[i].comm = cmdlist->comm;
-		i++;
-		item = cmdlist;
-		cmdlist = cmdlist->next;
-		free(item);
-	}
+	bits = pevent->cmdline_hash ? bits + 1 : CMDLINE_HASH_BITS;
+	hash = calloc(1 << bits, sizeof(*hash));
+	if (!hash)
+		return -1;
 
-	qsort(cmdlines, pevent->cmdline_count, sizeof(*cmdlines), cmdline_cmp);
+	free(pevent->cmdline_hash);
+	pevent->cmdline_hash = hash;
+	pevent->cmdline_hash_bits = bits;
 
-	pevent->cmdlines = cmdlines;
-	pevent->cmdlist = NULL;
+	for (cmdline = pevent->cmdlist; cmdline; cmdline = cmdline->next) {
+		key = cmdline_hash(pevent, cmdline->pid);
+		cmdline->hash_next = hash[key];
+		hash[key] = cmdline;
+	}
 
 	return 0;
 }
@@ -189,19 +200,11 @@ static int cmdline_init(struct pevent *pevent)
 static const char *find_cmdline(struct pevent *pevent, int pid)
 {
 	const struct cmdline *comm;
-	struct cmdline key;
 
 	if (!pid)
 		return "<idle>";
 
-	if (!pevent->cmdlines && cmdline_init(pevent))
-		return "<not enough memory for cmdlines!>";
-
-	key.pid = pid;
-
-	comm = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-
+	comm = find_cmdline_pid(pevent, pid);
 	if (comm)
 		return comm->comm;
 	return "<...>";
@@ -217,71 +220,10 @@ static const char *find_cmdline(struct pevent *pevent, int pid)
  */
 int pevent_pid_is_registered(struct pevent *pevent, int pid)
 {
-	const struct cmdline *comm;
-	struct cmdline key;
-
 	if (!pid)
 		return 1;
 
-	if (!pevent->cmdlines && cmdline_init(pevent))
-		return 0;
-
-	key.pid = pid;
-
-	comm = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-
-	if (comm)
-		return 1;
-	return 0;
-}
-
-/*
- * If the command lines have been converted to an array, then
- * we must add this pid. This is much slower than when cmdlines
- * are added before the array is initialized.
- */
-static int add_new_comm(struct pevent *pevent, const char *comm, int pid)
-{
-	struct cmdline *cmdlines = pevent->cmdlines;
-	const struct cmdline *cmdline;
-	struct cmdline key;
-
-	if (!pid)
-		return 0;
-
-	/* avoid duplicates */
-	key.pid = pid;
-
-	cmdline = bsearch(&key, pevent->cmdlines, pevent->cmdline_count,
-		       sizeof(*pevent->cmdlines), cmdline_cmp);
-	if (cmdline) {
-		errno = EEXIST;
-		return -1;
-	}
-
-	cmdlines = realloc(cmdlines, sizeof(*cmdlines) * (pevent->cmdline_count + 1));
-	if (!cmdlines) {
-		errno = ENOMEM;
-		return -1;
-	}
-
-	cmdlines[pevent->cmdline_count].comm = strdup(comm);
-	if (!cmdlines[pevent->cmdline_count].comm) {
-		free(cmdlines);
-		errno = ENOMEM;
-		return -1;
-	}
-
-	cmdlines[pevent->cmdline_count].pid = pid;
-		
-	if (cmdlines[pevent->cmdline_count].comm)
-		pevent->cmdline_count++;
-
-	qsort(cmdlines, pevent->cmdline_count, sizeof(*cmdlines), cmdline_cmp);
-	pevent->cmdlines = cmdlines;
-
-	return 0;
+	return find_cmdline_pid(pevent, pid) != NULL;
 }
 
 /**
@@ -291,18 +233,26 @@ static int add_new_comm(struct pevent *pevent, const char *comm, int pid)
  * @pid: the pid to map the command line to
  *
  * This adds a mapping to search for command line names with
- * a given pid. The comm is duplicated.
+ * a given pid. The comm is duplicated. If @pid already has a
+ * command line, it is kept and -1 is returned with errno set
+ * to EEXIST.
  */
 int pevent_register_comm(struct pevent *pevent, const char *comm, int pid)
 {
-	struct cmdline_list *item;
+	struct cmdline *item;
+	unsigned int key;
 
-	if (pevent->cmdlines)
-		return add_new_comm(pevent, comm, pid);
+	if (find_cmdline_pid(pevent, pid)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (grow_cmdline_hash(pevent) < 0)
+		goto out_nomem;
 
 	item = malloc(sizeof(*item));
 	if (!item)
-		return -1;
+		goto out_nomem;
 
 	if (comm)
 		item->comm = strdup(comm);
@@ -310,7 +260,7 @@ int pevent_register_comm(struct pevent *pevent, const char *comm, int pid)
 		item->comm = strdup("<...>");
 	if (!item->comm) {
 		free(item);
-		return -1;
+		goto out_nomem;
 	}
 	item->pid = pid;
 	item->next = pevent->cmdlist;
@@ -318,7 +268,15 @@ int pevent_register_comm(struct pevent *pevent, const char *comm, int pid)
 	pevent->cmdlist = item;
 	pevent->cmdline_count++;
 
+	key = cmdline_hash(pevent, pid);
+	item->hash_next = pevent->cmdline_hash[key];
+	pevent->cmdline_hash[key] = item;
+
 	return 0;
+
+ out_nomem:
+	errno = ENOMEM;
+	return -1;
 }
 
 int pevent_register_trace_clock(struct pevent *pevent, const char *trace_clock)
@@ -337,13 +295,51 @@ struct func_map {
 	char				*mod;
 };
 
-struct func_list {
-	struct func_list	*next;
+/*
+ * The names of the functions and modules are packed into large
+ * blocks, as there are many of them and they are only freed all
+ * together.
+ */
+#define FUNC_STRINGS_SIZE	(64 * 1024)
+
+struct func_strings {
+	struct func_strings	*next;
+	unsigned int		used;
+	unsigned int		size;
+	char			buf[];
+};
+
+/*
+ * To find the function that holds an address, the address range of
+ * the sorted func_map is split into buckets of (1 << shift) bytes,
+ * with about two buckets per function. first[b] is the index of the
+ * first function that starts at or after bucket b, so a lookup only
+ * has to search between first[b] and first[b + 1].
+ */
+struct func_index {
+	unsigned long long	start;
+	unsigned int		shift;
+	unsigned int		nr_buckets;
+	unsigned int		first[];
+};
+
+/*
+ * Most traced addresses repeat, so recent lookups are kept in a small
+ * direct mapped cache. It is per thread, and tagged with the
+ * generation of the func_map the result points into.
+ */
+#define FUNC_CACHE_BITS		8
+#define FUNC_CACHE_SIZE		(1 << FUNC_CACHE_BITS)
+
+struct func_cache {
 	unsigned long long	addr;
-	char			*func;
-	char			*mod;
+	struct func_map		*func;
+	unsigned int		gen;
 };
 
+static __thread struct func_cache func_cache[FUNC_CACHE_SIZE];
+static unsigned int func_map_gen;
+
 static int func_cmp(const void *a, const void *b)
 {
 	const struct func_map *fa = a;
@@ -357,79 +353,134 @@ static int func_cmp(const void *a, const void *b)
 	return 0;
 }
 
-/*
- * We are searching for a record in between, not an exact
- * match.
- */
-static int func_bcmp(const void *a, const void *b)
+static char *save_func_string(struct pevent *pevent, const char *str)
 {
-	const struct func_map *fa = a;
-	const struct func_map *fb = b;
-
-	if ((fa->addr == fb->addr) ||
+	struct func_strings *strings = pevent->func_strings;
+	unsigned int len = strlen(str) + 1;
+	unsigned int size;
+	char *p;
 
-	    (fa->addr > fb->addr &&
-	     fa->addr < (fb+1)->addr))
-		return 0;
+	if (!strings || strings->size - strings->used < len) {
+		size = len > FUNC_STRINGS_SIZE ? len : FUNC_STRINGS_SIZE;
+		strings = malloc(sizeof(*strings) + size);
+		if (!strings)
+			return NULL;
+		strings->used = 0;
+		strings->size = size;
+		strings->next = pevent->func_strings;
+		pevent->func_strings = strings;
+	}
 
-	if (fa->addr < fb->addr)
-		return -1;
+	p = strings->buf + strings->used;
+	memcpy(p, str, len);
+	strings->used += len;
 
-	return 1;
+	return p;
 }
 
 static int func_map_init(struct pevent *pevent)
 {
-	struct func_list *funclist;
-	struct func_list *item;
-	struct func_map *func_map;
-	int i;
+	struct func_map *func_map = pevent->func_map;
+	struct func_index *index;
+	unsigned long long span = 0;
+	unsigned int count = pevent->func_count;
+	unsigned int nr_buckets = 0;
+	unsigned int shift = 0;
+	unsigned int b, i;
+
+	if (count) {
+		/* Keep the order of functions at the same address as before */
+		for (i = 0; i < count / 2; i++) {
+			struct func_map tmp = func_map[i];
+
+			func_map[i] = func_map[count - i - 1];
+			func_map[count - i - 1] = tmp;
+		}
+		qsort(func_map, count, sizeof(*func_map), func_cmp);
+
+		span = func_map[count - 1].addr - func_map[0].addr;
+		while ((span >> shift) >= 2ULL * count)
+			shift++;
+		nr_buckets = (span >> shift) + 1;
+	}
 
-	func_map = malloc(sizeof(*func_map) * (pevent->func_count + 1));
-	if (!func_map)
+	index = malloc(sizeof(*index) +
+		       sizeof(*index->first) * (nr_buckets + 1));
+	if (!index)
 		return -1;
 
-	funclist = pevent->funclist;
+	index->start = count ? func_map[0].addr : 0;
+	index->shift = shift;
+	index->nr_buckets = nr_buckets;
 
-	i = 0;
-	while (funclist) {
-		func_map[i].func = funclist->func;
-		func_map[i].addr = funclist->addr;
-		func_map[i].mod = funclist->mod;
-		i++;
-		item = funclist;
-		funclist = funclist->next;
-		free(item);
+	for (b = 0, i = 0; b < nr_buckets; b++) {
+		while (i < count &&
+		       (func_map[i].addr - index->start) >> shift < b)
+			i++;
+		index->first[b] = i;
 	}
+	index->first[nr_buckets] = count;
 
-	qsort(func_map, pevent->func_count, sizeof(*func_map), func_cmp);
+	free(pevent->func_index);
+	pevent->func_index = index;
+	pevent->func_gen = __sync_add_and_fetch(&func_map_gen, 1);
 
-	/*
-	 * Add a special record at the end.
-	 */
-	func_map[pevent->func_count].func = NULL;
-	func_map[pevent->func_count].addr = 0;
-	func_map[pevent->func_count].mod = NULL;
+	return 0;
+}
+
+static struct func_map *
+__find_func(struct pevent *pevent, unsigned long long addr)
+{
+	struct func_index *index = pevent->func_index;
+	struct func_map *func_map = pevent->func_map;
+	unsigned long long b;
+	unsigned int lo, hi, mid;
 
-	pevent->func_map = func_map;
-	pevent->funclist = NULL;
+	if (addr < index->start)
+		return NULL;
 
-	return 0;
+	b = (addr - index->start) >> index->shift;
+	if (b >= index->nr_buckets)
+		return NULL;
+
+	/* Find the first function past addr, the one before it holds addr */
+	lo = index->first[b];
+	hi = index->first[b + 1];
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (func_map[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Nothing is known to be past the last function */
+	if (lo == pevent->func_count && func_map[lo - 1].addr != addr)
+		return NULL;
+
+	return &func_map[lo - 1];
 }
 
 static struct func_map *
 find_func(struct pevent *pevent, unsigned long long addr)
 {
+	struct func_cache *cache;
 	struct func_map *func;
-	struct func_map key;
 
-	if (!pevent->func_map)
-		func_map_init(pevent);
+	if (!pevent->func_index && func_map_init(pevent))
+		return NULL;
 
-	key.addr = addr;
+	cache = &func_cache[(addr * 0x9e3779b97f4a7c15ULL) >>
+			    (64 - FUNC_CACHE_BITS)];
+	if (cache->addr == addr && cache->gen == pevent->func_gen)
+		return cache->func;
 
-	func = bsearch(&key, pevent->func_map, pevent->func_count,
-		       sizeof(*pevent->func_map), func_bcmp);
+	func = __find_func(pevent, addr);
+	if (func) {
+		cache->addr = addr;
+		cache->func = func;
+		cache->gen = pevent->func_gen;
+	}
 
 	return func;
 }
@@ -488,34 +539,45 @@ pevent_find_function_address(struct pevent *pevent, unsigned long long addr)
 int pevent_register_function(struct pevent *pevent, char *func,
 			     unsigned long long addr, char *mod)
 {
-	struct func_list *item = malloc(sizeof(*item));
+	struct func_map *func_map = pevent->func_map;
+	struct func_map *item;
+	unsigned int size;
 
-	if (!item)
-		return -1;
+	if (pevent->func_count == pevent->func_size) {
+		size = pevent->func_size ? pevent->func_size * 2 : 1024;
+		func_map = realloc(func_map, sizeof(*func_map) * size);
+		if (!func_map)
+			goto out_nomem;
+		pevent->func_map = func_map;
+		pevent->func_size = size;
+	}
 
-	item->next = pevent->funclist;
-	item->func = strdup(func);
+	item = &func_map[pevent->func_count];
+	item->func = save_func_string(pevent, func);
 	if (!item->func)
-		goto out_free;
-
-	if (mod) {
-		item->mod = strdup(mod);
+		goto out_nomem;
+
+	/* Functions of a module are listed together, share its name */
+	item->mod = NULL;
+	if (mod && pevent->func_count && item[-1].mod &&
+	    strcmp(item[-1].mod, mod) == 0)
+		item->mod = item[-1].mod;
+	else if (mod) {
+		item->mod = save_func_string(pevent, mod);
 		if (!item->mod)
-			goto out_free_func;
-	} else
-		item->mod = NULL;
+			goto out_nomem;
+	}
 	item->addr = addr;
 
-	pevent->funclist = item;
 	pevent->func_count++;
 
+	/* The functions need to be sorted again */
+	free(pevent->func_index);
+	pevent->func_index = NULL;
+
 	return 0;
 
-out_free_func:
-	free(item->func);
-	item->func = NULL;
-out_free:
-	free(item);
+out_nomem:
 	errno = ENOMEM;
 	return -1;
 }
@@ -530,8 +592,8 @@ void pevent_print_funcs(struct pevent *pevent)
 {
 	int i;
 
-	if (!pevent->func_map)
-		func_map_init(pevent);
+	if (!pevent->func_index && func_map_init(pevent))
+		return;
 
 	for (i = 0; i < (int)pevent->func_count; i++) {
 		printf("%016llx %s",
@@ -688,11 +750,63 @@ static struct event_format *alloc_event(void)
 	return calloc(1, sizeof(struct event_format));
 }
 
+/* Event ids are small, anything past this is only found in pevent->events */
+#define EVENT_IDS_MAX		(1 << 16)
+#define EVENT_NAME_HASH_BITS	10
+#define EVENT_NAME_HASH_SIZE	(1 << EVENT_NAME_HASH_BITS)
+
+static unsigned int event_name_hash(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 31 + *name++;
+
+	return hash & (EVENT_NAME_HASH_SIZE - 1);
+}
+
+/* Makes room in pevent->event_ids for @id */
+static int grow_event_ids(struct pevent *pevent, int id)
+{
+	struct event_format **ids;
+	int nr;
+
+	if (id < pevent->nr_event_ids)
+		return 0;
+
+	nr = pevent->nr_event_ids ? : 256;
+	while (nr <= id)
+		nr *= 2;
+	ids = realloc(pevent->event_ids, sizeof(*ids) * nr);
+	if (!ids)
+		return -1;
+	memset(ids + pevent->nr_event_ids, 0,
+	       sizeof(*ids) * (nr - pevent->nr_event_ids));
+	pevent->event_ids = ids;
+	pevent->nr_event_ids = nr;
+
+	return 0;
+}
+
 static int add_event(struct pevent *pevent, struct event_format *event)
 {
 	int i;
-	struct event_format **events = realloc(pevent->events, sizeof(event) *
-					       (pevent->nr_events + 1));
+	unsigned int key;
+	struct event_format **events;
+
+	if (event->id >= 0 && event->id < EVENT_IDS_MAX &&
+	    grow_event_ids(pevent, event->id) < 0)
+		return -1;
+
+	if (!pevent->event_names) {
+		pevent->event_names = calloc(EVENT_NAME_HASH_SIZE,
+					     sizeof(*pevent->event_names));
+		if (!pevent->event_names)
+			return -1;
+	}
+
+	events = realloc(pevent->events, sizeof(event) *
+			 (pevent->nr_events + 1));
 	if (!events)
 		return -1;
 
@@ -710,6 +824,14 @@ static int add_event(struct pevent *pevent, struct event_format *event)
 	pevent->events[i] = event;
 	pevent->nr_events++;
 
+	if (event->id >= 0 && event->id < EVENT_IDS_MAX &&
+	    !pevent->event_ids[event->id])
+		pevent->event_ids[event->id] = event;
+
+	key = event_name_hash(event->name);
+	event->next_name = pevent->event_names[key];
+	pevent->event_names[key] = event;
+
 	event->pevent = pevent;
 
 	return 0;
@@ -1566,6 +1688,8 @@ static int event_read_fields(struct event_format *event, struct format_field **f
 		} else
 			field->elementsize = field->size;
 
+		pevent_field_init_read(field);
+
 		*fields = field;
 		fields = &field->next;
 
@@ -2344,7 +2468,7 @@ static int arg_num_eval(struct print_arg *arg, long long *val)
 static char *arg_eval (struct print_arg *arg)
 {
 	long long val;
-	static char buf[20];
+	static __thread char buf[20];
 
 	switch (arg->type) {
 	case PRINT_ATOM:
@@ -3232,130 +3356,328 @@ int pevent_read_number_field(struct format_field *field, const void *data,
 	case 2:
 	case 4:
 	case 8:
-		*value = pevent_read_number(field->event->pevent,
-					    data + field->offset, field->size);
+		*value = pevent_field_number(field, data);
 		return 0;
 	default:
 		return -1;
 	}
 }
 
-static int get_common_info(struct pevent *pevent,
-			   const char *type, int *offset, int *size)
+/**
+ * pevent_read_number_field_bulk - read a number field from many records
+ * @field: the field to read
+ * @records: the records to read the field from, all of @field's event
+ * @nr_records: the number of @records
+ * @values: where to store the value read from each record
+ *
+ * Returns 0 on success, or -1 if @field is not a number.
+ */
+int pevent_read_number_field_bulk(struct format_field *field,
+				  struct pevent_record **records, int nr_records,
+				  unsigned long long *values)
 {
-	struct event_format *event;
-	struct format_field *field;
+	pevent_field_read_func read;
+	int offset;
+	int i;
 
-	/*
-	 * All events should have the same common elements.
-	 * Pick any event to find where the type is;
-	 */
-	if (!pevent->events) {
-		do_warning("no event_list!");
+	if (!field)
+		return -1;
+	switch (field->size) {
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		break;
+	default:
 		return -1;
 	}
 
-	event = pevent->events[0];
-	field = pevent_find_common_field(event, type);
-	if (!field)
-		return -1;
+	read = field->read_number;
+	offset = field->offset;
 
-	*offset = field->offset;
-	*size = field->size;
+	for (i = 0; i < nr_records; i++)
+		values[i] = read(records[i]->data + offset);
 
 	return 0;
 }
 
-static int __parse_common(struct pevent *pevent, void *data,
-			  int *size, int *offset, const char *name)
+static unsigned long long read_none(const void *ptr __maybe_unused)
 {
-	int ret;
-
-	if (!*size) {
-		ret = get_common_info(pevent, name, offset, size);
-		if (ret < 0)
-			return ret;
-	}
-	return pevent_read_number(pevent, data + *offset, *size);
+	return 0;
 }
 
-static int trace_parse_common_type(struct pevent *pevent, void *data)
+static unsigned long long read_u8(const void *ptr)
 {
-	return __parse_common(pevent, data,
-			      &pevent->type_size, &pevent->type_offset,
-			      "common_type");
+	return *(unsigned char *)ptr;
 }
 
-static int parse_common_pid(struct pevent *pevent, void *data)
+static unsigned long long read_s8(const void *ptr)
 {
-	return __parse_common(pevent, data,
-			      &pevent->pid_size, &pevent->pid_offset,
-			      "common_pid");
+	return *(signed char *)ptr;
 }
 
-static int parse_common_pc(struct pevent *pevent, void *data)
+static unsigned long long read_u16(const void *ptr)
 {
-	return __parse_common(pevent, data,
-			      &pevent->pc_size, &pevent->pc_offset,
-			      "common_preempt_count");
+	return *(unsigned short *)ptr;
 }
 
-static int parse_common_flags(struct pevent *pevent, void *data)
+static unsigned long long read_s16(const void *ptr)
 {
-	return __parse_common(pevent, data,
-			      &pevent->flags_size, &pevent->flags_offset,
-			      "common_flags");
+	return *(short *)ptr;
 }
 
-static int parse_common_lock_depth(struct pevent *pevent, void *data)
+static unsigned long long read_u16_swap(const void *ptr)
 {
-	return __parse_common(pevent, data,
-			      &pevent->ld_size, &pevent->ld_offset,
-			      "common_lock_depth");
+	return (unsigned short)__builtin_bswap16(*(unsigned short *)ptr);
 }
 
-static int parse_common_migrate_disable(struct pevent *pevent, void *data)
+static unsigned long long read_s16_swap(const void *ptr)
 {
-	return __parse_common(pevent, data,
-			      &pevent->ld_size, &pevent->ld_offset,
-			      "common_migrate_disable");
+	return (short)__builtin_bswap16(*(unsigned short *)ptr);
 }
 
-static int events_id_cmp(const void *a, const void *b);
+static unsigned long long read_u32(const void *ptr)
+{
+	return *(unsigned int *)ptr;
+}
 
-/**
- * pevent_find_event - find an event by given id
- * @pevent: a handle to the pevent
- * @id: the id of the event
- *
- * Returns an event that has a given @id.
- */
-struct event_format *pevent_find_event(struct pevent *pevent, int id)
+static unsigned long long read_s32(const void *ptr)
 {
-	struct event_format **eventptr;
-	struct event_format key;
-	struct event_format *pkey = &key;
+	return *(int *)ptr;
+}
 
-	/* Check cache first */
-	if (pevent->last_event && pevent->last_event->id == id)
-		return pevent->last_event;
+static unsigned long long read_u32_swap(const void *ptr)
+{
+	return (unsigned int)__builtin_bswap32(*(unsigned int *)ptr);
+}
 
-	key.id = id;
+static unsigned long long read_s32_swap(const void *ptr)
+{
+	return (int)__builtin_bswap32(*(unsigned int *)ptr);
+}
 
-	eventptr = bsearch(&pkey, pevent->events, pevent->nr_events,
-			   sizeof(*pevent->events), events_id_cmp);
+static unsigned long long read_u64(const void *ptr)
+{
+	unsigned long long val;
 
-	if (eventptr) {
-		pevent->last_event = *eventptr;
-		return *eventptr;
-	}
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
 
-	return NULL;
+static unsigned long long read_u64_swap(const void *ptr)
+{
+	return __builtin_bswap64(read_u64(ptr));
 }
 
 /**
- * pevent_find_event_by_name - find an event by given name
- * @pevent: a handle to the pevent
+ * pevent_field_init_read - pick the functions to read a field with
+ * @field: the field to set up
+ *
+ * Sets field->read_number and field->read_value to functions that read
+ * a field of its size and signedness, in the byte order of the pevent.
+ * This is done when the format of the field is parsed, and again by
+ * pevent_set_file_bigendian() and pevent_set_host_bigendian().
+ */
+void pevent_field_init_read(struct format_field *field)
+{
+	struct pevent *pevent = field->event ? field->event->pevent : NULL;
+	int is_signed = field->flags & FIELD_IS_SIGNED;
+	int swap = 0;
+
+	if (pevent)
+		swap = pevent->host_bigendian != pevent->file_bigendian;
+
+	switch (field->size) {
+	case 1:
+		field->read_number = read_u8;
+		field->read_value = is_signed ? read_s8 : read_u8;
+		break;
+	case 2:
+		field->read_number = swap ? read_u16_swap : read_u16;
+		if (is_signed)
+			field->read_value = swap ? read_s16_swap : read_s16;
+		else
+			field->read_value = field->read_number;
+		break;
+	case 4:
+		field->read_number = swap ? read_u32_swap : read_u32;
+		if (is_signed)
+			field->read_value = swap ? read_s32_swap : read_s32;
+		else
+			field->read_value = field->read_number;
+		break;
+	case 8:
+		field->read_number = swap ? read_u64_swap : read_u64;
+		field->read_value = field->read_number;
+		break;
+	default:
+		field->read_number = read_none;
+		field->read_value = read_none;
+	}
+}
+
+/* The byte order changed, read the fields of the parsed events with it */
+static void init_field_reads(struct pevent *pevent)
+{
+	struct format_field *field;
+	int i;
+
+	for (i = 0; i < pevent->nr_events; i++) {
+		for (field = pevent->events[i]->format.common_fields;
+		     field; field = field->next)
+			pevent_field_init_read(field);
+		for (field = pevent->events[i]->format.fields;
+		     field; field = field->next)
+			pevent_field_init_read(field);
+	}
+}
+
+/**
+ * pevent_set_file_bigendian - set the byte order of the trace data
+ * @pevent: a handle to the pevent
+ * @endian: non zero if the data is big endian
+ */
+void pevent_set_file_bigendian(struct pevent *pevent, int endian)
+{
+	pevent->file_bigendian = endian;
+	init_field_reads(pevent);
+}
+
+/**
+ * pevent_set_host_bigendian - set the byte order of the host
+ * @pevent: a handle to the pevent
+ * @endian: non zero if the host is big endian
+ */
+void pevent_set_host_bigendian(struct pevent *pevent, int endian)
+{
+	pevent->host_bigendian = endian;
+	init_field_reads(pevent);
+}
+
+static struct event_format *parse_lazy_id(struct pevent *pevent, int id);
+static void parse_lazy_name(struct pevent *pevent, const char *sys,
+			    const char *name);
+static void parse_lazy_any(struct pevent *pevent);
+
+static int get_common_info(struct pevent *pevent,
+			   const char *type, int *offset, int *size)
+{
+	struct event_format *event;
+	struct format_field *field;
+
+	if (!pevent->events && pevent->nr_lazy_left)
+		parse_lazy_any(pevent);
+
+	/*
+	 * All events should have the same common elements.
+	 * Pick any event to find where the type is;
+	 */
+	if (!pevent->events) {
+		do_warning("no event_list!");
+		return -1;
+	}
+
+	event = pevent->events[0];
+	field = pevent_find_common_field(event, type);
+	if (!field)
+		return -1;
+
+	*offset = field->offset;
+	*size = field->size;
+
+	return 0;
+}
+
+static int __parse_common(struct pevent *pevent, void *data,
+			  int *size, int *offset, const char *name)
+{
+	int ret;
+
+	if (!*size) {
+		ret = get_common_info(pevent, name, offset, size);
+		if (ret < 0)
+			return ret;
+	}
+	return pevent_read_number(pevent, data + *offset, *size);
+}
+
+static int trace_parse_common_type(struct pevent *pevent, void *data)
+{
+	return __parse_common(pevent, data,
+			      &pevent->type_size, &pevent->type_offset,
+			      "common_type");
+}
+
+static int parse_common_pid(struct pevent *pevent, void *data)
+{
+	return __parse_common(pevent, data,
+			      &pevent->pid_size, &pevent->pid_offset,
+			      "common_pid");
+}
+
+static int parse_common_pc(struct pevent *pevent, void *data)
+{
+	return __parse_common(pevent, data,
+			      &pevent->pc_size, &pevent->pc_offset,
+			      "common_preempt_count");
+}
+
+static int parse_common_flags(struct pevent *pevent, void *data)
+{
+	return __parse_common(pevent, data,
+			      &pevent->flags_size, &pevent->flags_offset,
+			      "common_flags");
+}
+
+static int parse_common_lock_depth(struct pevent *pevent, void *data)
+{
+	return __parse_common(pevent, data,
+			      &pevent->ld_size, &pevent->ld_offset,
+			      "common_lock_depth");
+}
+
+static int parse_common_migrate_disable(struct pevent *pevent, void *data)
+{
+	return __parse_common(pevent, data,
+			      &pevent->ld_size, &pevent->ld_offset,
+			      "common_migrate_disable");
+}
+
+static int events_id_cmp(const void *a, const void *b);
+
+/**
+ * pevent_find_event - find an event by given id
+ * @pevent: a handle to the pevent
+ * @id: the id of the event
+ *
+ * Returns an event that has a given @id.
+ */
+struct event_format *pevent_find_event(struct pevent *pevent, int id)
+{
+	struct event_format **eventptr;
+	struct event_format key;
+	struct event_format *pkey = &key;
+
+	if (id >= 0 && id < pevent->nr_event_ids) {
+		if (pevent->event_ids[id])
+			return pevent->event_ids[id];
+	} else if (id >= EVENT_IDS_MAX || id < 0) {
+		key.id = id;
+		eventptr = bsearch(&pkey, pevent->events, pevent->nr_events,
+				   sizeof(*pevent->events), events_id_cmp);
+		if (eventptr)
+			return *eventptr;
+	}
+
+	if (pevent->nr_lazy_left)
+		return parse_lazy_id(pevent, id);
+
+	return NULL;
+}
+
+/**
+ * pevent_find_event_by_name - find an event by given name
+ * @pevent: a handle to the pevent
  * @sys: the system name to search for
  * @name: the name of the event to search for
  *
@@ -3367,27 +3689,26 @@ pevent_find_event_by_name(struct pevent *pevent,
 			  const char *sys, const char *name)
 {
 	struct event_format *event;
-	int i;
+	struct event_format *found = NULL;
 
-	if (pevent->last_event &&
-	    strcmp(pevent->last_event->name, name) == 0 &&
-	    (!sys || strcmp(pevent->last_event->system, sys) == 0))
-		return pevent->last_event;
+	if (pevent->nr_lazy_left)
+		parse_lazy_name(pevent, sys, name);
 
-	for (i = 0; i < pevent->nr_events; i++) {
-		event = pevent->events[i];
-		if (strcmp(event->name, name) == 0) {
-			if (!sys)
-				break;
-			if (strcmp(event->system, sys) == 0)
-				break;
-		}
+	if (!pevent->event_names)
+		return NULL;
+
+	/* "First" is by id, as in pevent->events */
+	for (event = pevent->event_names[event_name_hash(name)]; event;
+	     event = event->next_name) {
+		if (strcmp(event->name, name) != 0)
+			continue;
+		if (sys && strcmp(event->system, sys) != 0)
+			continue;
+		if (!found || event->id < found->id)
+			found = event;
 	}
-	if (i == pevent->nr_events)
-		event = NULL;
 
-	pevent->last_event = event;
-	return event;
+	return found;
 }
 
 static unsigned long long
@@ -3415,8 +3736,7 @@ eval_num_arg(void *data, int size, struct event_format *event, struct print_arg
 			
 		}
 		/* must be a number */
-		val = pevent_read_number(pevent, data + arg->field.field->offset,
-				arg->field.field->size);
+		val = pevent_field_number(arg->field.field, data);
 		break;
 	case PRINT_FLAGS:
 	case PRINT_SYMBOL:
@@ -4666,64 +4986,570 @@ static void print_event_fields(struct trace_seq *s, void *data,
 	}
 }
 
-static void pretty_print(struct trace_seq *s, void *data, int size, struct event_format *event)
+static int print_num_to_seq(struct trace_seq *s, const char *format, int ls,
+			    int len_as_arg, int len_arg, unsigned long long val)
+{
+	switch (ls) {
+	case -2:
+		if (len_as_arg)
+			trace_seq_printf(s, format, len_arg, (char)val);
+		else
+			trace_seq_printf(s, format, (char)val);
+		break;
+	case -1:
+		if (len_as_arg)
+			trace_seq_printf(s, format, len_arg, (short)val);
+		else
+			trace_seq_printf(s, format, (short)val);
+		break;
+	case 0:
+		if (len_as_arg)
+			trace_seq_printf(s, format, len_arg, (int)val);
+		else
+			trace_seq_printf(s, format, (int)val);
+		break;
+	case 1:
+		if (len_as_arg)
+			trace_seq_printf(s, format, len_arg, (long)val);
+		else
+			trace_seq_printf(s, format, (long)val);
+		break;
+	case 2:
+		if (len_as_arg)
+			trace_seq_printf(s, format, len_arg, (long long)val);
+		else
+			trace_seq_printf(s, format, (long long)val);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The print format of an event does not change between records, so
+ * instead of scanning it for every record, it is compiled once into a
+ * list of ops: runs of literal text and the arguments to print, with
+ * the fields they read already looked up. Anything the compiler does
+ * not handle leaves the event to pretty_print()'s interpreter.
+ */
+enum print_op_type {
+	PRINT_OP_TEXT,
+	PRINT_OP_NUM,
+	PRINT_OP_STR,
+	PRINT_OP_FIELD_STR,
+	PRINT_OP_DYN_STR,
+	PRINT_OP_MAC,
+};
+
+struct print_op {
+	enum print_op_type	type;
+	char			*text;		/* literal text or printf format */
+	int			len;		/* length of literal text */
+	int			ls;		/* size of a number argument */
+	int			offset;		/* __data_loc of a dynamic string */
+	char			conv;		/* number converted without printf */
+	char			show_func;
+	char			mac;
+	struct print_arg	*arg;
+	struct print_arg	*len_arg;
+	struct format_field	*field;
+};
+
+struct print_prog {
+	struct print_op		*ops;
+	int			nr_ops;
+};
+
+static void free_print_prog(struct print_prog *prog)
+{
+	int i;
+
+	if (!prog)
+		return;
+
+	for (i = 0; i < prog->nr_ops; i++)
+		free(prog->ops[i].text);
+	free(prog->ops);
+	free(prog);
+}
+
+static struct print_op *add_print_op(struct print_prog *prog,
+				     enum print_op_type type)
+{
+	struct print_op *ops;
+
+	ops = realloc(prog->ops, sizeof(*ops) * (prog->nr_ops + 1));
+	if (!ops)
+		return NULL;
+	prog->ops = ops;
+	ops = &ops[prog->nr_ops++];
+	memset(ops, 0, sizeof(*ops));
+	ops->type = type;
+
+	return ops;
+}
+
+/* Move the literal text gathered so far into its own op */
+static int flush_print_text(struct print_prog *prog, struct trace_seq *text)
+{
+	struct print_op *op;
+
+	if (!text->len)
+		return 0;
+
+	op = add_print_op(prog, PRINT_OP_TEXT);
+	if (!op)
+		return -1;
+	op->text = malloc(text->len);
+	if (!op->text)
+		return -1;
+	memcpy(op->text, text->buffer, text->len);
+	op->len = text->len;
+	trace_seq_reset(text);
+
+	return 0;
+}
+
+static struct format_field *
+print_arg_field(struct event_format *event, struct print_arg *arg)
+{
+	if (arg->type != PRINT_FIELD)
+		return NULL;
+	if (!arg->field.field)
+		arg->field.field = pevent_find_any_field(event, arg->field.name);
+	return arg->field.field;
+}
+
+/*
+ * Compiles the print format of @event the way pretty_print() reads it.
+ * Returns NULL if the format has something that only the interpreter
+ * knows how to deal with (including how it fails).
+ */
+static struct print_prog *compile_print_fmt(struct event_format *event)
 {
 	struct pevent *pevent = event->pevent;
-	struct print_fmt *print_fmt = &event->print_fmt;
-	struct print_arg *arg = print_fmt->args;
-	struct print_arg *args = NULL;
-	const char *ptr = print_fmt->format;
-	unsigned long long val;
-	struct func_map *func;
+	struct print_arg *arg = event->print_fmt.args;
+	const char *ptr = event->print_fmt.format;
+	struct print_arg *len_arg;
+	struct format_field *field;
+	struct print_prog *prog;
+	struct print_op *op;
+	struct trace_seq text;
 	const char *saveptr;
-	struct trace_seq p;
-	char *bprint_fmt = NULL;
-	char format[32];
+	char *format;
 	int show_func;
-	int len_as_arg;
-	int len_arg;
+	int simple;
 	int len;
 	int ls;
 
-	if (event->flags & EVENT_FL_FAILED) {
-		trace_seq_printf(s, "[FAILED TO PARSE]");
-		print_event_fields(s, data, size, event);
-		return;
-	}
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return NULL;
 
-	if (event->flags & EVENT_FL_ISBPRINT) {
-		bprint_fmt = get_bprint_format(data, size, event);
-		args = make_bprint_args(bprint_fmt, data, size, event);
-		arg = args;
-		ptr = bprint_fmt;
-	}
+	trace_seq_init(&text);
 
 	for (; *ptr; ptr++) {
-		ls = 0;
 		if (*ptr == '\\') {
 			ptr++;
 			switch (*ptr) {
 			case 'n':
-				trace_seq_putc(s, '\n');
+				trace_seq_putc(&text, '\n');
 				break;
 			case 't':
-				trace_seq_putc(s, '\t');
+				trace_seq_putc(&text, '\t');
 				break;
 			case 'r':
-				trace_seq_putc(s, '\r');
-				break;
-			case '\\':
-				trace_seq_putc(s, '\\');
+				trace_seq_putc(&text, '\r');
 				break;
+			case '\0':
+				goto fail;
 			default:
-				trace_seq_putc(s, *ptr);
+				trace_seq_putc(&text, *ptr);
 				break;
 			}
+			continue;
+		}
 
-		} else if (*ptr == '%') {
-			saveptr = ptr;
-			show_func = 0;
-			len_as_arg = 0;
+		if (*ptr != '%') {
+			trace_seq_putc(&text, *ptr);
+			continue;
+		}
+
+		saveptr = ptr;
+		show_func = 0;
+		len_arg = NULL;
+		simple = 1;
+		ls = 0;
+ cont_process:
+		ptr++;
+		switch (*ptr) {
+		case '%':
+			trace_seq_putc(&text, '%');
+			break;
+		case 'h':
+			ls--;
+			goto cont_process;
+		case 'l':
+			ls++;
+			goto cont_process;
+		case 'L':
+			ls = 2;
+			goto cont_process;
+		case '*':
+			if (!arg)
+				goto fail;
+			len_arg = arg;
+			arg = arg->next;
+			simple = 0;
+			goto cont_process;
+		case '#':
+		case '.':
+		case 'z':
+		case 'Z':
+		case '0' ... '9':
+		case '-':
+			simple = 0;
+			goto cont_process;
+		case 'p':
+			if (pevent->long_size == 4)
+				ls = 1;
+			else
+				ls = 2;
+			simple = 0;
+
+			if (*(ptr+1) == 'F' || *(ptr+1) == 'f') {
+				ptr++;
+				show_func = *ptr;
+			} else if (*(ptr+1) == 'M' || *(ptr+1) == 'm') {
+				if (!arg || flush_print_text(prog, &text) < 0)
+					goto fail;
+				op = add_print_op(prog, PRINT_OP_MAC);
+				if (!op)
+					goto fail;
+				op->mac = *(ptr+1);
+				op->arg = arg;
+				ptr++;
+				arg = arg->next;
+				break;
+			} else if (*(ptr+1) == 'I' || *(ptr+1) == 'i') {
+				/* How much of the format is used depends on the arg */
+				goto fail;
+			}
+
+			/* fall through */
+		case 'd':
+		case 'i':
+		case 'x':
+		case 'X':
+		case 'u':
+			len = ((unsigned long)ptr + 1) - (unsigned long)saveptr;
+			if (!arg || len > 31)
+				goto fail;
+
+			/* an extra byte in case %l becomes %ll */
+			format = malloc(len + 2);
+			if (!format)
+				goto fail;
+			memcpy(format, saveptr, len);
+			format[len] = 0;
+
+			if (pevent->long_size == 8 && ls &&
+			    sizeof(long) != 8) {
+				char *p;
+
+				ls = 2;
+				/* make %l into %ll */
+				p = strchr(format, 'l');
+				if (p)
+					memmove(p+1, p, strlen(p)+1);
+				else if (strcmp(format, "%p") == 0) {
+					free(format);
+					format = strdup("0x%llx");
+					if (!format)
+						goto fail;
+				}
+			}
+
+			if (ls < -2 || ls > 2 ||
+			    flush_print_text(prog, &text) < 0) {
+				free(format);
+				goto fail;
+			}
+			op = add_print_op(prog, PRINT_OP_NUM);
+			if (!op) {
+				free(format);
+				goto fail;
+			}
+			op->text = format;
+			op->ls = ls;
+			op->show_func = show_func;
+			op->arg = arg;
+			op->len_arg = len_arg;
+			op->field = print_arg_field(event, arg);
+			if (simple)
+				op->conv = *ptr;
+			arg = arg->next;
+			break;
+		case 's':
+			len = ((unsigned long)ptr + 1) - (unsigned long)saveptr;
+			if (!arg || len > 31 ||
+			    flush_print_text(prog, &text) < 0)
+				goto fail;
+
+			op = add_print_op(prog, PRINT_OP_STR);
+			if (!op)
+				goto fail;
+			op->text = malloc(len + 1);
+			if (!op->text)
+				goto fail;
+			memcpy(op->text, saveptr, len);
+			op->text[len] = 0;
+			op->arg = arg;
+			op->len_arg = len_arg;
+			arg = arg->next;
+
+			if (!simple || ls)
+				break;
+
+			/* Plain "%s" of a string in the record is copied as is */
+			field = print_arg_field(event, op->arg);
+			if (field && ((field->flags & FIELD_IS_ARRAY) ||
+				      field->size != pevent->long_size)) {
+				op->type = PRINT_OP_FIELD_STR;
+				op->field = field;
+			} else if (op->arg->type == PRINT_STRING) {
+				if (op->arg->string.offset == -1) {
+					field = pevent_find_any_field(event,
+							op->arg->string.string);
+					if (!field)
+						break;
+					op->arg->string.offset = field->offset;
+				}
+				op->type = PRINT_OP_DYN_STR;
+				op->offset = op->arg->string.offset;
+			}
+			break;
+		case '\0':
+			goto fail;
+		default:
+			trace_seq_printf(&text, ">%c<", *ptr);
+		}
+	}
+
+	if (flush_print_text(prog, &text) < 0)
+		goto fail;
+	trace_seq_destroy(&text);
+
+	return prog;
+
+ fail:
+	trace_seq_destroy(&text);
+	free_print_prog(prog);
+	return NULL;
+}
+
+/* What printf() would show for @val with %d, %i, %u, %x or %X of size @ls */
+static void print_num_conv(struct trace_seq *s, unsigned long long val,
+			   int ls, char conv)
+{
+	const char *digits = "0123456789abcdef";
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	int is_signed = conv == 'd' || conv == 'i';
+	int neg = 0;
+	int bits;
+
+	switch (ls) {
+	case -2:
+		bits = 8;
+		break;
+	case -1:
+		bits = 16;
+		break;
+	case 0:
+		bits = 32;
+		break;
+	case 1:
+		bits = sizeof(long) * 8;
+		break;
+	default:
+		bits = 64;
+	}
+
+	if (bits < 64) {
+		if (is_signed && (val & (1ULL << (bits - 1))))
+			val |= ~0ULL << bits;
+		else
+			val &= (1ULL << bits) - 1;
+	}
+
+	if (is_signed && (long long)val < 0) {
+		neg = 1;
+		val = -val;
+	}
+
+	if (conv == 'x' || conv == 'X') {
+		if (conv == 'X')
+			digits = "0123456789ABCDEF";
+		do {
+			*--p = digits[val & 0xf];
+			val >>= 4;
+		} while (val);
+	} else {
+		do {
+			*--p = '0' + val % 10;
+			val /= 10;
+		} while (val);
+	}
+	if (neg)
+		*--p = '-';
+
+	trace_seq_putmem(s, p, buf + sizeof(buf) - p);
+}
+
+static void run_print_prog(struct trace_seq *s, void *data, int size,
+			   struct event_format *event, struct print_prog *prog)
+{
+	struct pevent *pevent = event->pevent;
+	struct print_op *op = prog->ops;
+	struct print_op *end = op + prog->nr_ops;
+	unsigned long long val;
+	struct func_map *func;
+	unsigned int start;
+	char *str;
+	int len_arg;
+	int len;
+
+	for (; op < end; op++) {
+		len_arg = -1;
+		if (op->len_arg)
+			len_arg = eval_num_arg(data, size, event, op->len_arg);
+
+		switch (op->type) {
+		case PRINT_OP_TEXT:
+			trace_seq_putmem(s, op->text, op->len);
+			break;
+		case PRINT_OP_NUM:
+			if (op->field)
+				val = pevent_field_number(op->field, data);
+			else
+				val = eval_num_arg(data, size, event, op->arg);
+
+			if (op->show_func) {
+				func = find_func(pevent, val);
+				if (func) {
+					trace_seq_puts(s, func->func);
+					if (op->show_func == 'F')
+						trace_seq_printf(s, "+0x%llx",
+								 val - func->addr);
+					break;
+				}
+			}
+			if (op->conv)
+				print_num_conv(s, val, op->ls, op->conv);
+			else
+				print_num_to_seq(s, op->text, op->ls,
+						 op->len_arg != NULL, len_arg, val);
+			break;
+		case PRINT_OP_FIELD_STR:
+			/* Zero sized fields, mean the rest of the data */
+			len = op->field->size ? : size - op->field->offset;
+			if (len < 0)
+				break;
+			str = data + op->field->offset;
+			trace_seq_putmem(s, str, strnlen(str, len));
+			break;
+		case PRINT_OP_DYN_STR:
+			len = data2host4(pevent, data + op->offset) & 0xffff;
+			trace_seq_puts(s, (char *)data + len);
+			break;
+		case PRINT_OP_STR:
+			/* The string ends at the first nul, as with a helper seq */
+			start = s->len;
+			print_str_arg(s, data, size, event, op->text,
+				      len_arg, op->arg);
+			str = memchr(s->buffer + start, 0, s->len - start);
+			if (str)
+				s->len = str - s->buffer;
+			break;
+		case PRINT_OP_MAC:
+			print_mac_arg(s, op->mac, data, size, event, op->arg);
+			break;
+		}
+	}
+}
+
+static void pretty_print(struct trace_seq *s, void *data, int size, struct event_format *event)
+{
+	struct pevent *pevent = event->pevent;
+	struct print_fmt *print_fmt = &event->print_fmt;
+	struct print_arg *arg = print_fmt->args;
+	struct print_arg *args = NULL;
+	const char *ptr = print_fmt->format;
+	unsigned long long val;
+	struct func_map *func;
+	const char *saveptr;
+	struct trace_seq p;
+	char *bprint_fmt = NULL;
+	char format[32];
+	int show_func;
+	int len_as_arg;
+	int len_arg;
+	int len;
+	int ls;
+
+	if (event->flags & EVENT_FL_FAILED) {
+		trace_seq_printf(s, "[FAILED TO PARSE]");
+		print_event_fields(s, data, size, event);
+		return;
+	}
+
+	if (!(event->flags & (EVENT_FL_ISBPRINT | EVENT_FL_NOPROG))) {
+		if (!event->print_prog) {
+			event->print_prog = compile_print_fmt(event);
+			if (!event->print_prog)
+				event->flags |= EVENT_FL_NOPROG;
+		}
+		if (event->print_prog) {
+			run_print_prog(s, data, size, event, event->print_prog);
+			return;
+		}
+	}
+
+	if (event->flags & EVENT_FL_ISBPRINT) {
+		bprint_fmt = get_bprint_format(data, size, event);
+		args = make_bprint_args(bprint_fmt, data, size, event);
+		arg = args;
+		ptr = bprint_fmt;
+	}
+
+	for (; *ptr; ptr++) {
+		ls = 0;
+		if (*ptr == '\\') {
+			ptr++;
+			switch (*ptr) {
+			case 'n':
+				trace_seq_putc(s, '\n');
+				break;
+			case 't':
+				trace_seq_putc(s, '\t');
+				break;
+			case 'r':
+				trace_seq_putc(s, '\r');
+				break;
+			case '\\':
+				trace_seq_putc(s, '\\');
+				break;
+			default:
+				trace_seq_putc(s, *ptr);
+				break;
+			}
+
+		} else if (*ptr == '%') {
+			saveptr = ptr;
+			show_func = 0;
+			len_as_arg = 0;
  cont_process:
 			ptr++;
 			switch (*ptr) {
@@ -4836,39 +5662,8 @@ static void pretty_print(struct trace_seq *s, void *data, int size, struct event
 					else if (strcmp(format, "%p") == 0)
 						strcpy(format, "0x%llx");
 				}
-				switch (ls) {
-				case -2:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (char)val);
-					else
-						trace_seq_printf(s, format, (char)val);
-					break;
-				case -1:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (short)val);
-					else
-						trace_seq_printf(s, format, (short)val);
-					break;
-				case 0:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (int)val);
-					else
-						trace_seq_printf(s, format, (int)val);
-					break;
-				case 1:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg, (long)val);
-					else
-						trace_seq_printf(s, format, (long)val);
-					break;
-				case 2:
-					if (len_as_arg)
-						trace_seq_printf(s, format, len_arg,
-								 (long long)val);
-					else
-						trace_seq_printf(s, format, (long long)val);
-					break;
-				default:
+				if (print_num_to_seq(s, format, ls, len_as_arg,
+						     len_arg, val) < 0) {
 					do_warning_event(event, "bad count (%d)", ls);
 					event->flags |= EVENT_FL_FAILED;
 				}
@@ -5057,22 +5852,6 @@ const char *pevent_data_comm_from_pid(struct pevent *pevent, int pid)
 	return comm;
 }
 
-static struct cmdline *
-pid_from_cmdlist(struct pevent *pevent, const char *comm, struct cmdline *next)
-{
-	struct cmdline_list *cmdlist = (struct cmdline_list *)next;
-
-	if (cmdlist)
-		cmdlist = cmdlist->next;
-	else
-		cmdlist = pevent->cmdlist;
-
-	while (cmdlist && strcmp(cmdlist->comm, comm) != 0)
-		cmdlist = cmdlist->next;
-
-	return (struct cmdline *)cmdlist;
-}
-
 /**
  * pevent_data_pid_from_comm - return the pid from a given comm
  * @pevent: a handle to the pevent
@@ -5091,34 +5870,15 @@ struct cmdline *pevent_data_pid_from_comm(struct pevent *pevent, const char *com
 {
 	struct cmdline *cmdline;
 
-	/*
-	 * If the cmdlines have not been converted yet, then use
-	 * the list.
-	 */
-	if (!pevent->cmdlines)
-		return pid_from_cmdlist(pevent, comm, next);
-
-	if (next) {
-		/*
-		 * The next pointer could have been still from
-		 * a previous call before cmdlines were created
-		 */
-		if (next < pevent->cmdlines ||
-		    next >= pevent->cmdlines + pevent->cmdline_count)
-			next = NULL;
-		else
-			cmdline  = next++;
-	}
+	if (next)
+		cmdline = next->next;
+	else
+		cmdline = pevent->cmdlist;
 
-	if (!next)
-		cmdline = pevent->cmdlines;
+	while (cmdline && strcmp(cmdline->comm, comm) != 0)
+		cmdline = cmdline->next;
 
-	while (cmdline < pevent->cmdlines + pevent->cmdline_count) {
-		if (strcmp(cmdline->comm, comm) == 0)
-			return cmdline;
-		cmdline++;
-	}
-	return NULL;
+	return cmdline;
 }
 
 /**
@@ -5130,20 +5890,9 @@ struct cmdline *pevent_data_pid_from_comm(struct pevent *pevent, const char *com
  */
 int pevent_cmdline_pid(struct pevent *pevent, struct cmdline *cmdline)
 {
-	struct cmdline_list *cmdlist = (struct cmdline_list *)cmdline;
-
 	if (!cmdline)
 		return -1;
 
-	/*
-	 * If cmdlines have not been created yet, or cmdline is
-	 * not part of the array, then treat it as a cmdlist instead.
-	 */
-	if (!pevent->cmdlines ||
-	    cmdline < pevent->cmdlines ||
-	    cmdline >= pevent->cmdlines + pevent->cmdline_count)
-		return cmdlist->pid;
-
 	return cmdline->pid;
 }
 
@@ -5311,6 +6060,8 @@ struct event_format **pevent_list_events(struct pevent *pevent, enum event_sort_
 	struct event_format **events;
 	int (*sort)(const void *a, const void *b);
 
+	pevent_parse_lazy_events(pevent);
+
 	events = pevent->sort_events;
 
 	if (events && pevent->last_type == sort_type)
@@ -5663,7 +6414,8 @@ static void free_handler(struct event_handler *handle)
 	free(handle);
 }
 
-static int find_event_handle(struct pevent *pevent, struct event_format *event)
+static struct event_handler **
+event_handle_ptr(struct pevent *pevent, struct event_format *event)
 {
 	struct event_handler *handle, **next;
 
@@ -5676,8 +6428,17 @@ static int find_event_handle(struct pevent *pevent, struct event_format *event)
 			break;
 	}
 
+	return next;
+}
+
+static int find_event_handle(struct pevent *pevent, struct event_format *event)
+{
+	struct event_handler *handle, **next;
+
+	next = event_handle_ptr(pevent, event);
 	if (!(*next))
 		return 0;
+	handle = *next;
 
 	pr_stat("overriding event (%d) %s:%s with new print handler",
 		event->id, event->system, event->name);
@@ -5691,22 +6452,14 @@ static int find_event_handle(struct pevent *pevent, struct event_format *event)
 	return 1;
 }
 
-/**
- * __pevent_parse_format - parse the event format
- * @buf: the buffer storing the event format string
- * @size: the size of @buf
- * @sys: the system the event belongs to
- *
- * This parses the event format and creates an event structure
- * to quickly parse raw data for a given event.
- *
- * These files currently come from:
- *
- * /sys/kernel/debug/tracing/events/.../.../format
+/*
+ * Parses the format without changing @pevent, so that it may be run
+ * on several threads at once. The print handler registered for the
+ * event, if any, is claimed afterwards by claim_event_handle().
  */
-enum pevent_errno __pevent_parse_format(struct event_format **eventp,
-					struct pevent *pevent, const char *buf,
-					unsigned long size, const char *sys)
+static enum pevent_errno parse_format(struct event_format **eventp,
+				      struct pevent *pevent, const char *buf,
+				      unsigned long size, const char *sys)
 {
 	struct event_format *event;
 	int ret;
@@ -5760,7 +6513,7 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 	 * If the event has an override, don't print warnings if the event
 	 * print format fails to parse.
 	 */
-	if (pevent && find_event_handle(pevent, event))
+	if (pevent && *event_handle_ptr(pevent, event))
 		show_warning = 0;
 
 	ret = event_read_print(event);
@@ -5811,15 +6564,44 @@ enum pevent_errno __pevent_parse_format(struct event_format **eventp,
 	return ret;
 }
 
-static enum pevent_errno
-__pevent_parse_event(struct pevent *pevent,
-		     struct event_format **eventp,
-		     const char *buf, unsigned long size,
-		     const char *sys)
+static void claim_event_handle(struct pevent *pevent,
+			       struct event_format *event,
+			       enum pevent_errno ret)
 {
-	int ret = __pevent_parse_format(eventp, pevent, buf, size, sys);
-	struct event_format *event = *eventp;
+	/* Only events that got as far as their print format have one */
+	if (pevent && event && ret != PEVENT_ERRNO__READ_FORMAT_FAILED)
+		find_event_handle(pevent, event);
+}
 
+/**
+ * __pevent_parse_format - parse the event format
+ * @buf: the buffer storing the event format string
+ * @size: the size of @buf
+ * @sys: the system the event belongs to
+ *
+ * This parses the event format and creates an event structure
+ * to quickly parse raw data for a given event.
+ *
+ * These files currently come from:
+ *
+ * /sys/kernel/debug/tracing/events/.../.../format
+ */
+enum pevent_errno __pevent_parse_format(struct event_format **eventp,
+					struct pevent *pevent, const char *buf,
+					unsigned long size, const char *sys)
+{
+	enum pevent_errno ret;
+
+	ret = parse_format(eventp, pevent, buf, size, sys);
+	claim_event_handle(pevent, *eventp, ret);
+
+	return ret;
+}
+
+static enum pevent_errno
+add_parsed_event(struct pevent *pevent, struct event_format *event,
+		 enum pevent_errno ret)
+{
 	if (event == NULL)
 		return ret;
 
@@ -5839,6 +6621,17 @@ event_add_failed:
 	return ret;
 }
 
+static enum pevent_errno
+__pevent_parse_event(struct pevent *pevent,
+		     struct event_format **eventp,
+		     const char *buf, unsigned long size,
+		     const char *sys)
+{
+	int ret = __pevent_parse_format(eventp, pevent, buf, size, sys);
+
+	return add_parsed_event(pevent, *eventp, ret);
+}
+
 /**
  * pevent_parse_format - parse the event format
  * @pevent: the handle to the pevent
@@ -5883,6 +6676,475 @@ enum pevent_errno pevent_parse_event(struct pevent *pevent, const char *buf,
 	return __pevent_parse_event(pevent, &event, buf, size, sys);
 }
 
+struct lazy_event {
+	int			id;
+	char			*name;
+	char			*system;
+	char			*buf;
+	unsigned long		size;
+};
+
+/*
+ * Get the name and id from the start of a format, without parsing
+ * the rest of it. Returns -1 if they are not in the expected form,
+ * then the format is parsed right away instead.
+ */
+static int lazy_event_info(const char *buf, unsigned long size,
+			   char **name, int *id)
+{
+	const char *end = buf + size;
+	const char *line;
+	const char *eol;
+	const char *p;
+	int found_id = 0;
+
+	*name = NULL;
+	*id = 0;
+
+	for (line = buf; line < end && (!*name || !found_id); line = eol + 1) {
+		eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
+
+		if (eol - line > 6 && strncmp(line, "name: ", 6) == 0) {
+			for (p = line + 6; p < eol; p++) {
+				if (!isalnum(*p) && *p != '_')
+					break;
+			}
+			if (p != eol || *name)
+				break;
+			*name = strndup(line + 6, eol - (line + 6));
+			if (!*name)
+				break;
+		} else if (eol - line > 4 && strncmp(line, "ID: ", 4) == 0) {
+			for (p = line + 4; p < eol && isdigit(*p); p++)
+				*id = *id * 10 + *p - '0';
+			if (p != eol || p == line + 4)
+				break;
+			found_id = 1;
+		} else
+			break;
+	}
+
+	if (*name && found_id)
+		return 0;
+
+	free(*name);
+	*name = NULL;
+	return -1;
+}
+
+/*
+ * Adds an event parsed from @lazy by parse_format() to @pevent.
+ * The format is parsed long after the file was read, so say which
+ * event the warnings of the parser were about. As when parsing it
+ * right away, a bad print format of an event that a plugin prints
+ * is not warned about.
+ */
+static struct event_format *
+add_lazy_event(struct pevent *pevent, struct lazy_event *lazy,
+	       struct event_format *event, enum pevent_errno ret)
+{
+	char err[128];
+
+	claim_event_handle(pevent, event, ret);
+
+	if (ret && !(ret == PEVENT_ERRNO__READ_PRINT_FAILED &&
+		     event && event->handler)) {
+		pevent_strerror(pevent, ret, err, sizeof(err));
+		do_warning("failed to parse event %s:%s: %s",
+			   lazy->system, lazy->name, err);
+	}
+	if (add_parsed_event(pevent, event, ret))
+		pevent->parsing_failures = 1;
+
+	free(lazy->buf);
+	free(lazy->name);
+	free(lazy->system);
+	lazy->buf = NULL;
+	lazy->name = NULL;
+	lazy->system = NULL;
+	pevent->nr_lazy_left--;
+
+	return event;
+}
+
+static struct event_format *
+parse_lazy_event(struct pevent *pevent, struct lazy_event *lazy)
+{
+	struct event_format *event = NULL;
+	enum pevent_errno ret;
+
+	if (!lazy->buf)
+		return NULL;
+
+	ret = parse_format(&event, pevent, lazy->buf, lazy->size,
+			   lazy->system);
+
+	return add_lazy_event(pevent, lazy, event, ret);
+}
+
+static int lazy_id_cmp(const void *a, const void *b)
+{
+	const struct lazy_event *la = a;
+	const struct lazy_event *lb = b;
+
+	if (la->id < lb->id)
+		return -1;
+	if (la->id > lb->id)
+		return 1;
+	return 0;
+}
+
+static struct event_format *parse_lazy_id(struct pevent *pevent, int id)
+{
+	struct lazy_event *lazy;
+	struct lazy_event key;
+
+	if (!pevent->lazy_sorted) {
+		qsort(pevent->lazy_events, pevent->nr_lazy_events,
+		      sizeof(*pevent->lazy_events), lazy_id_cmp);
+		pevent->lazy_sorted = 1;
+	}
+
+	key.id = id;
+	lazy = bsearch(&key, pevent->lazy_events, pevent->nr_lazy_events,
+		       sizeof(*pevent->lazy_events), lazy_id_cmp);
+	if (!lazy)
+		return NULL;
+
+	return parse_lazy_event(pevent, lazy);
+}
+
+static void parse_lazy_name(struct pevent *pevent, const char *sys,
+			    const char *name)
+{
+	struct lazy_event *lazy;
+	int i;
+
+	for (i = 0; i < pevent->nr_lazy_events; i++) {
+		lazy = &pevent->lazy_events[i];
+		if (!lazy->buf || strcmp(lazy->name, name) != 0)
+			continue;
+		if (!sys || strcmp(lazy->system, sys) == 0)
+			parse_lazy_event(pevent, lazy);
+	}
+}
+
+static void parse_lazy_any(struct pevent *pevent)
+{
+	int i;
+
+	for (i = 0; i < pevent->nr_lazy_events; i++) {
+		if (pevent->lazy_events[i].buf) {
+			parse_lazy_event(pevent, &pevent->lazy_events[i]);
+			return;
+		}
+	}
+}
+
+/**
+ * pevent_parse_event_lazy - save an event format to parse on first use
+ * @pevent: the handle to the pevent
+ * @buf: the buffer storing the event format string
+ * @size: the size of @buf
+ * @sys: the system the event belongs to
+ *
+ * Like pevent_parse_event(), but only the name and id of the event
+ * are read now. The format is parsed the first time the event is
+ * looked up, or when all events are listed. Failures to parse are
+ * then reported in pevent->parsing_failures.
+ */
+enum pevent_errno pevent_parse_event_lazy(struct pevent *pevent, const char *buf,
+					  unsigned long size, const char *sys)
+{
+	struct lazy_event *lazy;
+	char *name;
+	int id;
+
+	if (lazy_event_info(buf, size, &name, &id) < 0)
+		return pevent_parse_event(pevent, buf, size, sys);
+
+	if (!(pevent->nr_lazy_events % 64)) {
+		lazy = realloc(pevent->lazy_events, sizeof(*lazy) *
+			       (pevent->nr_lazy_events + 64));
+		if (!lazy)
+			goto fail;
+		pevent->lazy_events = lazy;
+	}
+
+	lazy = &pevent->lazy_events[pevent->nr_lazy_events];
+	lazy->id = id;
+	lazy->name = name;
+	lazy->size = size;
+	lazy->system = strdup(sys);
+	lazy->buf = malloc(size);
+	if (!lazy->system || !lazy->buf) {
+		free(lazy->system);
+		free(lazy->buf);
+		goto fail;
+	}
+	memcpy(lazy->buf, buf, size);
+
+	pevent->nr_lazy_events++;
+	pevent->nr_lazy_left++;
+	pevent->lazy_sorted = 0;
+
+	return 0;
+
+ fail:
+	free(name);
+	return PEVENT_ERRNO__MEM_ALLOC_FAILED;
+}
+
+/* Parsing fewer formats than this is not worth starting threads for */
+#define LAZY_PARSE_MIN		64
+#define LAZY_PARSE_THREADS	8
+
+struct lazy_parse {
+	struct pevent		*pevent;
+	struct event_format	**events;
+	enum pevent_errno	*rets;
+	int			next;
+};
+
+static void *lazy_parse_thread(void *data)
+{
+	struct lazy_parse *parse = data;
+	struct pevent *pevent = parse->pevent;
+	struct lazy_event *lazy;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&parse->next, 1)) <
+	       pevent->nr_lazy_events) {
+		lazy = &pevent->lazy_events[i];
+		if (!lazy->buf)
+			continue;
+		parse->rets[i] = parse_format(&parse->events[i], pevent,
+					      lazy->buf, lazy->size,
+					      lazy->system);
+	}
+
+	return NULL;
+}
+
+/*
+ * Parses the formats saved for later on several threads. Only the
+ * parsing is done in parallel, the events are added to @pevent in the
+ * same order as parsing them one by one would.
+ */
+static int parse_lazy_threaded(struct pevent *pevent)
+{
+	pthread_t threads[LAZY_PARSE_THREADS];
+	struct lazy_parse parse;
+	long nr_threads;
+	int started;
+	int i;
+
+	nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_threads > LAZY_PARSE_THREADS)
+		nr_threads = LAZY_PARSE_THREADS;
+	if (nr_threads < 2)
+		return -1;
+
+	parse.pevent = pevent;
+	parse.next = 0;
+	parse.events = calloc(pevent->nr_lazy_events, sizeof(*parse.events));
+	parse.rets = calloc(pevent->nr_lazy_events, sizeof(*parse.rets));
+	if (!parse.events || !parse.rets) {
+		free(parse.events);
+		free(parse.rets);
+		return -1;
+	}
+
+	/* This thread does its share too */
+	for (started = 0; started < nr_threads - 1; started++) {
+		if (pthread_create(&threads[started], NULL,
+				   lazy_parse_thread, &parse))
+			break;
+	}
+	lazy_parse_thread(&parse);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < pevent->nr_lazy_events; i++) {
+		if (pevent->lazy_events[i].buf)
+			add_lazy_event(pevent, &pevent->lazy_events[i],
+				       parse.events[i], parse.rets[i]);
+	}
+
+	free(parse.events);
+	free(parse.rets);
+
+	return 0;
+}
+
+/**
+ * pevent_parse_lazy_events - parse the formats saved to parse later
+ * @pevent: the handle to the pevent
+ *
+ * Parses all formats added with pevent_parse_event_lazy() that were
+ * not used yet. This is needed before walking all the events.
+ */
+void pevent_parse_lazy_events(struct pevent *pevent)
+{
+	int i;
+
+	if (pevent->nr_lazy_left >= LAZY_PARSE_MIN &&
+	    parse_lazy_threaded(pevent) == 0)
+		return;
+
+	for (i = 0; pevent->nr_lazy_left && i < pevent->nr_lazy_events; i++)
+		parse_lazy_event(pevent, &pevent->lazy_events[i]);
+}
+
+static void resolve_print_arg(struct event_format *event,
+			      struct print_arg *arg)
+{
+	struct format_field *field;
+	struct print_arg *farg;
+
+	if (!arg)
+		return;
+
+	switch (arg->type) {
+	case PRINT_FIELD:
+		if (!arg->field.field)
+			arg->field.field =
+				pevent_find_any_field(event, arg->field.name);
+		break;
+	case PRINT_FLAGS:
+		resolve_print_arg(event, arg->flags.field);
+		break;
+	case PRINT_SYMBOL:
+		resolve_print_arg(event, arg->symbol.field);
+		break;
+	case PRINT_HEX:
+		resolve_print_arg(event, arg->hex.field);
+		resolve_print_arg(event, arg->hex.size);
+		break;
+	case PRINT_INT_ARRAY:
+		resolve_print_arg(event, arg->int_array.field);
+		resolve_print_arg(event, arg->int_array.count);
+		resolve_print_arg(event, arg->int_array.el_size);
+		break;
+	case PRINT_TYPE:
+		resolve_print_arg(event, arg->typecast.item);
+		break;
+	case PRINT_STRING:
+		if (arg->string.offset == -1) {
+			field = pevent_find_any_field(event, arg->string.string);
+			if (field)
+				arg->string.offset = field->offset;
+		}
+		break;
+	case PRINT_BITMASK:
+		if (arg->bitmask.offset == -1) {
+			field = pevent_find_any_field(event, arg->bitmask.bitmask);
+			if (field)
+				arg->bitmask.offset = field->offset;
+		}
+		break;
+	case PRINT_OP:
+		resolve_print_arg(event, arg->op.left);
+		resolve_print_arg(event, arg->op.right);
+		break;
+	case PRINT_FUNC:
+		for (farg = arg->func.args; farg; farg = farg->next)
+			resolve_print_arg(event, farg);
+		break;
+	default:
+		break;
+	}
+}
+
+static void prepare_event_print(struct event_format *event)
+{
+	struct pevent *pevent = event->pevent;
+	struct format_field *ip_field;
+	struct format_field *field;
+	struct print_arg *arg;
+
+	for (field = event->format.common_fields; field; field = field->next)
+		if (!field->read_number)
+			pevent_field_init_read(field);
+	for (field = event->format.fields; field; field = field->next)
+		if (!field->read_number)
+			pevent_field_init_read(field);
+
+	for (arg = event->print_fmt.args; arg; arg = arg->next)
+		resolve_print_arg(event, arg);
+
+	if (event->flags & EVENT_FL_FAILED)
+		return;
+
+	if (event->flags & EVENT_FL_ISBPRINT) {
+		if (!pevent->bprint_buf_field) {
+			field = pevent_find_field(event, "buf");
+			ip_field = pevent_find_field(event, "ip");
+			if (field && ip_field) {
+				pevent->bprint_buf_field = field;
+				pevent->bprint_ip_field = ip_field;
+			}
+		}
+		if (!pevent->bprint_fmt_field)
+			pevent->bprint_fmt_field = pevent_find_field(event, "fmt");
+		return;
+	}
+
+	if (!(event->flags & EVENT_FL_NOPROG) && !event->print_prog) {
+		event->print_prog = compile_print_fmt(event);
+		if (!event->print_prog)
+			event->flags |= EVENT_FL_NOPROG;
+	}
+}
+
+/**
+ * pevent_prepare_print_threads - get ready to print from several threads
+ * @pevent: the handle to the pevent
+ *
+ * Printing an event fills in a few things on first use: lazily
+ * parsed formats, the function and printk maps, the common field
+ * offsets, field readers and compiled print formats. This does all
+ * of that up front, after which pevent_print_event() only reads the
+ * pevent and may be called from several threads at once (as long as
+ * no event handler registers new comms, functions or events).
+ *
+ * Returns 0 on success, -1 if it ran out of memory.
+ */
+int pevent_prepare_print_threads(struct pevent *pevent)
+{
+	int i;
+
+	pevent_parse_lazy_events(pevent);
+
+	if (!pevent->func_index && func_map_init(pevent))
+		return -1;
+	if (!pevent->printk_map && printk_map_init(pevent))
+		return -1;
+
+	if (!pevent->nr_events)
+		return 0;
+
+	if (!pevent->type_size)
+		get_common_info(pevent, "common_type",
+				&pevent->type_offset, &pevent->type_size);
+	if (!pevent->pid_size)
+		get_common_info(pevent, "common_pid",
+				&pevent->pid_offset, &pevent->pid_size);
+	if (!pevent->pc_size)
+		get_common_info(pevent, "common_preempt_count",
+				&pevent->pc_offset, &pevent->pc_size);
+	if (!pevent->flags_size)
+		get_common_info(pevent, "common_flags",
+				&pevent->flags_offset, &pevent->flags_size);
+
+	for (i = 0; i < pevent->nr_events; i++)
+		prepare_event_print(pevent->events[i]);
+
+	return 0;
+}
+
 #undef _PE
 #define _PE(code, str) str
 static const char * const pevent_error_str[] = {
@@ -6480,6 +7742,7 @@ void pevent_free_format(struct event_format *event)
 
 	free(event->print_fmt.format);
 	free_args(event->print_fmt.args);
+	free_print_prog(event->print_prog);
 
 	free(event);
 }
@@ -6490,8 +7753,8 @@ void pevent_free_format(struct event_format *event)
  */
 void pevent_free(struct pevent *pevent)
 {
-	struct cmdline_list *cmdlist, *cmdnext;
-	struct func_list *funclist, *funcnext;
+	struct cmdline *cmdlist, *cmdnext;
+	struct func_strings *strings, *strings_next;
 	struct printk_list *printklist, *printknext;
 	struct pevent_function_handler *func_handler;
 	struct event_handler *handle;
@@ -6501,18 +7764,13 @@ void pevent_free(struct pevent *pevent)
 		return;
 
 	cmdlist = pevent->cmdlist;
-	funclist = pevent->funclist;
 	printklist = pevent->printklist;
 
 	pevent->ref_count--;
 	if (pevent->ref_count)
 		return;
 
-	if (pevent->cmdlines) {
-		for (i = 0; i < pevent->cmdline_count; i++)
-			free(pevent->cmdlines[i].comm);
-		free(pevent->cmdlines);
-	}
+	free(pevent->cmdline_hash);
 
 	while (cmdlist) {
 		cmdnext = cmdlist->next;
@@ -6521,20 +7779,12 @@ void pevent_free(struct pevent *pevent)
 		cmdlist = cmdnext;
 	}
 
-	if (pevent->func_map) {
-		for (i = 0; i < (int)pevent->func_count; i++) {
-			free(pevent->func_map[i].func);
-			free(pevent->func_map[i].mod);
-		}
-		free(pevent->func_map);
-	}
+	free(pevent->func_map);
+	free(pevent->func_index);
 
-	while (funclist) {
-		funcnext = funclist->next;
-		free(funclist->func);
-		free(funclist->mod);
-		free(funclist);
-		funclist = funcnext;
+	for (strings = pevent->func_strings; strings; strings = strings_next) {
+		strings_next = strings->next;
+		free(strings);
 	}
 
 	while (pevent->func_handlers) {
@@ -6559,6 +7809,13 @@ void pevent_free(struct pevent *pevent)
 	for (i = 0; i < pevent->nr_events; i++)
 		pevent_free_format(pevent->events[i]);
 
+	for (i = 0; i < pevent->nr_lazy_events; i++) {
+		free(pevent->lazy_events[i].buf);
+		free(pevent->lazy_events[i].name);
+		free(pevent->lazy_events[i].system);
+	}
+	free(pevent->lazy_events);
+
 	while (pevent->handlers) {
 		handle = pevent->handlers;
 		pevent->handlers = handle->next;
@@ -6568,6 +7825,8 @@ void pevent_free(struct pevent *pevent)
 	free(pevent->trace_clock);
 	free(pevent->events);
 	free(pevent->sort_events);
+	free(pevent->event_ids);
+	free(pevent->event_names);
 
 	free(pevent);
 }
@@ -89,6 +89,8 @@ extern int trace_seq_vprintf(struct trace_seq *s, const char *fmt, va_list args)
 
 extern int trace_seq_puts(struct trace_seq *s, const char *str);
 extern int trace_seq_putc(struct trace_seq *s, unsigned char c);
+extern int trace_seq_putmem(struct trace_seq *s, const void *mem,
+			    unsigned int len);
 
 extern void trace_seq_terminate(struct trace_seq *s);
 
@@ -186,6 +188,8 @@ enum format_flags {
 	FIELD_IS_SYMBOLIC	= 128,
 };
 
+typedef unsigned long long (*pevent_field_read_func)(const void *ptr);
+
 struct format_field {
 	struct format_field	*next;
 	struct event_format	*event;
@@ -197,6 +201,9 @@ struct format_field {
 	unsigned int		arraylen;
 	unsigned int		elementsize;
 	unsigned long		flags;
+	/* set up by pevent_field_init_read() when the format is parsed */
+	pevent_field_read_func	read_number;
+	pevent_field_read_func	read_value;
 };
 
 struct format {
@@ -320,6 +327,8 @@ struct print_fmt {
 	struct print_arg	*args;
 };
 
+struct print_prog;
+
 struct event_format {
 	struct pevent		*pevent;
 	char			*name;
@@ -330,6 +339,8 @@ struct event_format {
 	char			*system;
 	pevent_event_handler_func handler;
 	void			*context;
+	struct print_prog	*print_prog;
+	struct event_format	*next_name;
 };
 
 enum {
@@ -340,6 +351,7 @@ enum {
 	EVENT_FL_ISFUNCRET	= 0x20,
 	EVENT_FL_NOHANDLE	= 0x40,
 	EVENT_FL_PRINTRAW	= 0x80,
+	EVENT_FL_NOPROG		= 0x100,
 
 	EVENT_FL_FAILED		= 0x80000000
 };
@@ -449,9 +461,9 @@ void traceevent_print_plugins(struct trace_seq *s,
 			      const struct plugin_list *list);
 
 struct cmdline;
-struct cmdline_list;
 struct func_map;
-struct func_list;
+struct func_index;
+struct func_strings;
 struct event_handler;
 
 struct pevent {
@@ -476,13 +488,17 @@ struct pevent {
 	int long_size;
 	int page_size;
 
-	struct cmdline *cmdlines;
-	struct cmdline_list *cmdlist;
+	struct cmdline *cmdlist;
+	struct cmdline **cmdline_hash;
+	int cmdline_hash_bits;
 	int cmdline_count;
 
 	struct func_map *func_map;
-	struct func_list *funclist;
+	struct func_index *func_index;
+	struct func_strings *func_strings;
 	unsigned int func_count;
+	unsigned int func_size;
+	unsigned int func_gen;
 
 	struct printk_map *printk_map;
 	struct printk_list *printklist;
@@ -494,6 +510,12 @@ struct pevent {
 	struct event_format **sort_events;
 	enum event_sort_type last_type;
 
+	/* formats saved by pevent_parse_event_lazy(), not parsed yet */
+	struct lazy_event *lazy_events;
+	int nr_lazy_events;
+	int nr_lazy_left;
+	int lazy_sorted;
+
 	int type_offset;
 	int type_size;
 
@@ -524,8 +546,12 @@ struct pevent {
 
 	int parsing_failures;
 
-	/* cache */
-	struct event_format *last_event;
+	/* events by id, for ids below EVENT_IDS_MAX */
+	struct event_format **event_ids;
+	int nr_event_ids;
+
+	/* events hashed by name, chained through event->next_name */
+	struct event_format **event_names;
 
 	char *trace_clock;
 };
@@ -629,6 +655,10 @@ int pevent_parse_header_page(struct pevent *pevent, char *buf, unsigned long siz
 
 enum pevent_errno pevent_parse_event(struct pevent *pevent, const char *buf,
 				     unsigned long size, const char *sys);
+enum pevent_errno pevent_parse_event_lazy(struct pevent *pevent, const char *buf,
+					  unsigned long size, const char *sys);
+void pevent_parse_lazy_events(struct pevent *pevent);
+int pevent_prepare_print_threads(struct pevent *pevent);
 enum pevent_errno pevent_parse_format(struct pevent *pevent,
 				      struct event_format **eventp,
 				      const char *buf,
@@ -681,6 +711,35 @@ pevent_find_function_address(struct pevent *pevent, unsigned long long addr);
 unsigned long long pevent_read_number(struct pevent *pevent, const void *ptr, int size);
 int pevent_read_number_field(struct format_field *field, const void *data,
 			     unsigned long long *value);
+int pevent_read_number_field_bulk(struct format_field *field,
+				  struct pevent_record **records, int nr_records,
+				  unsigned long long *values);
+void pevent_field_init_read(struct format_field *field);
+
+/**
+ * pevent_field_number - read a number field from record data
+ * @field: the field to read, of size 1, 2, 4 or 8
+ * @data: the data of a record of the field's event
+ *
+ * Like pevent_read_number_field(), but without its checks. The way
+ * to read the field is worked out when its format is parsed.
+ */
+static inline unsigned long long
+pevent_field_number(struct format_field *field, const void *data)
+{
+	return field->read_number((const char *)data + field->offset);
+}
+
+/**
+ * pevent_field_value - read a number field, sign extended if signed
+ * @field: the field to read, of size 1, 2, 4 or 8
+ * @data: the data of a record of the field's event
+ */
+static inline unsigned long long
+pevent_field_value(struct format_field *field, const void *data)
+{
+	return field->read_value((const char *)data + field->offset);
+}
 
 struct event_format *pevent_find_event(struct pevent *pevent, int id);
 
@@ -742,20 +801,14 @@ static inline int pevent_is_file_bigendian(struct pevent *pevent)
 	return pevent->file_bigendian;
 }
 
-static inline void pevent_set_file_bigendian(struct pevent *pevent, int endian)
-{
-	pevent->file_bigendian = endian;
-}
+void pevent_set_file_bigendian(struct pevent *pevent, int endian);
 
 static inline int pevent_is_host_bigendian(struct pevent *pevent)
 {
 	return pevent->host_bigendian;
 }
 
-static inline void pevent_set_host_bigendian(struct pevent *pevent, int endian)
-{
-	pevent->host_bigendian = endian;
-}
+void pevent_set_host_bigendian(struct pevent *pevent, int endian);
 
 static inline int pevent_is_latency_format(struct pevent *pevent)
 {
@@ -879,12 +932,27 @@ struct filter_arg_num {
 	struct filter_arg	*right;
 };
 
+/*
+ * How a string compare is done. Simple regular expressions are
+ * reduced to a literal (lit, lit_len) that points into val.
+ */
+enum filter_str_match {
+	FILTER_STR_REGEX,
+	FILTER_STR_EXACT,
+	FILTER_STR_PREFIX,
+	FILTER_STR_SUFFIX,
+	FILTER_STR_SUBSTR,
+};
+
 struct filter_arg_str {
 	enum filter_cmp_type	type;
 	struct format_field	*field;
 	char			*val;
 	char			*buffer;
 	regex_t			reg;
+	enum filter_str_match	match;
+	const char		*lit;
+	int			lit_len;
 };
 
 struct filter_arg {
@@ -900,10 +968,13 @@ struct filter_arg {
 	};
 };
 
+struct filter_prog;
+
 struct filter_type {
 	int			event_id;
 	struct event_format	*event;
 	struct filter_arg	*filter;
+	struct filter_prog	*prog;
 };
 
 #define PEVENT_FILTER_ERROR_BUFSZ  1024
@@ -911,7 +982,11 @@ struct filter_type {
 struct event_filter {
 	struct pevent		*pevent;
 	int			filters;
+	int			alloc_filters;
 	struct filter_type	*event_filters;
+	/* where the filter of each event id is, see find_filter_type() */
+	unsigned int		*event_ids;
+	int			nr_event_ids;
 	char			error_buffer[PEVENT_FILTER_ERROR_BUFSZ];
 };
 
@@ -935,6 +1010,10 @@ enum pevent_errno pevent_filter_add_filter_str(struct event_filter *filter,
 enum pevent_errno pevent_filter_match(struct event_filter *filter,
 				      struct pevent_record *record);
 
+enum pevent_errno pevent_filter_match_batch(struct event_filter *filter,
+					    struct pevent_record **records,
+					    int nr, unsigned long *matches);
+
 int pevent_filter_strerror(struct event_filter *filter, enum pevent_errno err,
 			   char *buf, size_t buflen);
 
@@ -957,6 +1036,10 @@ int pevent_filter_event_has_trivial(struct event_filter *filter,
 				    int event_id,
 				    enum filter_trivial_type type);
 
+int pevent_filter_field_values(struct event_filter *filter, int event_id,
+			       const char *field_name,
+			       unsigned long long **values);
+
 int pevent_filter_copy(struct event_filter *dest, struct event_filter *source);
 
 int pevent_update_trivial(struct event_filter *dest, struct event_filter *source,
@@ -52,3 +52,16 @@ int main (void)
 	return ret;
 }
 endef
+
+define SOURCE_ZLIB
+#include <zlib.h>
+
+int main (void)
+{
+	unsigned char in[1] = { 0 };
+	unsigned char out[64];
+	uLongf size = sizeof(out);
+
+	return compress2(out, &size, in, sizeof(in), Z_BEST_SPEED);
+}
+endef
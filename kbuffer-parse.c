@@ -54,6 +54,7 @@ enum {
  * @read_4		- Function to read 4 raw bytes (may swap)
  * @read_8		- Function to read 8 raw bytes (may swap)
  * @read_long		- Function to read a long word (4 or 8 bytes with needed swap)
+ * @next_event		- Function to move to the next event (one for each byte order)
  */
 struct kbuffer {
 	unsigned long long 	timestamp;
@@ -167,7 +168,10 @@ static int calc_index(struct kbuffer *kbuf, void *ptr)
 	return (unsigned long)ptr - (unsigned long)kbuf->data;
 }
 
-static int __next_event(struct kbuffer *kbuf);
+static int next_event_le(struct kbuffer *kbuf);
+static int next_event_be(struct kbuffer *kbuf);
+static int next_event_le_swap(struct kbuffer *kbuf);
+static int next_event_be_swap(struct kbuffer *kbuf);
 
 /**
  * kbuffer_alloc - allocat a new kbuffer
@@ -224,8 +228,16 @@ kbuffer_alloc(enum kbuffer_long_size size, enum kbuffer_endian endian)
 	else
 		kbuf->read_long = __read_long_4;
 
-	/* May be changed by kbuffer_set_old_format() */
-	kbuf->next_event = __next_event;
+	/*
+	 * Pick the event decoder for the byte order of the buffer.
+	 * May be changed by kbuffer_set_old_format().
+	 */
+	if (kbuf->flags & KBUFFER_FL_BIG_ENDIAN)
+		kbuf->next_event = do_swap(kbuf) ? next_event_be_swap :
+			next_event_be;
+	else
+		kbuf->next_event = do_swap(kbuf) ? next_event_le_swap :
+			next_event_le;
 
 	return kbuf;
 }
@@ -402,20 +414,95 @@ translate_data(struct kbuffer *kbuf, void *data, void **rptr,
 	return type_len;
 }
 
-static unsigned int update_pointers(struct kbuffer *kbuf)
+static inline unsigned int read_4_order(void *ptr, int swap)
+{
+	return swap ? __read_4_sw(ptr) : __read_4(ptr);
+}
+
+/*
+ * Move to the next event, the same as translate_data() does, but
+ * with the byte order of the buffer as constants. The versions of
+ * this below get the reads inlined and the flag tests folded away,
+ * which matters as this is called for every event that is read.
+ */
+static inline __attribute__((always_inline)) int
+next_event_order(struct kbuffer *kbuf, int swap, int big)
 {
 	unsigned long long delta;
+	unsigned int type_len_ts;
 	unsigned int type_len;
-	int length;
-	void *ptr = kbuf->data + kbuf->curr;
+	unsigned int length;
+	void *ptr;
 
-	type_len = translate_data(kbuf, ptr, &ptr, &delta, &length);
+	do {
+		kbuf->curr = kbuf->next;
+		if (kbuf->next >= kbuf->size)
+			return -1;
 
-	kbuf->timestamp += delta;
-	kbuf->index = calc_index(kbuf, ptr);
-	kbuf->next = kbuf->index + length;
+		ptr = kbuf->data + kbuf->curr;
+		type_len_ts = read_4_order(ptr, swap);
+		ptr += 4;
 
-	return type_len;
+		if (big) {
+			type_len = type_len_ts >> 27;
+			delta = type_len_ts & ((1 << 27) - 1);
+		} else {
+			type_len = type_len_ts & ((1 << 5) - 1);
+			delta = type_len_ts >> 5;
+		}
+
+		switch (type_len) {
+		case KBUFFER_TYPE_PADDING:
+			length = read_4_order(ptr, swap);
+			break;
+
+		case KBUFFER_TYPE_TIME_EXTEND:
+			delta += (unsigned long long)read_4_order(ptr, swap) << TS_SHIFT;
+			ptr += 4;
+			length = 0;
+			break;
+
+		case KBUFFER_TYPE_TIME_STAMP:
+			ptr += 12;
+			length = 0;
+			break;
+		case 0:
+			length = read_4_order(ptr, swap) - 4;
+			length = (length + 3) & ~3;
+			ptr += 4;
+			break;
+		default:
+			length = type_len * 4;
+			break;
+		}
+
+		kbuf->timestamp += delta;
+		kbuf->index = calc_index(kbuf, ptr);
+		kbuf->next = kbuf->index + length;
+	} while (type_len == KBUFFER_TYPE_TIME_EXTEND ||
+		 type_len == KBUFFER_TYPE_PADDING);
+
+	return 0;
+}
+
+static int next_event_le(struct kbuffer *kbuf)
+{
+	return next_event_order(kbuf, 0, 0);
+}
+
+static int next_event_be(struct kbuffer *kbuf)
+{
+	return next_event_order(kbuf, 0, 1);
+}
+
+static int next_event_le_swap(struct kbuffer *kbuf)
+{
+	return next_event_order(kbuf, 1, 0);
+}
+
+static int next_event_be_swap(struct kbuffer *kbuf)
+{
+	return next_event_order(kbuf, 1, 1);
 }
 
 /**
@@ -459,20 +546,6 @@ void *kbuffer_translate_data(int swap, void *data, unsigned int *size)
 	return ptr;
 }
 
-static int __next_event(struct kbuffer *kbuf)
-{
-	int type;
-
-	do {
-		kbuf->curr = kbuf->next;
-		if (kbuf->next >= kbuf->size)
-			return -1;
-		type = update_pointers(kbuf);
-	} while (type == KBUFFER_TYPE_TIME_EXTEND || type == KBUFFER_TYPE_PADDING);
-
-	return 0;
-}
-
 static int next_event(struct kbuffer *kbuf)
 {
 	return kbuf->next_event(kbuf);
@@ -22,6 +22,8 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 #include <sys/types.h>
 
 #include "event-parse.h"
@@ -101,71 +103,115 @@ static enum event_type read_token(char **tok)
 	return type;
 }
 
-static int filter_cmp(const void *a, const void *b)
+/*
+ * filter->event_ids[id] is 0 if event @id has no filter. Otherwise it
+ * is the index of its filter_type in filter->event_filters plus one,
+ * shifted up by FILTER_ID_SHIFT, with FILTER_ID_TRUE or FILTER_ID_FALSE
+ * in the low bits if the filter is just TRUE or FALSE. That way records
+ * of events that are not filtered, or filtered trivially, take a single
+ * lookup. The event_filters are in no particular order.
+ */
+#define FILTER_IDS_MAX		(1 << 16)
+#define FILTER_ID_SHIFT		2
+#define FILTER_ID_TRUE		1
+#define FILTER_ID_FALSE		2
+#define FILTER_ID_TRIVIAL	(FILTER_ID_TRUE | FILTER_ID_FALSE)
+
+static struct filter_type *
+find_filter_type(struct event_filter *filter, int id)
 {
-	const struct filter_type *ea = a;
-	const struct filter_type *eb = b;
+	unsigned int slot;
+	int i;
 
-	if (ea->event_id < eb->event_id)
-		return -1;
+	if (id >= 0 && id < filter->nr_event_ids) {
+		slot = filter->event_ids[id] >> FILTER_ID_SHIFT;
+		return slot ? &filter->event_filters[slot - 1] : NULL;
+	}
 
-	if (ea->event_id > eb->event_id)
-		return 1;
+	if (id >= 0 && id < FILTER_IDS_MAX)
+		return NULL;
 
-	return 0;
+	/* Event ids should fit in common_type, but just in case */
+	for (i = 0; i < filter->filters; i++) {
+		if (filter->event_filters[i].event_id == id)
+			return &filter->event_filters[i];
+	}
+
+	return NULL;
 }
 
-static struct filter_type *
-find_filter_type(struct event_filter *filter, int id)
+/* Points the event id of filter->event_filters[@i] at it */
+static void update_filter_id(struct event_filter *filter, int i)
 {
-	struct filter_type *filter_type;
-	struct filter_type key;
+	struct filter_type *filter_type = &filter->event_filters[i];
+	struct filter_arg *arg = filter_type->filter;
+	unsigned int slot;
 
-	key.event_id = id;
+	if (filter_type->event_id < 0 ||
+	    filter_type->event_id >= filter->nr_event_ids)
+		return;
 
-	filter_type = bsearch(&key, filter->event_filters,
-			      filter->filters,
-			      sizeof(*filter->event_filters),
-			      filter_cmp);
+	slot = (i + 1) << FILTER_ID_SHIFT;
+	if (arg && arg->type == FILTER_ARG_BOOLEAN)
+		slot |= arg->boolean.value ? FILTER_ID_TRUE : FILTER_ID_FALSE;
 
-	return filter_type;
+	filter->event_ids[filter_type->event_id] = slot;
+}
+
+/* Makes room in filter->event_ids for @id */
+static int grow_filter_ids(struct event_filter *filter, int id)
+{
+	unsigned int *ids;
+	int nr;
+
+	if (id < 0 || id >= FILTER_IDS_MAX || id < filter->nr_event_ids)
+		return 0;
+
+	nr = filter->nr_event_ids ? : 256;
+	while (nr <= id)
+		nr *= 2;
+	ids = realloc(filter->event_ids, sizeof(*ids) * nr);
+	if (!ids)
+		return -1;
+	memset(ids + filter->nr_event_ids, 0,
+	       sizeof(*ids) * (nr - filter->nr_event_ids));
+	filter->event_ids = ids;
+	filter->nr_event_ids = nr;
+
+	return 0;
 }
 
 static struct filter_type *
 add_filter_type(struct event_filter *filter, int id)
 {
 	struct filter_type *filter_type;
-	int i;
+	int nr;
 
 	filter_type = find_filter_type(filter, id);
 	if (filter_type)
 		return filter_type;
 
-	filter_type = realloc(filter->event_filters,
-			      sizeof(*filter->event_filters) *
-			      (filter->filters + 1));
-	if (!filter_type)
+	if (grow_filter_ids(filter, id) < 0)
 		return NULL;
 
-	filter->event_filters = filter_type;
+	if (filter->filters == filter->alloc_filters) {
+		nr = filter->alloc_filters ? filter->alloc_filters * 2 : 16;
+		filter_type = realloc(filter->event_filters,
+				      sizeof(*filter->event_filters) * nr);
+		if (!filter_type)
+			return NULL;
 
-	for (i = 0; i < filter->filters; i++) {
-		if (filter->event_filters[i].event_id > id)
-			break;
+		filter->event_filters = filter_type;
+		filter->alloc_filters = nr;
 	}
 
-	if (i < filter->filters)
-		memmove(&filter->event_filters[i+1],
-			&filter->event_filters[i],
-			sizeof(*filter->event_filters) *
-			(filter->filters - i));
-
-	filter_type = &filter->event_filters[i];
+	filter_type = &filter->event_filters[filter->filters];
 	filter_type->event_id = id;
 	filter_type->event = pevent_find_event(filter->pevent, id);
 	filter_type->filter = NULL;
+	filter_type->prog = NULL;
 
-	filter->filters++;
+	update_filter_id(filter, filter->filters++);
 
 	return filter_type;
 }
@@ -217,7 +263,6 @@ static void free_arg(struct filter_arg *arg)
 	case FILTER_ARG_STR:
 		free(arg->str.val);
 		regfree(&arg->str.reg);
-		free(arg->str.buffer);
 		break;
 
 	case FILTER_ARG_VALUE:
@@ -310,6 +355,8 @@ find_event(struct pevent *pevent, struct event_list **events,
 		}
 	}
 
+	pevent_parse_lazy_events(pevent);
+
 	for (i = 0; i < pevent->nr_events; i++) {
 		event = pevent->events[i];
 		if (event_match(event, sys_name ? &sreg : NULL, &ereg)) {
@@ -449,6 +496,74 @@ create_arg_cmp(enum filter_exp_type etype)
 	return arg;
 }
 
+/*
+ * A character that stands for itself in a basic regular expression.
+ * Characters that GNU gives a meaning to when escaped are left out
+ * as well, to stay on the safe side.
+ */
+static int is_regex_literal(char c)
+{
+	if (c < ' ' || c > '~')
+		return 0;
+	return !strchr(".[]\\*^$+?|(){}", c);
+}
+
+static int is_regex_star(const char *p)
+{
+	return (*p == '.' || is_regex_literal(*p)) && p[1] == '*';
+}
+
+/*
+ * Most regular expressions given to filters are really just a word
+ * that is looked for ("kworker*" is "kworke" anywhere in the string).
+ * Find those and record the word so that the test can skip regexec().
+ * A "c*" at an unanchored end matches nothing and may be dropped.
+ * Anything else is left to the regex engine.
+ */
+static void classify_str_regex(struct filter_arg_str *str)
+{
+	const char *p = str->val;
+	const char *lit;
+	int start = 0;
+	int end = 0;
+
+	str->match = FILTER_STR_REGEX;
+
+	if (*p == '^') {
+		start = 1;
+		p++;
+	} else {
+		while (is_regex_star(p))
+			p += 2;
+	}
+
+	lit = p;
+	while (is_regex_literal(*p) && p[1] != '*')
+		p++;
+	str->lit = lit;
+	str->lit_len = p - lit;
+
+	if (p[0] == '$' && !p[1]) {
+		end = 1;
+		p++;
+	} else {
+		while (is_regex_star(p))
+			p += 2;
+	}
+
+	if (*p)
+		return;
+
+	if (start && end)
+		str->match = FILTER_STR_EXACT;
+	else if (start)
+		str->match = FILTER_STR_PREFIX;
+	else if (end)
+		str->match = FILTER_STR_SUFFIX;
+	else
+		str->match = FILTER_STR_SUBSTR;
+}
+
 static enum pevent_errno
 add_right(struct filter_arg *op, struct filter_arg *arg, char *error_str)
 {
@@ -565,16 +680,14 @@ add_right(struct filter_arg *op, struct filter_arg *arg, char *error_str)
 				show_error(error_str, "Failed to allocate string filter");
 				return PEVENT_ERRNO__MEM_ALLOC_FAILED;
 			}
-			/*
-			 * Need a buffer to copy data for tests
-			 */
-			op->str.buffer = malloc(op->str.field->size + 1);
-			if (!op->str.buffer) {
-				show_error(error_str, "Failed to allocate string filter");
-				return PEVENT_ERRNO__MEM_ALLOC_FAILED;
-			}
-			/* Null terminate this buffer */
-			op->str.buffer[op->str.field->size] = 0;
+
+			if (op_type == FILTER_CMP_MATCH ||
+			    op_type == FILTER_CMP_NOT_MATCH) {
+				op->str.match = FILTER_STR_EXACT;
+				op->str.lit = op->str.val;
+				op->str.lit_len = strlen(op->str.val);
+			} else
+				classify_str_regex(&op->str);
 
 			/* We no longer have left or right args */
 			free_arg(arg);
@@ -1164,11 +1277,15 @@ process_filter(struct event_format *event, struct filter_arg **parg,
 		current_op = current_exp;
 
 	ret = collapse_tree(current_op, parg, error_str);
+	/*
+	 * collapse_tree() may have freed current_op (and current_exp,
+	 * which is part of it). What is left is in *parg.
+	 */
+	current_op = NULL;
+	current_exp = NULL;
 	if (ret < 0)
 		goto fail;
 
-	*parg = current_op;
-
 	free(token);
 	return 0;
 
@@ -1212,6 +1329,23 @@ process_event(struct event_format *event, const char *filter_str,
 	return 0;
 }
 
+static struct filter_prog *
+compile_filter_prog(struct event_format *event, struct filter_arg *arg);
+static void free_filter_prog(struct filter_prog *prog);
+
+/* Replace the filter of @filter_type with @arg, and compile it */
+static void set_filter_arg(struct event_filter *filter,
+			   struct filter_type *filter_type,
+			   struct filter_arg *arg)
+{
+	free_arg(filter_type->filter);
+	free_filter_prog(filter_type->prog);
+	filter_type->filter = arg;
+	/* If this fails, pevent_filter_match() walks @arg instead */
+	filter_type->prog = compile_filter_prog(filter_type->event, arg);
+	update_filter_id(filter, filter_type - filter->event_filters);
+}
+
 static enum pevent_errno
 filter_event(struct event_filter *filter, struct event_format *event,
 	     const char *filter_str, char *error_str)
@@ -1239,9 +1373,7 @@ filter_event(struct event_filter *filter, struct event_format *event,
 	if (filter_type == NULL)
 		return PEVENT_ERRNO__MEM_ALLOC_FAILED;
 
-	if (filter_type->filter)
-		free_arg(filter_type->filter);
-	filter_type->filter = arg;
+	set_filter_arg(filter, filter_type, arg);
 
 	return 0;
 }
@@ -1253,6 +1385,17 @@ static void filter_init_error_buf(struct event_filter *filter)
 	filter->error_buffer[0] = '\0';
 }
 
+/*
+ * The matching of records may run in several threads at once.
+ * Only the parsing writes errors to the buffer, so leave it alone
+ * unless there is one to clear.
+ */
+static void filter_clear_error_buf(struct event_filter *filter)
+{
+	if (filter->error_buffer[0])
+		filter->error_buffer[0] = '\0';
+}
+
 /**
  * pevent_filter_add_filter_str - add a new filter
  * @filter: the event filter to add to
@@ -1363,6 +1506,7 @@ enum pevent_errno pevent_filter_add_filter_str(struct event_filter *filter,
 static void free_filter_type(struct filter_type *filter_type)
 {
 	free_arg(filter_type->filter);
+	free_filter_prog(filter_type->prog);
 }
 
 /**
@@ -1406,7 +1550,7 @@ int pevent_filter_remove_event(struct event_filter *filter,
 			       int event_id)
 {
 	struct filter_type *filter_type;
-	unsigned long len;
+	struct filter_type *last;
 
 	if (!filter->filters)
 		return 0;
@@ -1418,15 +1562,18 @@ int pevent_filter_remove_event(struct event_filter *filter,
 
 	free_filter_type(filter_type);
 
-	/* The filter_type points into the event_filters array */
-	len = (unsigned long)(filter->event_filters + filter->filters) -
-		(unsigned long)(filter_type + 1);
+	if (event_id >= 0 && event_id < filter->nr_event_ids)
+		filter->event_ids[event_id] = 0;
 
-	memmove(filter_type, filter_type + 1, len);
+	/* Move the last filter into the hole */
 	filter->filters--;
+	last = &filter->event_filters[filter->filters];
+	if (filter_type != last) {
+		*filter_type = *last;
+		update_filter_id(filter, filter_type - filter->event_filters);
+	}
 
-	memset(&filter->event_filters[filter->filters], 0,
-	       sizeof(*filter_type));
+	memset(last, 0, sizeof(*last));
 
 	return 1;
 }
@@ -1446,7 +1593,12 @@ void pevent_filter_reset(struct event_filter *filter)
 
 	free(filter->event_filters);
 	filter->filters = 0;
+	filter->alloc_filters = 0;
 	filter->event_filters = NULL;
+
+	free(filter->event_ids);
+	filter->nr_event_ids = 0;
+	filter->event_ids = NULL;
 }
 
 void pevent_filter_free(struct event_filter *filter)
@@ -1497,7 +1649,7 @@ static int copy_filter_type(struct event_filter *filter,
 		if (filter_type == NULL)
 			return -1;
 
-		filter_type->filter = arg;
+		set_filter_arg(filter, filter_type, arg);
 
 		free(str);
 		return 0;
@@ -1690,6 +1842,141 @@ int pevent_filter_event_has_trivial(struct event_filter *filter,
 	}
 }
 
+/* Number of values pevent_filter_field_values() keeps track of */
+#define FILTER_VALUES_MAX	64
+
+/* Is @arg the value of @name compared to a number? */
+static int arg_field_value(struct filter_arg *arg, struct filter_arg *value,
+			   const char *name, unsigned long long *val)
+{
+	if (arg->type != FILTER_ARG_FIELD ||
+	    strcmp(arg->field.field->name, name) != 0)
+		return 0;
+	if (value->type != FILTER_ARG_VALUE ||
+	    value->value.type != FILTER_NUMBER)
+		return 0;
+	*val = value->value.val;
+	return 1;
+}
+
+static int value_in(unsigned long long *vals, int nr, unsigned long long val)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (vals[i] == val)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Fill @vals with the values of the field @name that @arg can be
+ * true for. Returns the number of values, or -1 if there are more
+ * than FILTER_VALUES_MAX or the field is not limited by @arg.
+ */
+static int arg_field_values(struct filter_arg *arg, const char *name,
+			    unsigned long long *vals)
+{
+	unsigned long long right[FILTER_VALUES_MAX];
+	unsigned long long val;
+	int nr_right;
+	int nr;
+	int i;
+
+	switch (arg->type) {
+	case FILTER_ARG_BOOLEAN:
+		return arg->boolean.value ? -1 : 0;
+
+	case FILTER_ARG_NUM:
+		if (arg->num.type != FILTER_CMP_EQ)
+			return -1;
+		if (!arg_field_value(arg->num.left, arg->num.right, name, &val) &&
+		    !arg_field_value(arg->num.right, arg->num.left, name, &val))
+			return -1;
+		vals[0] = val;
+		return 1;
+
+	case FILTER_ARG_OP:
+		if (arg->op.type == FILTER_OP_NOT)
+			return -1;
+
+		nr = arg_field_values(arg->op.left, name, vals);
+		nr_right = arg_field_values(arg->op.right, name, right);
+
+		if (arg->op.type == FILTER_OP_AND) {
+			if (nr < 0 && nr_right < 0)
+				return -1;
+			if (nr < 0) {
+				memcpy(vals, right, sizeof(*vals) * nr_right);
+				return nr_right;
+			}
+			if (nr_right < 0)
+				return nr;
+			for (i = 0; i < nr; i++) {
+				if (!value_in(right, nr_right, vals[i]))
+					vals[i--] = vals[--nr];
+			}
+			return nr;
+		}
+
+		/* FILTER_OP_OR */
+		if (nr < 0 || nr_right < 0)
+			return -1;
+		for (i = 0; i < nr_right; i++) {
+			if (value_in(vals, nr, right[i]))
+				continue;
+			if (nr == FILTER_VALUES_MAX)
+				return -1;
+			vals[nr++] = right[i];
+		}
+		return nr;
+
+	default:
+		return -1;
+	}
+}
+
+/**
+ * pevent_filter_field_values - find the values a filter passes for a field
+ * @filter: the filter with the information
+ * @event_id: the id of the event to look at
+ * @field_name: the name of a number field of the event
+ * @values: returns an allocated array of the values
+ *
+ * Looks for comparisons of @field_name to numbers in the filter of
+ * the event, as in "common_pid == 10 || common_pid == 11", which
+ * any record that the filter matches must satisfy. This lets
+ * a reader drop records before the filter is run on them.
+ *
+ * Returns the number of values in @values, which must be freed,
+ * or -1 if the filter does not limit the field to a few values.
+ * Zero is returned for a filter that matches no record.
+ */
+int pevent_filter_field_values(struct event_filter *filter, int event_id,
+			       const char *field_name,
+			       unsigned long long **values)
+{
+	unsigned long long vals[FILTER_VALUES_MAX];
+	struct filter_type *filter_type;
+	int nr;
+
+	filter_type = find_filter_type(filter, event_id);
+	if (!filter_type)
+		return -1;
+
+	nr = arg_field_values(filter_type->filter, field_name, vals);
+	if (nr < 0)
+		return -1;
+
+	*values = malloc(sizeof(*vals) * (nr ? nr : 1));
+	if (!*values)
+		return -1;
+	memcpy(*values, vals, sizeof(*vals) * nr);
+
+	return nr;
+}
+
 static int test_filter(struct event_format *event, struct filter_arg *arg,
 		       struct pevent_record *record, enum pevent_errno *err);
 
@@ -1708,8 +1995,6 @@ static unsigned long long
 get_value(struct event_format *event,
 	  struct format_field *field, struct pevent_record *record)
 {
-	unsigned long long val;
-
 	/* Handle our dummy "comm" field */
 	if (field == &comm) {
 		const char *name;
@@ -1718,22 +2003,7 @@ get_value(struct event_format *event,
 		return (unsigned long)name;
 	}
 
-	pevent_read_number_field(field, record->data, &val);
-
-	if (!(field->flags & FIELD_IS_SIGNED))
-		return val;
-
-	switch (field->size) {
-	case 1:
-		return (char)val;
-	case 2:
-		return (short)val;
-	case 4:
-		return (int)val;
-	case 8:
-		return (long long)val;
-	}
-	return val;
+	return pevent_field_value(field, record->data);
 }
 
 static unsigned long long
@@ -1861,27 +2131,45 @@ static int test_num(struct event_format *event, struct filter_arg *arg,
 	}
 }
 
-static const char *get_field_str(struct filter_arg *arg, struct pevent_record *record)
+/* Size of the buffer that test_str() copies fields to */
+#define FILTER_STR_BUF		256
+
+/*
+ * Returns the field of @arg as a string. Filters may be matched by
+ * several threads at once, so the field is copied to @buf, which
+ * holds FILTER_STR_BUF bytes. Larger fields are copied to a buffer
+ * returned in @alloc, which must be freed. Returns NULL if that
+ * could not be allocated.
+ */
+static const char *get_field_str(struct filter_arg *arg,
+				 struct pevent_record *record,
+				 char *buf, char **alloc)
 {
 	struct event_format *event;
 	struct pevent *pevent;
 	unsigned long long addr;
 	const char *val = NULL;
-	char hex[64];
+	int size;
 
 	/* If the field is not a string convert it */
 	if (arg->str.field->flags & FIELD_IS_STRING) {
 		val = record->data + arg->str.field->offset;
+		size = arg->str.field->size;
 
 		/*
 		 * We need to copy the data since we can't be sure the field
 		 * is null terminated.
 		 */
-		if (*(val + arg->str.field->size - 1)) {
-			/* copy it */
-			memcpy(arg->str.buffer, val, arg->str.field->size);
-			/* the buffer is already NULL terminated */
-			val = arg->str.buffer;
+		if (*(val + size - 1)) {
+			if (size >= FILTER_STR_BUF) {
+				*alloc = malloc(size + 1);
+				if (!*alloc)
+					return NULL;
+				buf = *alloc;
+			}
+			memcpy(buf, val, size);
+			buf[size] = 0;
+			val = buf;
 		}
 
 	} else {
@@ -1895,43 +2183,137 @@ static const char *get_field_str(struct filter_arg *arg, struct pevent_record *r
 
 		if (val == NULL) {
 			/* just use the hex of the string name */
-			snprintf(hex, 64, "0x%llx", addr);
-			val = hex;
+			snprintf(buf, FILTER_STR_BUF, "0x%llx", addr);
+			val = buf;
 		}
 	}
 
 	return val;
 }
 
+static int find_str_nocase(const char *val, int len,
+			   const char *lit, int lit_len)
+{
+	const char *end;
+	int c;
+
+	if (!lit_len)
+		return 1;
+	if (len < lit_len)
+		return 0;
+
+	c = tolower(lit[0]);
+	end = val + len - lit_len;
+	for (; val <= end; val++) {
+		if (tolower(*val) == c &&
+		    !strncasecmp(val + 1, lit + 1, lit_len - 1))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Test @val, which ends at the first nul or after @size bytes,
+ * without copying it. Returns -1 if regexec() has to decide.
+ */
+static int match_str(struct filter_arg_str *str, const char *val, int size)
+{
+	int lit_len = str->lit_len;
+	int len;
+
+	switch (str->match) {
+	case FILTER_STR_REGEX:
+		return -1;
+	default:
+		break;
+	}
+
+	/* == and != are case sensitive and always exact */
+	if (str->type == FILTER_CMP_MATCH ||
+	    str->type == FILTER_CMP_NOT_MATCH)
+		return lit_len <= size &&
+			!strncmp(val, str->lit, lit_len) &&
+			(lit_len == size || !val[lit_len]);
+
+	/*
+	 * The regex is case insensitive. How that applies outside
+	 * of ASCII depends on the locale, let regexec() handle it.
+	 */
+	for (len = 0; len < size && val[len]; len++) {
+		if (val[len] & 0x80)
+			return -1;
+	}
+
+	switch (str->match) {
+	case FILTER_STR_EXACT:
+		return len == lit_len && !strncasecmp(val, str->lit, lit_len);
+	case FILTER_STR_PREFIX:
+		return len >= lit_len && !strncasecmp(val, str->lit, lit_len);
+	case FILTER_STR_SUFFIX:
+		return len >= lit_len &&
+			!strncasecmp(val + len - lit_len, str->lit, lit_len);
+	case FILTER_STR_SUBSTR:
+		return find_str_nocase(val, len, str->lit, lit_len);
+	default:
+		return -1;
+	}
+}
+
 static int test_str(struct event_format *event, struct filter_arg *arg,
 		    struct pevent_record *record, enum pevent_errno *err)
 {
+	struct format_field *field = arg->str.field;
+	char buf[FILTER_STR_BUF];
+	char *alloc = NULL;
 	const char *val;
-
-	if (arg->str.field == &comm)
-		val = get_comm(event, record);
-	else
-		val = get_field_str(arg, record);
+	int size = INT_MAX;
+	int ret;
 
 	switch (arg->str.type) {
 	case FILTER_CMP_MATCH:
-		return strcmp(val, arg->str.val) == 0;
-
 	case FILTER_CMP_NOT_MATCH:
-		return strcmp(val, arg->str.val) != 0;
-
 	case FILTER_CMP_REGEX:
-		/* Returns zero on match */
-		return !regexec(&arg->str.reg, val, 0, NULL, 0);
-
 	case FILTER_CMP_NOT_REGEX:
-		return regexec(&arg->str.reg, val, 0, NULL, 0);
-
+		break;
 	default:
 		if (!*err)
 			*err = PEVENT_ERRNO__ILLEGAL_STRING_CMP;
 		return 0;
 	}
+
+	if (field == &comm)
+		val = get_comm(event, record);
+	else if ((field->flags & FIELD_IS_STRING) && field->size > 0) {
+		/* Looked at in place, no need to copy it */
+		val = record->data + field->offset;
+		size = field->size;
+	} else
+		val = get_field_str(arg, record, buf, &alloc);
+
+	if (!val)
+		goto out_nomem;
+
+	ret = match_str(&arg->str, val, size);
+	if (ret < 0) {
+		if (size != INT_MAX) {
+			val = get_field_str(arg, record, buf, &alloc);
+			if (!val)
+				goto out_nomem;
+		}
+		/* Returns zero on match */
+		ret = !regexec(&arg->str.reg, val, 0, NULL, 0);
+	}
+	free(alloc);
+
+	if (arg->str.type == FILTER_CMP_NOT_MATCH ||
+	    arg->str.type == FILTER_CMP_NOT_REGEX)
+		return !ret;
+	return ret;
+
+ out_nomem:
+	if (!*err)
+		*err = PEVENT_ERRNO__MEM_ALLOC_FAILED;
+	return 0;
 }
 
 static int test_op(struct event_format *event, struct filter_arg *arg,
@@ -1996,65 +2378,1041 @@ static int test_filter(struct event_format *event, struct filter_arg *arg,
 	}
 }
 
-/**
- * pevent_event_filtered - return true if event has filter
- * @filter: filter struct with filter information
- * @event_id: event id to test if filter exists
- *
- * Returns 1 if filter found for @event_id
- *   otherwise 0;
+/*
+ * A filter does not change between records, so instead of walking
+ * the filter_arg tree for each one, it is compiled once into a flat
+ * program. Values are loaded into registers, with the way to read a
+ * field (offset, size, sign and byte order) worked out up front, and
+ * a comparison sets the accumulator that the jumps of && and || test.
+ * Anything the compiler does not handle, including what only fails
+ * at match time, is left to test_filter().
  */
-int pevent_event_filtered(struct event_filter *filter, int event_id)
-{
-	struct filter_type *filter_type;
+enum filter_insn_code {
+	FILTER_INSN_BOOL,	/* acc = imm */
+	FILTER_INSN_IMM,	/* r[dst] = imm */
+	FILTER_INSN_LOAD,	/* r[dst] = read(data + offset) */
+	FILTER_INSN_LOAD_U8,
+	FILTER_INSN_LOAD_S8,
+	FILTER_INSN_LOAD_U16,
+	FILTER_INSN_LOAD_S16,
+	FILTER_INSN_LOAD_U32,
+	FILTER_INSN_LOAD_S32,
+	FILTER_INSN_LOAD_U64,
+	FILTER_INSN_LOAD_COMM,	/* r[dst] = comm of the record's pid */
+	FILTER_INSN_ADD,	/* r[dst] = r[dst] op r[src] */
+	FILTER_INSN_SUB,
+	FILTER_INSN_MUL,
+	FILTER_INSN_DIV,
+	FILTER_INSN_MOD,
+	FILTER_INSN_RSHIFT,
+	FILTER_INSN_LSHIFT,
+	FILTER_INSN_AND,
+	FILTER_INSN_OR,
+	FILTER_INSN_XOR,
+	FILTER_INSN_EQ,		/* acc = r[dst] op r[src] */
+	FILTER_INSN_NE,
+	FILTER_INSN_GT,
+	FILTER_INSN_LT,
+	FILTER_INSN_GE,
+	FILTER_INSN_LE,
+	FILTER_INSN_EQ_IMM,	/* acc = r[dst] op imm */
+	FILTER_INSN_NE_IMM,
+	FILTER_INSN_GT_IMM,
+	FILTER_INSN_LT_IMM,
+	FILTER_INSN_GE_IMM,
+	FILTER_INSN_LE_IMM,
+	FILTER_INSN_TEST,	/* acc = r[dst] != 0 */
+	FILTER_INSN_STR,	/* acc = test_str(str) */
+	FILTER_INSN_NOT,	/* acc = !acc */
+	FILTER_INSN_JZ,		/* if (!acc) skip the next @skip insns */
+	FILTER_INSN_JNZ,	/* if (acc) skip the next @skip insns */
+	FILTER_INSN_RET,	/* return acc */
+};
 
-	if (!filter->filters)
-		return 0;
+#define FILTER_PROG_REGS	16
+
+struct filter_insn {
+	enum filter_insn_code	code;
+	int			dst;
+	int			src;
+	int			offset;
+	int			skip;
+	pevent_field_read_func	read;
+	unsigned long long	imm;
+	struct filter_arg	*str;
+};
 
-	filter_type = find_filter_type(filter, event_id);
+struct filter_prog {
+	struct event_format	*event;
+	struct filter_insn	*insns;
+	int			nr_insns;
+};
 
-	return filter_type ? 1 : 0;
+static void free_filter_prog(struct filter_prog *prog)
+{
+	if (!prog)
+		return;
+
+	free(prog->insns);
+	free(prog);
 }
 
-/**
- * pevent_filter_match - test if a record matches a filter
- * @filter: filter struct with filter information
- * @record: the record to test against the filter
- *
- * Returns: match result or error code (prefixed with PEVENT_ERRNO__)
- * FILTER_MATCH - filter found for event and @record matches
- * FILTER_MISS  - filter found for event and @record does not match
- * FILTER_NOT_FOUND - no filter found for @record's event
- * NO_FILTER - if no filters exist
- * otherwise - error occurred during test
- */
-enum pevent_errno pevent_filter_match(struct event_filter *filter,
-				      struct pevent_record *record)
+/* Returns the index of the new insn, or -1 on allocation failure */
+static int add_filter_insn(struct filter_prog *prog,
+			   enum filter_insn_code code, int dst)
 {
-	struct pevent *pevent = filter->pevent;
-	struct filter_type *filter_type;
-	int event_id;
-	int ret;
-	enum pevent_errno err = 0;
+	struct filter_insn *insns;
 
-	filter_init_error_buf(filter);
+	insns = realloc(prog->insns, sizeof(*insns) * (prog->nr_insns + 1));
+	if (!insns)
+		return -1;
+	prog->insns = insns;
+	insns = &insns[prog->nr_insns];
+	memset(insns, 0, sizeof(*insns));
+	insns->code = code;
+	insns->dst = dst;
 
-	if (!filter->filters)
-		return PEVENT_ERRNO__NO_FILTER;
+	return prog->nr_insns++;
+}
+
+static int compile_filter_load(struct filter_prog *prog,
+			       struct format_field *field, int reg)
+{
+	struct pevent *pevent = prog->event->pevent;
+	enum filter_insn_code code = FILTER_INSN_LOAD;
+	int is_signed = field->flags & FIELD_IS_SIGNED;
+	int i;
+
+	if (field == &comm)
+		return add_filter_insn(prog, FILTER_INSN_LOAD_COMM, reg);
+
+	if (pevent->host_bigendian == pevent->file_bigendian) {
+		switch (field->size) {
+		case 1:
+			code = is_signed ? FILTER_INSN_LOAD_S8 :
+				FILTER_INSN_LOAD_U8;
+			break;
+		case 2:
+			code = is_signed ? FILTER_INSN_LOAD_S16 :
+				FILTER_INSN_LOAD_U16;
+			break;
+		case 4:
+			code = is_signed ? FILTER_INSN_LOAD_S32 :
+				FILTER_INSN_LOAD_U32;
+			break;
+		case 8:
+			code = FILTER_INSN_LOAD_U64;
+			break;
+		}
+	}
+
+	i = add_filter_insn(prog, code, reg);
+	if (i < 0)
+		return -1;
+	prog->insns[i].offset = field->offset;
+	prog->insns[i].read = field->read_value;
+
+	return i;
+}
+
+/* Compiles @arg the way get_arg_value() reads it, into r[reg] */
+static int compile_filter_value(struct filter_prog *prog,
+				struct filter_arg *arg, int reg)
+{
+	enum filter_insn_code code;
+	int i;
+
+	switch (arg->type) {
+	case FILTER_ARG_FIELD:
+		return compile_filter_load(prog, arg->field.field, reg);
+
+	case FILTER_ARG_VALUE:
+		if (arg->value.type != FILTER_NUMBER)
+			return -1;
+		i = add_filter_insn(prog, FILTER_INSN_IMM, reg);
+		if (i < 0)
+			return -1;
+		prog->insns[i].imm = arg->value.val;
+		return i;
+
+	case FILTER_ARG_EXP:
+		switch (arg->exp.type) {
+		case FILTER_EXP_ADD:	code = FILTER_INSN_ADD;		break;
+		case FILTER_EXP_SUB:	code = FILTER_INSN_SUB;		break;
+		case FILTER_EXP_MUL:	code = FILTER_INSN_MUL;		break;
+		case FILTER_EXP_DIV:	code = FILTER_INSN_DIV;		break;
+		case FILTER_EXP_MOD:	code = FILTER_INSN_MOD;		break;
+		case FILTER_EXP_RSHIFT:	code = FILTER_INSN_RSHIFT;	break;
+		case FILTER_EXP_LSHIFT:	code = FILTER_INSN_LSHIFT;	break;
+		case FILTER_EXP_AND:	code = FILTER_INSN_AND;		break;
+		case FILTER_EXP_OR:	code = FILTER_INSN_OR;		break;
+		case FILTER_EXP_XOR:	code = FILTER_INSN_XOR;		break;
+		default:
+			return -1;
+		}
+		if (reg + 1 >= FILTER_PROG_REGS)
+			return -1;
+		if (compile_filter_value(prog, arg->exp.left, reg) < 0 ||
+		    compile_filter_value(prog, arg->exp.right, reg + 1) < 0)
+			return -1;
+		i = add_filter_insn(prog, code, reg);
+		if (i < 0)
+			return -1;
+		prog->insns[i].src = reg + 1;
+		return i;
+
+	default:
+		return -1;
+	}
+}
+
+static int compile_filter_num(struct filter_prog *prog, struct filter_arg *arg)
+{
+	struct filter_arg *right = arg->num.right;
+	enum filter_insn_code code;
+	int imm;
+	int i;
+
+	switch (arg->num.type) {
+	case FILTER_CMP_EQ:	code = FILTER_INSN_EQ;	break;
+	case FILTER_CMP_NE:	code = FILTER_INSN_NE;	break;
+	case FILTER_CMP_GT:	code = FILTER_INSN_GT;	break;
+	case FILTER_CMP_LT:	code = FILTER_INSN_LT;	break;
+	case FILTER_CMP_GE:	code = FILTER_INSN_GE;	break;
+	case FILTER_CMP_LE:	code = FILTER_INSN_LE;	break;
+	default:
+		return -1;
+	}
+
+	if (compile_filter_value(prog, arg->num.left, 0) < 0)
+		return -1;
+
+	/* Comparing against a number is the common case */
+	imm = right->type == FILTER_ARG_VALUE &&
+		right->value.type == FILTER_NUMBER;
+	if (imm)
+		code += FILTER_INSN_EQ_IMM - FILTER_INSN_EQ;
+	else if (compile_filter_value(prog, right, 1) < 0)
+		return -1;
+
+	i = add_filter_insn(prog, code, 0);
+	if (i < 0)
+		return -1;
+	if (imm)
+		prog->insns[i].imm = right->value.val;
+	else
+		prog->insns[i].src = 1;
+
+	return i;
+}
+
+/* Compiles @arg the way test_filter() tests it, into the accumulator */
+static int compile_filter_test(struct filter_prog *prog, struct filter_arg *arg)
+{
+	int i;
+
+	switch (arg->type) {
+	case FILTER_ARG_BOOLEAN:
+		i = add_filter_insn(prog, FILTER_INSN_BOOL, 0);
+		if (i < 0)
+			return -1;
+		prog->insns[i].imm = arg->boolean.value;
+		return i;
+
+	case FILTER_ARG_OP:
+		switch (arg->op.type) {
+		case FILTER_OP_AND:
+		case FILTER_OP_OR:
+			if (compile_filter_test(prog, arg->op.left) < 0)
+				return -1;
+			i = add_filter_insn(prog, arg->op.type == FILTER_OP_AND ?
+					    FILTER_INSN_JZ : FILTER_INSN_JNZ, 0);
+			if (i < 0 ||
+			    compile_filter_test(prog, arg->op.right) < 0)
+				return -1;
+			prog->insns[i].skip = prog->nr_insns - (i + 1);
+			return i;
+
+		case FILTER_OP_NOT:
+			if (compile_filter_test(prog, arg->op.right) < 0)
+				return -1;
+			return add_filter_insn(prog, FILTER_INSN_NOT, 0);
+
+		default:
+			return -1;
+		}
+
+	case FILTER_ARG_NUM:
+		return compile_filter_num(prog, arg);
+
+	case FILTER_ARG_STR:
+		switch (arg->str.type) {
+		case FILTER_CMP_MATCH:
+		case FILTER_CMP_NOT_MATCH:
+		case FILTER_CMP_REGEX:
+		case FILTER_CMP_NOT_REGEX:
+			break;
+		default:
+			return -1;
+		}
+		i = add_filter_insn(prog, FILTER_INSN_STR, 0);
+		if (i < 0)
+			return -1;
+		prog->insns[i].str = arg;
+		return i;
+
+	case FILTER_ARG_EXP:
+	case FILTER_ARG_VALUE:
+	case FILTER_ARG_FIELD:
+		if (compile_filter_value(prog, arg, 0) < 0)
+			return -1;
+		return add_filter_insn(prog, FILTER_INSN_TEST, 0);
+
+	default:
+		return -1;
+	}
+}
+
+/*
+ * A jump is only taken with a known accumulator, so if it lands on
+ * another jump, where that one goes is known too. This makes a chain
+ * of && or || leave from the first test that decides it.
+ */
+static void thread_filter_jumps(struct filter_prog *prog)
+{
+	struct filter_insn *insn;
+	struct filter_insn *next;
+	int i;
+
+	/* Go backward so that later jumps are already threaded */
+	for (i = prog->nr_insns - 1; i >= 0; i--) {
+		insn = &prog->insns[i];
+		if (insn->code != FILTER_INSN_JZ &&
+		    insn->code != FILTER_INSN_JNZ)
+			continue;
+		next = insn + 1 + insn->skip;
+		if (next->code == insn->code)
+			insn->skip += 1 + next->skip;
+		else if (next->code == FILTER_INSN_JZ ||
+			 next->code == FILTER_INSN_JNZ)
+			insn->skip++;
+	}
+}
+
+static struct filter_prog *
+compile_filter_prog(struct event_format *event, struct filter_arg *arg)
+{
+	struct filter_prog *prog;
+
+	if (!event || !arg)
+		return NULL;
+
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return NULL;
+	prog->event = event;
+
+	if (compile_filter_test(prog, arg) < 0 ||
+	    add_filter_insn(prog, FILTER_INSN_RET, 0) < 0) {
+		free_filter_prog(prog);
+		return NULL;
+	}
+
+	thread_filter_jumps(prog);
+
+	return prog;
+}
+
+static int run_filter_prog(struct filter_prog *prog,
+			   struct pevent_record *record)
+{
+	unsigned long long regs[FILTER_PROG_REGS];
+	struct filter_insn *insn;
+	const char *data = record->data;
+	enum pevent_errno err = 0;
+	unsigned short u16;
+	unsigned int u32;
+	int acc = 0;
+
+	for (insn = prog->insns; ; insn++) {
+		unsigned long long *dst = &regs[insn->dst];
+
+		switch (insn->code) {
+		case FILTER_INSN_BOOL:
+			acc = insn->imm;
+			break;
+		case FILTER_INSN_IMM:
+			*dst = insn->imm;
+			break;
+		case FILTER_INSN_LOAD:
+			*dst = insn->read(data + insn->offset);
+			break;
+		case FILTER_INSN_LOAD_U8:
+			*dst = *(unsigned char *)(data + insn->offset);
+			break;
+		case FILTER_INSN_LOAD_S8:
+			*dst = *(signed char *)(data + insn->offset);
+			break;
+		case FILTER_INSN_LOAD_U16:
+			memcpy(&u16, data + insn->offset, sizeof(u16));
+			*dst = u16;
+			break;
+		case FILTER_INSN_LOAD_S16:
+			memcpy(&u16, data + insn->offset, sizeof(u16));
+			*dst = (short)u16;
+			break;
+		case FILTER_INSN_LOAD_U32:
+			memcpy(&u32, data + insn->offset, sizeof(u32));
+			*dst = u32;
+			break;
+		case FILTER_INSN_LOAD_S32:
+			memcpy(&u32, data + insn->offset, sizeof(u32));
+			*dst = (int)u32;
+			break;
+		case FILTER_INSN_LOAD_U64:
+			memcpy(dst, data + insn->offset, sizeof(*dst));
+			break;
+		case FILTER_INSN_LOAD_COMM:
+			*dst = (unsigned long)get_comm(prog->event, record);
+			break;
+		case FILTER_INSN_ADD:
+			*dst += regs[insn->src];
+			break;
+		case FILTER_INSN_SUB:
+			*dst -= regs[insn->src];
+			break;
+		case FILTER_INSN_MUL:
+			*dst *= regs[insn->src];
+			break;
+		case FILTER_INSN_DIV:
+			*dst /= regs[insn->src];
+			break;
+		case FILTER_INSN_MOD:
+			*dst %= regs[insn->src];
+			break;
+		case FILTER_INSN_RSHIFT:
+			*dst >>= regs[insn->src];
+			break;
+		case FILTER_INSN_LSHIFT:
+			*dst <<= regs[insn->src];
+			break;
+		case FILTER_INSN_AND:
+			*dst &= regs[insn->src];
+			break;
+		case FILTER_INSN_OR:
+			*dst |= regs[insn->src];
+			break;
+		case FILTER_INSN_XOR:
+			*dst ^= regs[insn->src];
+			break;
+		case FILTER_INSN_EQ:
+			acc = *dst == regs[insn->src];
+			break;
+		case FILTER_INSN_NE:
+			acc = *dst != regs[insn->src];
+			break;
+		case FILTER_INSN_GT:
+			acc = *dst > regs[insn->src];
+			break;
+		case FILTER_INSN_LT:
+			acc = *dst < regs[insn->src];
+			break;
+		case FILTER_INSN_GE:
+			acc = *dst >= regs[insn->src];
+			break;
+		case FILTER_INSN_LE:
+			acc = *dst <= regs[insn->src];
+			break;
+		case FILTER_INSN_EQ_IMM:
+			acc = *dst == insn->imm;
+			break;
+		case FILTER_INSN_NE_IMM:
+			acc = *dst != insn->imm;
+			break;
+		case FILTER_INSN_GT_IMM:
+			acc = *dst > insn->imm;
+			break;
+		case FILTER_INSN_LT_IMM:
+			acc = *dst < insn->imm;
+			break;
+		case FILTER_INSN_GE_IMM:
+			acc = *dst >= insn->imm;
+			break;
+		case FILTER_INSN_LE_IMM:
+			acc = *dst <= insn->imm;
+			break;
+		case FILTER_INSN_TEST:
+			acc = *dst != 0;
+			break;
+		case FILTER_INSN_STR:
+			/* The compiler only lets through what can not fail */
+			acc = test_str(prog->event, insn->str, record, &err);
+			break;
+		case FILTER_INSN_NOT:
+			acc = !acc;
+			break;
+		case FILTER_INSN_JZ:
+			if (!acc)
+				insn += insn->skip;
+			break;
+		case FILTER_INSN_JNZ:
+			if (acc)
+				insn += insn->skip;
+			break;
+		case FILTER_INSN_RET:
+			return acc;
+		}
+	}
+}
+
+/**
+ * pevent_event_filtered - return true if event has filter
+ * @filter: filter struct with filter information
+ * @event_id: event id to test if filter exists
+ *
+ * Returns 1 if filter found for @event_id
+ *   otherwise 0;
+ */
+int pevent_event_filtered(struct event_filter *filter, int event_id)
+{
+	struct filter_type *filter_type;
+
+	if (!filter->filters)
+		return 0;
+
+	filter_type = find_filter_type(filter, event_id);
+
+	return filter_type ? 1 : 0;
+}
+
+/**
+ * pevent_filter_match - test if a record matches a filter
+ * @filter: filter struct with filter information
+ * @record: the record to test against the filter
+ *
+ * Returns: match result or error code (prefixed with PEVENT_ERRNO__)
+ * FILTER_MATCH - filter found for event and @record matches
+ * FILTER_MISS  - filter found for event and @record does not match
+ * FILTER_NOT_FOUND - no filter found for @record's event
+ * NO_FILTER - if no filters exist
+ * otherwise - error occurred during test
+ */
+enum pevent_errno pevent_filter_match(struct event_filter *filter,
+				      struct pevent_record *record)
+{
+	struct pevent *pevent = filter->pevent;
+	struct filter_type *filter_type;
+	int event_id;
+	int ret;
+	enum pevent_errno err = 0;
+
+	filter_clear_error_buf(filter);
+
+	if (!filter->filters)
+		return PEVENT_ERRNO__NO_FILTER;
 
 	event_id = pevent_data_type(pevent, record);
 
+	if (event_id >= 0 && event_id < filter->nr_event_ids) {
+		switch (filter->event_ids[event_id] & FILTER_ID_TRIVIAL) {
+		case FILTER_ID_TRUE:
+			return PEVENT_ERRNO__FILTER_MATCH;
+		case FILTER_ID_FALSE:
+			return PEVENT_ERRNO__FILTER_MISS;
+		}
+	}
+
 	filter_type = find_filter_type(filter, event_id);
 	if (!filter_type)
 		return PEVENT_ERRNO__FILTER_NOT_FOUND;
 
-	ret = test_filter(filter_type->event, filter_type->filter, record, &err);
-	if (err)
-		return err;
+	if (filter_type->prog)
+		ret = run_filter_prog(filter_type->prog, record);
+	else {
+		ret = test_filter(filter_type->event, filter_type->filter,
+				  record, &err);
+		if (err)
+			return err;
+	}
 
 	return ret ? PEVENT_ERRNO__FILTER_MATCH : PEVENT_ERRNO__FILTER_MISS;
 }
 
+/*
+ * pevent_filter_match_batch() groups the records by event, and runs
+ * the program of each event over up to FILTER_BATCH_ROWS of its
+ * records at a time, one instruction for all of them before the next.
+ * Each instruction is then a plain loop over columns of values that
+ * the compiler can vectorize, instead of a dispatch per record.
+ *
+ * The rows that take a jump are set aside at its target, and only the
+ * rows still active write the accumulator. Registers are never live
+ * across a jump, so they are computed for all rows, except where that
+ * could fail or costs more than it saves (division, comms, strings).
+ */
+#define FILTER_BATCH_ROWS	256
+#define FILTER_BATCH_WINDOW	4096
+#define FILTER_BITS		(sizeof(unsigned long) * 8)
+
+struct filter_batch {
+	unsigned long long	regs[FILTER_PROG_REGS][FILTER_BATCH_ROWS];
+	unsigned char		acc[FILTER_BATCH_ROWS];
+	unsigned char		active[FILTER_BATCH_ROWS];
+	const char		*data[FILTER_BATCH_ROWS];
+	struct pevent_record	*records[FILTER_BATCH_ROWS];
+	/* rows that jumped to each insn, if jumped[insn] */
+	unsigned char		*pending;
+	unsigned char		*jumped;
+	int			nr_insns;
+};
+
+/* Makes room in @batch for the jumps of @prog */
+static int filter_batch_fit(struct filter_batch *batch,
+			    struct filter_prog *prog)
+{
+	unsigned char *pending;
+	unsigned char *jumped;
+
+	if (prog->nr_insns <= batch->nr_insns)
+		return 0;
+
+	pending = realloc(batch->pending,
+			  prog->nr_insns * FILTER_BATCH_ROWS);
+	if (!pending)
+		return -1;
+	batch->pending = pending;
+
+	jumped = realloc(batch->jumped, prog->nr_insns);
+	if (!jumped)
+		return -1;
+	batch->jumped = jumped;
+
+	batch->nr_insns = prog->nr_insns;
+
+	return 0;
+}
+
+#define BATCH_LOAD(type)						\
+	for (i = 0; i < n; i++) {					\
+		type val;						\
+		memcpy(&val, batch->data[i] + insn->offset, sizeof(val)); \
+		dst[i] = val;						\
+	}
+
+#define BATCH_ALU(op)							\
+	for (i = 0; i < n; i++)						\
+		dst[i] op src[i]
+
+#define BATCH_SET_ACC(expr)						\
+	for (i = 0; i < n; i++)						\
+		acc[i] = active[i] ? (expr) : acc[i]
+
+#define BATCH_JUMP(cond)						\
+	do {								\
+		unsigned char *to;					\
+		int target = pc + 1 + insn->skip;			\
+									\
+		to = batch->pending + target * FILTER_BATCH_ROWS;	\
+		if (!batch->jumped[target]) {				\
+			memset(to, 0, n);				\
+			batch->jumped[target] = 1;			\
+		}							\
+		for (i = 0; i < n; i++) {				\
+			unsigned char take = active[i] & (cond);	\
+									\
+			to[i] |= take;					\
+			active[i] &= !take;				\
+		}							\
+	} while (0)
+
+/* Runs @prog over the first @n rows of @batch, leaving the results in acc */
+static void run_filter_batch(struct filter_prog *prog,
+			     struct filter_batch *batch, int n)
+{
+	unsigned char *active = batch->active;
+	unsigned char *acc = batch->acc;
+	enum pevent_errno err = 0;
+	struct filter_insn *insn;
+	unsigned long long *dst;
+	unsigned long long *src;
+	unsigned char *from;
+	int pc;
+	int i;
+
+	memset(active, 1, n);
+	memset(acc, 0, n);
+	memset(batch->jumped, 0, prog->nr_insns);
+
+	for (pc = 0; pc < prog->nr_insns; pc++) {
+		insn = &prog->insns[pc];
+		dst = batch->regs[insn->dst];
+		src = batch->regs[insn->src];
+
+		if (batch->jumped[pc]) {
+			from = batch->pending + pc * FILTER_BATCH_ROWS;
+			for (i = 0; i < n; i++)
+				active[i] |= from[i];
+		}
+
+		switch (insn->code) {
+		case FILTER_INSN_BOOL:
+			BATCH_SET_ACC(!!insn->imm);
+			break;
+		case FILTER_INSN_IMM:
+			for (i = 0; i < n; i++)
+				dst[i] = insn->imm;
+			break;
+		case FILTER_INSN_LOAD:
+			for (i = 0; i < n; i++)
+				dst[i] = insn->read(batch->data[i] + insn->offset);
+			break;
+		case FILTER_INSN_LOAD_U8:
+			BATCH_LOAD(unsigned char);
+			break;
+		case FILTER_INSN_LOAD_S8:
+			BATCH_LOAD(signed char);
+			break;
+		case FILTER_INSN_LOAD_U16:
+			BATCH_LOAD(unsigned short);
+			break;
+		case FILTER_INSN_LOAD_S16:
+			BATCH_LOAD(short);
+			break;
+		case FILTER_INSN_LOAD_U32:
+			BATCH_LOAD(unsigned int);
+			break;
+		case FILTER_INSN_LOAD_S32:
+			BATCH_LOAD(int);
+			break;
+		case FILTER_INSN_LOAD_U64:
+			BATCH_LOAD(unsigned long long);
+			break;
+		case FILTER_INSN_LOAD_COMM:
+			for (i = 0; i < n; i++) {
+				if (active[i])
+					dst[i] = (unsigned long)
+						get_comm(prog->event,
+							 batch->records[i]);
+			}
+			break;
+		case FILTER_INSN_ADD:
+			BATCH_ALU(+=);
+			break;
+		case FILTER_INSN_SUB:
+			BATCH_ALU(-=);
+			break;
+		case FILTER_INSN_MUL:
+			BATCH_ALU(*=);
+			break;
+		case FILTER_INSN_DIV:
+			for (i = 0; i < n; i++) {
+				if (active[i])
+					dst[i] /= src[i];
+			}
+			break;
+		case FILTER_INSN_MOD:
+			for (i = 0; i < n; i++) {
+				if (active[i])
+					dst[i] %= src[i];
+			}
+			break;
+		case FILTER_INSN_RSHIFT:
+			BATCH_ALU(>>=);
+			break;
+		case FILTER_INSN_LSHIFT:
+			BATCH_ALU(<<=);
+			break;
+		case FILTER_INSN_AND:
+			BATCH_ALU(&=);
+			break;
+		case FILTER_INSN_OR:
+			BATCH_ALU(|=);
+			break;
+		case FILTER_INSN_XOR:
+			BATCH_ALU(^=);
+			break;
+		case FILTER_INSN_EQ:
+			BATCH_SET_ACC(dst[i] == src[i]);
+			break;
+		case FILTER_INSN_NE:
+			BATCH_SET_ACC(dst[i] != src[i]);
+			break;
+		case FILTER_INSN_GT:
+			BATCH_SET_ACC(dst[i] > src[i]);
+			break;
+		case FILTER_INSN_LT:
+			BATCH_SET_ACC(dst[i] < src[i]);
+			break;
+		case FILTER_INSN_GE:
+			BATCH_SET_ACC(dst[i] >= src[i]);
+			break;
+		case FILTER_INSN_LE:
+			BATCH_SET_ACC(dst[i] <= src[i]);
+			break;
+		case FILTER_INSN_EQ_IMM:
+			BATCH_SET_ACC(dst[i] == insn->imm);
+			break;
+		case FILTER_INSN_NE_IMM:
+			BATCH_SET_ACC(dst[i] != insn->imm);
+			break;
+		case FILTER_INSN_GT_IMM:
+			BATCH_SET_ACC(dst[i] > insn->imm);
+			break;
+		case FILTER_INSN_LT_IMM:
+			BATCH_SET_ACC(dst[i] < insn->imm);
+			break;
+		case FILTER_INSN_GE_IMM:
+			BATCH_SET_ACC(dst[i] >= insn->imm);
+			break;
+		case FILTER_INSN_LE_IMM:
+			BATCH_SET_ACC(dst[i] <= insn->imm);
+			break;
+		case FILTER_INSN_TEST:
+			BATCH_SET_ACC(dst[i] != 0);
+			break;
+		case FILTER_INSN_STR:
+			for (i = 0; i < n; i++) {
+				if (active[i])
+					acc[i] = !!test_str(prog->event,
+							    insn->str,
+							    batch->records[i],
+							    &err);
+			}
+			break;
+		case FILTER_INSN_NOT:
+			for (i = 0; i < n; i++)
+				acc[i] ^= active[i];
+			break;
+		case FILTER_INSN_JZ:
+			BATCH_JUMP(!acc[i]);
+			break;
+		case FILTER_INSN_JNZ:
+			BATCH_JUMP(acc[i]);
+			break;
+		case FILTER_INSN_RET:
+			/* Every jump lands at or before here */
+			return;
+		}
+	}
+}
+
+#undef BATCH_LOAD
+#undef BATCH_ALU
+#undef BATCH_SET_ACC
+#undef BATCH_JUMP
+
+static inline void set_match_bit(unsigned long *matches, int i)
+{
+	matches[i / FILTER_BITS] |= 1UL << (i % FILTER_BITS);
+}
+
+/*
+ * Matches the records one at a time, for what the batch can not do.
+ * @rows picks @nr of @records, or is NULL for the first @nr.
+ */
+static enum pevent_errno
+filter_match_each(struct event_filter *filter, struct pevent_record **records,
+		  int *rows, int nr, unsigned long *matches)
+{
+	enum pevent_errno err = 0;
+	enum pevent_errno ret;
+	int row;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		row = rows ? rows[i] : i;
+		ret = pevent_filter_match(filter, records[row]);
+		switch (ret) {
+		case PEVENT_ERRNO__FILTER_MATCH:
+			set_match_bit(matches, row);
+			break;
+		case PEVENT_ERRNO__FILTER_MISS:
+		case PEVENT_ERRNO__FILTER_NOT_FOUND:
+		case PEVENT_ERRNO__NO_FILTER:
+			break;
+		default:
+			if (!err)
+				err = ret;
+		}
+	}
+
+	return err;
+}
+
+/* Runs the program of @filter_type over @nr of @records, picked by @rows */
+static void filter_match_rows(struct filter_type *filter_type,
+			      struct filter_batch *batch,
+			      struct pevent_record **records,
+			      int *rows, int nr, unsigned long *matches)
+{
+	int n;
+	int i;
+
+	while (nr) {
+		n = nr < FILTER_BATCH_ROWS ? nr : FILTER_BATCH_ROWS;
+		for (i = 0; i < n; i++) {
+			batch->records[i] = records[rows[i]];
+			batch->data[i] = records[rows[i]]->data;
+		}
+
+		run_filter_batch(filter_type->prog, batch, n);
+
+		for (i = 0; i < n; i++) {
+			if (batch->acc[i])
+				set_match_bit(matches, rows[i]);
+		}
+		rows += n;
+		nr -= n;
+	}
+}
+
+/*
+ * Matches up to FILTER_BATCH_WINDOW @records, so that the records
+ * looked at to sort them are still in the cache when they are matched.
+ * @keys and @rows have room for the window, and @counts for a key per
+ * filter and one more.
+ */
+static enum pevent_errno
+filter_match_window(struct event_filter *filter, struct filter_batch *batch,
+		    struct pevent_record **records, int nr,
+		    unsigned long *matches, int *keys, int *rows, int *counts)
+{
+	struct filter_type *filter_type;
+	unsigned int slot;
+	int event_id;
+	int start;
+	int i;
+
+	memset(counts, 0, sizeof(*counts) * (filter->filters + 1));
+
+	/*
+	 * Answer the trivial filters right away, and sort the rest by
+	 * filter with a counting sort. Key 0 is for the records that
+	 * go through pevent_filter_match() one at a time.
+	 */
+	for (i = 0; i < nr; i++) {
+		event_id = pevent_data_type(filter->pevent, records[i]);
+		keys[i] = -1;
+
+		if (event_id < 0 || event_id >= FILTER_IDS_MAX) {
+			keys[i] = 0;
+		} else if (event_id < filter->nr_event_ids) {
+			slot = filter->event_ids[event_id];
+			if (slot & FILTER_ID_TRUE)
+				set_match_bit(matches, i);
+			else if (slot && !(slot & FILTER_ID_FALSE)) {
+				slot >>= FILTER_ID_SHIFT;
+				filter_type = &filter->event_filters[slot - 1];
+				if (filter_type->prog &&
+				    !filter_batch_fit(batch, filter_type->prog))
+					keys[i] = slot;
+				else
+					keys[i] = 0;
+			}
+		}
+
+		if (keys[i] >= 0)
+			counts[keys[i]]++;
+	}
+
+	for (start = 0, i = 0; i <= filter->filters; i++) {
+		int count = counts[i];
+
+		counts[i] = start;
+		start += count;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (keys[i] >= 0)
+			rows[counts[keys[i]]++] = i;
+	}
+
+	/* counts[k] is now where the rows of key k + 1 start */
+	for (i = 1; i <= filter->filters; i++) {
+		start = counts[i - 1];
+		if (counts[i] > start)
+			filter_match_rows(&filter->event_filters[i - 1], batch,
+					  records, rows + start,
+					  counts[i] - start, matches);
+	}
+
+	return filter_match_each(filter, records, rows, counts[0], matches);
+}
+
+/**
+ * pevent_filter_match_batch - test if records match a filter
+ * @filter: filter struct with filter information
+ * @records: the records to test against the filter
+ * @nr: the number of @records
+ * @matches: bitmap of at least @nr bits, set for the records that match
+ *
+ * Gives the same answers as calling pevent_filter_match() on each of
+ * @records, with a bit set in @matches for each one that returns
+ * FILTER_MATCH. Records of events without a filter do not match.
+ *
+ * Returns 0, or the first error that pevent_filter_match() would
+ * have returned. The records that failed do not match.
+ */
+enum pevent_errno pevent_filter_match_batch(struct event_filter *filter,
+					    struct pevent_record **records,
+					    int nr, unsigned long *matches)
+{
+	struct filter_batch *batch = NULL;
+	enum pevent_errno err = 0;
+	enum pevent_errno ret;
+	int *counts = NULL;
+	int *rows = NULL;
+	int *keys = NULL;
+	int start;
+	int n;
+
+	if (nr <= 0)
+		return 0;
+
+	memset(matches, 0, (nr + FILTER_BITS - 1) / FILTER_BITS *
+	       sizeof(*matches));
+
+	filter_clear_error_buf(filter);
+
+	if (!filter->filters)
+		return 0;
+
+	n = nr < FILTER_BATCH_WINDOW ? nr : FILTER_BATCH_WINDOW;
+	keys = malloc(sizeof(*keys) * n);
+	rows = malloc(sizeof(*rows) * n);
+	counts = malloc(sizeof(*counts) * (filter->filters + 1));
+	batch = calloc(1, sizeof(*batch));
+	if (!keys || !rows || !counts || !batch) {
+		/* Do it the slow way */
+		err = filter_match_each(filter, records, NULL, nr, matches);
+		goto out;
+	}
+
+	/* The windows start on a word of @matches */
+	for (start = 0; start < nr; start += n) {
+		n = nr - start;
+		if (n > FILTER_BATCH_WINDOW)
+			n = FILTER_BATCH_WINDOW;
+		ret = filter_match_window(filter, batch, records + start, n,
+					  matches + start / FILTER_BITS,
+					  keys, rows, counts);
+		if (!err)
+			err = ret;
+	}
+
+ out:
+	if (batch) {
+		free(batch->pending);
+		free(batch->jumped);
+	}
+	free(batch);
+	free(counts);
+	free(rows);
+	free(keys);
+
+	return err;
+}
+
 static char *op_to_str(struct event_filter *filter, struct filter_arg *arg)
 {
 	char *str = NULL;
@@ -42,6 +42,8 @@ void __weak die(const char *fmt, ...)
 
 void __vwarning(const char *fmt, va_list ap)
 {
+	/* Keep the lines of warnings from different threads apart */
+	flockfile(stderr);
 	if (errno)
 		perror("trace-cmd");
 	errno = 0;
@@ -50,6 +52,7 @@ void __vwarning(const char *fmt, va_list ap)
 	vfprintf(stderr, fmt, ap);
 
 	fprintf(stderr, "\n");
+	funlockfile(stderr);
 }
 
 void __warning(const char *fmt, ...)
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "trace-cmd.h"
 
@@ -30,6 +31,12 @@ static struct func_stack {
 
 static int cpus = -1;
 
+/*
+ * trace-cmd report -j formats the records of different CPUs in
+ * different threads, each CPU's records staying in order.
+ */
+static pthread_mutex_t fstack_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define STK_BLK 10
 
 struct pevent_plugin_option plugin_options[] =
@@ -141,8 +148,11 @@ static int function_handler(struct trace_seq *s, struct pevent_record *record,
 
 	parent = pevent_find_function(pevent, pfunction);
 
-	if (parent && ftrace_indent->set)
+	if (parent && ftrace_indent->set) {
+		pthread_mutex_lock(&fstack_lock);
 		index = add_and_get_index(parent, func, record->cpu);
+		pthread_mutex_unlock(&fstack_lock);
+	}
 
 	trace_seq_printf(s, "%*s", index*3, "");
 
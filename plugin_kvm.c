@@ -28,12 +28,15 @@
 
 #include <udis86.h>
 
-static ud_t ud;
+/* Per thread, as trace-cmd report -j prints from several threads */
+static __thread ud_t ud;
+static __thread int ud_ready;
 
 static void init_disassembler(void)
 {
 	ud_init(&ud);
 	ud_set_syntax(&ud, UD_SYN_ATT);
+	ud_ready = 1;
 }
 
 static const char *disassemble(unsigned char *insn, int len, uint64_t rip,
@@ -42,6 +45,9 @@ static const char *disassemble(unsigned char *insn, int len, uint64_t rip,
 {
 	int mode;
 
+	if (!ud_ready)
+		init_disassembler();
+
 	if (!cr0_pe)
 		mode = 16;
 	else if (eflags_vm)
@@ -70,7 +76,7 @@ static const char *disassemble(unsigned char *insn, int len, uint64_t rip,
 			       int cr0_pe, int eflags_vm,
 			       int cs_d, int cs_l)
 {
-	static char out[15*3+1];
+	static __thread char out[15*3+1];
 	int i;
 
 	for (i = 0; i < len; ++i)
@@ -36,6 +36,8 @@ void warning(const char *fmt, ...)
 	if (silence_warnings)
 		return;
 
+	/* Keep the lines of warnings from different threads apart */
+	flockfile(stderr);
 	if (errno)
 		perror("trace-cmd");
 	errno = 0;
@@ -46,6 +48,7 @@ void warning(const char *fmt, ...)
 	va_end(ap);
 
 	fprintf(stderr, "\n");
+	funlockfile(stderr);
 }
 
 void pr_stat(const char *fmt, ...)
@@ -431,6 +434,9 @@ int main (int argc, char **argv)
 	} else if (strcmp(argv[1], "split") == 0) {
 		trace_split(argc, argv);
 		exit(0);
+	} else if (strcmp(argv[1], "convert") == 0) {
+		trace_convert(argc, argv);
+		exit(0);
 	} else if (strcmp(argv[1], "restore") == 0) {
 		trace_restore(argc, argv);
 		exit(0);
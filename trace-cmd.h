@@ -89,6 +89,8 @@ enum {
 	TRACECMD_OPTION_TRACECLOCK,
 	TRACECMD_OPTION_UNAME,
 	TRACECMD_OPTION_HOOK,
+	TRACECMD_OPTION_PAGE_INDEX,
+	TRACECMD_OPTION_PAGE_EVENTS,
 };
 
 enum {
@@ -152,12 +154,40 @@ tracecmd_peek_data_ref(struct tracecmd_input *handle, int cpu)
 
 struct pevent_record *
 tracecmd_read_data(struct tracecmd_input *handle, int cpu);
+int tracecmd_read_batch(struct tracecmd_input *handle, int cpu,
+			struct pevent_record *records, int max);
 
 struct pevent_record *
 tracecmd_read_prev(struct tracecmd_input *handle, struct pevent_record *record);
 
 struct pevent_record *
 tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu);
+void tracecmd_set_read_cpus(struct tracecmd_input *handle, const int *cpus);
+int tracecmd_set_read_events(struct tracecmd_input *handle, const int *ids);
+int tracecmd_set_read_pids(struct tracecmd_input *handle, const int *ids,
+			   const int *pids);
+void tracecmd_set_read_follow(struct tracecmd_input *handle, int id);
+
+typedef int (*tracecmd_read_filter_func)(struct tracecmd_input *handle,
+					 struct pevent_record *record,
+					 void *data);
+int tracecmd_start_read_threads(struct tracecmd_input *handle, int nr_threads,
+				tracecmd_read_filter_func filter, void *data);
+void tracecmd_stop_read_threads(struct tracecmd_input *handle);
+
+struct tracecmd_iter;
+struct tracecmd_iter *
+tracecmd_iter_new(struct tracecmd_input *handle, const int *cpus,
+		  unsigned long long ts);
+void tracecmd_iter_free(struct tracecmd_iter *iter);
+int tracecmd_iter_set_timestamp(struct tracecmd_iter *iter,
+				unsigned long long ts);
+struct pevent_record *
+tracecmd_iter_peek_data(struct tracecmd_iter *iter, int cpu);
+struct pevent_record *
+tracecmd_iter_read_data(struct tracecmd_iter *iter, int cpu);
+struct pevent_record *
+tracecmd_iter_read_next_data(struct tracecmd_iter *iter, int *rec_cpu);
 
 struct pevent_record *
 tracecmd_read_at(struct tracecmd_input *handle, unsigned long long offset,
@@ -240,6 +270,7 @@ void tracecmd_output_close(struct tracecmd_output *handle);
 void tracecmd_output_free(struct tracecmd_output *handle);
 struct tracecmd_output *tracecmd_copy(struct tracecmd_input *ihandle,
 				      const char *file);
+int tracecmd_output_set_compress(struct tracecmd_output *handle);
 int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 			     int cpus, char * const *cpu_data_files);
 int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
@@ -0,0 +1,795 @@
+/*
+ * Copyright (C) 2015 Red Hat Inc, Steven Rostedt <srostedt@redhat.com>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License (not later!)
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not,  see <http://www.gnu.org/licenses>
+ *
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ */
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <endian.h>
+#include <errno.h>
+
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+
+#include "trace-local.h"
+#include "trace-hash.h"
+
+/*
+ * trace-cmd convert writes the events of a trace.dat file into
+ * tables, one per event type, stored column by column. The layout
+ * is described in Documentation/trace-cmd-convert.1.txt. All numbers
+ * in the file are little endian.
+ */
+
+#define CONVERT_MAGIC		"TRACECOL"
+#define CONVERT_VERSION		1
+
+/* Rows of a table that are written (and compressed) together */
+#define CONVERT_CHUNK_ROWS	16384
+
+enum convert_block {
+	CONVERT_BLOCK_END	= 0,
+	CONVERT_BLOCK_TABLE	= 1,
+	CONVERT_BLOCK_DICT	= 2,
+	CONVERT_BLOCK_CHUNK	= 3,
+};
+
+enum convert_type {
+	CONVERT_U8		= 1,
+	CONVERT_S8		= 2,
+	CONVERT_U16		= 3,
+	CONVERT_S16		= 4,
+	CONVERT_U32		= 5,
+	CONVERT_S32		= 6,
+	CONVERT_U64		= 7,
+	CONVERT_S64		= 8,
+	CONVERT_STRING		= 9,	/* 4 byte length + bytes per row */
+	CONVERT_BYTES		= 10,	/* 4 byte length + raw field data */
+	CONVERT_COMM		= 11,	/* 4 byte index in the comm dictionary */
+	CONVERT_SYM		= 12,	/* 4 byte index in the symbol dictionary */
+};
+
+enum convert_dict_id {
+	CONVERT_DICT_COMM	= 0,
+	CONVERT_DICT_SYM	= 1,
+	CONVERT_NR_DICTS,
+};
+
+enum convert_encoding {
+	CONVERT_ENC_PLAIN	= 0,
+	CONVERT_ENC_DELTA	= 1,	/* zigzag varints of the differences */
+};
+
+enum convert_compression {
+	CONVERT_COMP_NONE	= 0,
+	CONVERT_COMP_ZLIB	= 1,
+};
+
+/* Symbol columns hold this for addresses that are not a known function */
+#define CONVERT_NO_SYM		0xffffffffU
+
+enum convert_source {
+	CONVERT_SRC_TS,
+	CONVERT_SRC_CPU,
+	CONVERT_SRC_COMM,
+	CONVERT_SRC_FIELD,
+	CONVERT_SRC_SYM,
+};
+
+struct convert_buf {
+	unsigned char		*data;
+	unsigned long long	len;
+	unsigned long long	size;
+};
+
+struct convert_column {
+	char			*name;
+	struct format_field	*field;
+	enum convert_source	source;
+	enum convert_type	type;
+	struct convert_buf	buf;
+};
+
+struct convert_table {
+	struct trace_hash_item	hash;
+	struct event_format	*event;
+	struct convert_column	*columns;
+	int			nr_columns;
+	unsigned int		nr_rows;
+};
+
+struct convert_str {
+	struct trace_hash_item	hash;
+	const char		*str;
+	unsigned int		id;
+};
+
+struct convert_dict {
+	struct trace_hash	hash;
+	struct convert_str	**strs;
+	unsigned int		nr_strs;
+	unsigned int		nr_written;
+	unsigned int		size;
+};
+
+static const char *default_input_file = "trace.dat";
+static const char *default_output_file = "trace.col";
+
+static FILE *convert_fp;
+static const char *convert_file;
+static struct trace_hash convert_tables;
+static struct convert_dict convert_dicts[CONVERT_NR_DICTS];
+static struct convert_buf convert_scratch;
+static int convert_compress = 1;
+
+static void convert_write(const void *data, unsigned long long size)
+{
+	if (size && fwrite(data, 1, size, convert_fp) != size)
+		die("Failed writing to %s", convert_file);
+}
+
+static void buf_reserve(struct convert_buf *buf, unsigned long long len)
+{
+	if (buf->len + len <= buf->size)
+		return;
+
+	if (!buf->size)
+		buf->size = 4096;
+	while (buf->len + len > buf->size)
+		buf->size *= 2;
+	buf->data = realloc(buf->data, buf->size);
+	if (!buf->data)
+		die("Failed to allocate column buffer");
+}
+
+static void buf_add(struct convert_buf *buf, const void *data,
+		    unsigned long long len)
+{
+	buf_reserve(buf, len);
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void buf_add_8(struct convert_buf *buf, unsigned char val)
+{
+	buf_add(buf, &val, 1);
+}
+
+static void buf_add_16(struct convert_buf *buf, unsigned short val)
+{
+	val = htole16(val);
+	buf_add(buf, &val, 2);
+}
+
+static void buf_add_32(struct convert_buf *buf, unsigned int val)
+{
+	val = htole32(val);
+	buf_add(buf, &val, 4);
+}
+
+static void buf_add_64(struct convert_buf *buf, unsigned long long val)
+{
+	val = htole64(val);
+	buf_add(buf, &val, 8);
+}
+
+static void buf_add_str(struct convert_buf *buf, const char *str)
+{
+	buf_add(buf, str, strlen(str) + 1);
+}
+
+static void buf_add_varint(struct convert_buf *buf, unsigned long long val)
+{
+	while (val >= 0x80) {
+		buf_add_8(buf, (val & 0x7f) | 0x80);
+		val >>= 7;
+	}
+	buf_add_8(buf, val);
+}
+
+/* Blocks are a 4 byte type and 8 byte size followed by the payload */
+static void write_block(enum convert_block type, struct convert_buf *buf)
+{
+	unsigned long long size = buf ? buf->len : 0;
+	unsigned int type4 = htole32(type);
+
+	size = htole64(size);
+	convert_write(&type4, 4);
+	convert_write(&size, 8);
+	if (buf)
+		convert_write(buf->data, buf->len);
+}
+
+static int match_str(struct trace_hash_item *item, void *data)
+{
+	struct convert_str *cstr = container_of(item, struct convert_str, hash);
+
+	return strcmp(cstr->str, data) == 0;
+}
+
+static unsigned int dict_id(struct convert_dict *dict, const char *str)
+{
+	struct trace_hash_item *item;
+	struct convert_str *cstr;
+	unsigned int key;
+
+	key = trace_hash_str((char *)str);
+	item = trace_hash_find(&dict->hash, key, match_str, (void *)str);
+	if (item) {
+		cstr = container_of(item, struct convert_str, hash);
+		return cstr->id;
+	}
+
+	if (dict->nr_strs == dict->size) {
+		dict->size = dict->size ? dict->size * 2 : 256;
+		dict->strs = realloc(dict->strs, sizeof(*dict->strs) * dict->size);
+		if (!dict->strs)
+			die("Failed to allocate dictionary");
+	}
+
+	cstr = malloc_or_die(sizeof(*cstr));
+	cstr->str = strdup(str);
+	if (!cstr->str)
+		die("Failed to allocate dictionary");
+	cstr->id = dict->nr_strs;
+	cstr->hash.key = key;
+	trace_hash_add(&dict->hash, &cstr->hash);
+	dict->strs[dict->nr_strs++] = cstr;
+
+	return cstr->id;
+}
+
+/* Write out the strings added to the dictionaries since the last time */
+static void write_dicts(void)
+{
+	struct convert_buf *buf = &convert_scratch;
+	struct convert_dict *dict;
+	unsigned int i;
+	int d;
+
+	for (d = 0; d < CONVERT_NR_DICTS; d++) {
+		dict = &convert_dicts[d];
+		if (dict->nr_written == dict->nr_strs)
+			continue;
+
+		buf->len = 0;
+		buf_add_32(buf, d);
+		buf_add_32(buf, dict->nr_written);
+		buf_add_32(buf, dict->nr_strs - dict->nr_written);
+		for (i = dict->nr_written; i < dict->nr_strs; i++)
+			buf_add_str(buf, dict->strs[i]->str);
+		write_block(CONVERT_BLOCK_DICT, buf);
+
+		dict->nr_written = dict->nr_strs;
+	}
+}
+
+static struct format_field *arg_field(struct event_format *event,
+				      struct print_arg *arg)
+{
+	while (arg && arg->type == PRINT_TYPE)
+		arg = arg->typecast.item;
+
+	if (!arg || arg->type != PRINT_FIELD)
+		return NULL;
+
+	if (arg->field.field)
+		return arg->field.field;
+
+	return pevent_find_any_field(event, arg->field.name);
+}
+
+/*
+ * Returns true if the print format of @event shows @field as a
+ * kernel symbol (%ps, %pS, %pf or %pF).
+ */
+static int is_symbol_field(struct event_format *event,
+			   struct format_field *field)
+{
+	struct print_arg *arg = event->print_fmt.args;
+	const char *p = event->print_fmt.format;
+
+	if (!p || event->flags & EVENT_FL_ISBPRINT)
+		return 0;
+
+	for (; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (*++p == '%')
+			continue;
+
+		/* Skip the flags, width, precision and length */
+		for (; *p && strchr("#0-+ .123456789*hlzjtL", *p); p++) {
+			if (*p == '*' && arg)
+				arg = arg->next;
+		}
+		if (!*p)
+			break;
+
+		if (*p == 'p' && p[1] && strchr("sSfF", p[1]) &&
+		    arg_field(event, arg) == field)
+			return 1;
+
+		if (arg)
+			arg = arg->next;
+	}
+
+	return 0;
+}
+
+static enum convert_type field_type(struct format_field *field)
+{
+	int is_signed = field->flags & FIELD_IS_SIGNED;
+
+	if (field->flags & FIELD_IS_STRING)
+		return CONVERT_STRING;
+
+	if (field->flags & (FIELD_IS_ARRAY | FIELD_IS_DYNAMIC))
+		return CONVERT_BYTES;
+
+	switch (field->size) {
+	case 1:
+		return is_signed ? CONVERT_S8 : CONVERT_U8;
+	case 2:
+		return is_signed ? CONVERT_S16 : CONVERT_U16;
+	case 4:
+		return is_signed ? CONVERT_S32 : CONVERT_U32;
+	case 8:
+		return is_signed ? CONVERT_S64 : CONVERT_U64;
+	}
+
+	return CONVERT_BYTES;
+}
+
+static void add_column(struct convert_table *table, const char *name,
+		       struct format_field *field,
+		       enum convert_source source, enum convert_type type)
+{
+	struct convert_column *col;
+
+	table->columns = realloc(table->columns, sizeof(*table->columns) *
+				 (table->nr_columns + 1));
+	if (!table->columns)
+		die("Failed to allocate columns");
+
+	col = &table->columns[table->nr_columns++];
+	memset(col, 0, sizeof(*col));
+	col->name = strdup(name);
+	if (!col->name)
+		die("Failed to allocate columns");
+	col->field = field;
+	col->source = source;
+	col->type = type;
+}
+
+static void add_field_columns(struct convert_table *table,
+			      struct format_field *field)
+{
+	char *name;
+
+	add_column(table, field->name, field, CONVERT_SRC_FIELD,
+		   field_type(field));
+
+	if (field->flags & (FIELD_IS_ARRAY | FIELD_IS_STRING) ||
+	    !is_symbol_field(table->event, field))
+		return;
+
+	name = malloc_or_die(strlen(field->name) + 5);
+	sprintf(name, "%s.sym", field->name);
+	add_column(table, name, field, CONVERT_SRC_SYM, CONVERT_SYM);
+	free(name);
+}
+
+static void write_table(struct convert_table *table)
+{
+	struct convert_buf *buf = &convert_scratch;
+	struct event_format *event = table->event;
+	int i;
+
+	buf->len = 0;
+	buf_add_32(buf, event->id);
+	buf_add_16(buf, table->nr_columns);
+	buf_add_str(buf, event->system);
+	buf_add_str(buf, event->name);
+	for (i = 0; i < table->nr_columns; i++) {
+		buf_add_8(buf, table->columns[i].type);
+		buf_add_str(buf, table->columns[i].name);
+	}
+	write_block(CONVERT_BLOCK_TABLE, buf);
+}
+
+static struct convert_table *create_table(struct event_format *event)
+{
+	struct convert_table *table;
+	struct format_field *field;
+
+	table = malloc_or_die(sizeof(*table));
+	memset(table, 0, sizeof(*table));
+	table->event = event;
+	table->hash.key = trace_hash(event->id);
+
+	/* Named like the common fields, so they can't clash with the others */
+	add_column(table, "common_ts", NULL, CONVERT_SRC_TS, CONVERT_U64);
+	add_column(table, "common_cpu", NULL, CONVERT_SRC_CPU, CONVERT_U32);
+	add_column(table, "common_comm", NULL, CONVERT_SRC_COMM, CONVERT_COMM);
+
+	/* The table already tells the type */
+	for (field = event->format.common_fields; field; field = field->next) {
+		if (strcmp(field->name, "common_type") != 0)
+			add_field_columns(table, field);
+	}
+	for (field = event->format.fields; field; field = field->next)
+		add_field_columns(table, field);
+
+	trace_hash_add(&convert_tables, &table->hash);
+	write_table(table);
+
+	return table;
+}
+
+static int match_table(struct trace_hash_item *item, void *data)
+{
+	struct convert_table *table = container_of(item, struct convert_table, hash);
+
+	return table->event == data;
+}
+
+static struct convert_table *find_table(struct event_format *event)
+{
+	struct trace_hash_item *item;
+
+	item = trace_hash_find(&convert_tables, trace_hash(event->id),
+			       match_table, event);
+	if (item)
+		return container_of(item, struct convert_table, hash);
+
+	return create_table(event);
+}
+
+static void add_field_value(struct convert_column *col,
+			    struct pevent_record *record)
+{
+	struct format_field *field = col->field;
+	void *data = record->data + field->offset;
+	unsigned int offset;
+	unsigned int len;
+	char *str;
+
+	switch (col->type) {
+	case CONVERT_U8:
+	case CONVERT_S8:
+		buf_add_8(&col->buf, pevent_field_number(field, record->data));
+		break;
+	case CONVERT_U16:
+	case CONVERT_S16:
+		buf_add_16(&col->buf, pevent_field_number(field, record->data));
+		break;
+	case CONVERT_U32:
+	case CONVERT_S32:
+		buf_add_32(&col->buf, pevent_field_number(field, record->data));
+		break;
+	case CONVERT_U64:
+	case CONVERT_S64:
+		buf_add_64(&col->buf, pevent_field_number(field, record->data));
+		break;
+	case CONVERT_STRING:
+	case CONVERT_BYTES:
+		len = field->size;
+		/* A trailing "char buf[]" runs to the end of the record */
+		if (!len && field->offset < record->size)
+			len = record->size - field->offset;
+		if (field->flags & FIELD_IS_DYNAMIC) {
+			offset = pevent_read_number(field->event->pevent,
+						    data, field->size);
+			len = offset >> 16;
+			offset &= 0xffff;
+			data = record->data + offset;
+			if (offset + len > record->size)
+				len = offset < record->size ?
+					record->size - offset : 0;
+		}
+		if (col->type == CONVERT_STRING) {
+			str = data;
+			len = strnlen(str, len);
+		}
+		buf_add_32(&col->buf, len);
+		buf_add(&col->buf, data, len);
+		break;
+	default:
+		break;
+	}
+}
+
+static void add_row(struct convert_table *table, struct pevent *pevent,
+		    struct pevent_record *record)
+{
+	struct convert_column *col;
+	unsigned long long val;
+	const char *str;
+	int pid;
+	int i;
+
+	for (i = 0; i < table->nr_columns; i++) {
+		col = &table->columns[i];
+
+		switch (col->source) {
+		case CONVERT_SRC_TS:
+			buf_add_64(&col->buf, record->ts);
+			break;
+		case CONVERT_SRC_CPU:
+			buf_add_32(&col->buf, record->cpu);
+			break;
+		case CONVERT_SRC_COMM:
+			pid = pevent_data_pid(pevent, record);
+			str = pevent_data_comm_from_pid(pevent, pid);
+			buf_add_32(&col->buf,
+				   dict_id(&convert_dicts[CONVERT_DICT_COMM], str));
+			break;
+		case CONVERT_SRC_FIELD:
+			add_field_value(col, record);
+			break;
+		case CONVERT_SRC_SYM:
+			val = pevent_field_number(col->field, record->data);
+			str = pevent_find_function(pevent, val);
+			buf_add_32(&col->buf, str ?
+				   dict_id(&convert_dicts[CONVERT_DICT_SYM], str) :
+				   CONVERT_NO_SYM);
+			break;
+		}
+	}
+	table->nr_rows++;
+}
+
+/* The timestamps grow slowly, store them as the differences */
+static void encode_delta(struct convert_buf *out, struct convert_buf *in)
+{
+	unsigned long long prev = 0;
+	unsigned long long val;
+	long long delta;
+	unsigned long long i;
+
+	for (i = 0; i + 8 <= in->len; i += 8) {
+		memcpy(&val, in->data + i, 8);
+		val = le64toh(val);
+		delta = val - prev;
+		prev = val;
+		buf_add_varint(out, ((unsigned long long)delta << 1) ^
+				    (unsigned long long)(delta >> 63));
+	}
+}
+
+static void write_column(struct convert_buf *chunk, struct convert_column *col)
+{
+	struct convert_buf encoded = { };
+	struct convert_buf *data = &col->buf;
+	enum convert_encoding encoding = CONVERT_ENC_PLAIN;
+	enum convert_compression compression = CONVERT_COMP_NONE;
+	unsigned long long stored;
+	unsigned char *out = NULL;
+
+	if (col->source == CONVERT_SRC_TS) {
+		encode_delta(&encoded, data);
+		data = &encoded;
+		encoding = CONVERT_ENC_DELTA;
+	}
+	stored = data->len;
+
+#ifndef NO_ZLIB
+	if (convert_compress && data->len) {
+		uLongf out_size = compressBound(data->len);
+
+		out = malloc_or_die(out_size);
+		if (compress2(out, &out_size, data->data, data->len,
+			      Z_BEST_SPEED) == Z_OK && out_size < data->len) {
+			compression = CONVERT_COMP_ZLIB;
+			stored = out_size;
+		}
+	}
+#endif
+
+	buf_add_8(chunk, encoding);
+	buf_add_8(chunk, compression);
+	buf_add_64(chunk, data->len);
+	buf_add_64(chunk, stored);
+	buf_add(chunk, compression == CONVERT_COMP_NONE ? data->data : out,
+		stored);
+
+	free(out);
+	free(encoded.data);
+}
+
+static void write_chunk(struct convert_table *table)
+{
+	struct convert_buf *buf = &convert_scratch;
+	int i;
+
+	if (!table->nr_rows)
+		return;
+
+	/* The strings the chunk refers to must come before it */
+	write_dicts();
+
+	buf->len = 0;
+	buf_add_32(buf, table->event->id);
+	buf_add_32(buf, table->nr_rows);
+	for (i = 0; i < table->nr_columns; i++) {
+		write_column(buf, &table->columns[i]);
+		table->columns[i].buf.len = 0;
+	}
+	write_block(CONVERT_BLOCK_CHUNK, buf);
+
+	table->nr_rows = 0;
+}
+
+static void free_table(struct convert_table *table)
+{
+	int i;
+
+	for (i = 0; i < table->nr_columns; i++) {
+		free(table->columns[i].name);
+		free(table->columns[i].buf.data);
+	}
+	free(table->columns);
+	free(table);
+}
+
+static void finish_tables(void)
+{
+	struct trace_hash_item **bucket;
+	struct trace_hash_item *item;
+	struct convert_table *table;
+
+	trace_hash_for_each_bucket(bucket, &convert_tables) {
+		trace_hash_for_each_item(item, bucket) {
+			table = container_of(item, struct convert_table, hash);
+			write_chunk(table);
+		}
+	}
+
+	trace_hash_for_each_bucket(bucket, &convert_tables) {
+		trace_hash_while_item(item, bucket) {
+			trace_hash_del(item);
+			table = container_of(item, struct convert_table, hash);
+			free_table(table);
+		}
+	}
+	trace_hash_free(&convert_tables);
+}
+
+static void free_dicts(void)
+{
+	struct convert_dict *dict;
+	unsigned int i;
+	int d;
+
+	for (d = 0; d < CONVERT_NR_DICTS; d++) {
+		dict = &convert_dicts[d];
+		for (i = 0; i < dict->nr_strs; i++) {
+			free((char *)dict->strs[i]->str);
+			free(dict->strs[i]);
+		}
+		free(dict->strs);
+		trace_hash_free(&dict->hash);
+	}
+}
+
+void trace_convert(int argc, char **argv)
+{
+	struct tracecmd_input *handle;
+	struct pevent_record *record;
+	struct convert_table *table;
+	struct event_format *event;
+	const char *input_file = NULL;
+	const char *output_file = NULL;
+	unsigned long long skipped = 0;
+	unsigned int version;
+	struct pevent *pevent;
+	int cpu;
+	int d;
+	int c;
+
+	if (strcmp(argv[1], "convert") != 0)
+		usage(argv);
+
+	while ((c = getopt(argc-1, argv+1, "+hi:o:n")) >= 0) {
+		switch (c) {
+		case 'h':
+			usage(argv);
+			break;
+		case 'i':
+			if (input_file)
+				die("only one input file allowed");
+			input_file = optarg;
+			break;
+		case 'o':
+			if (output_file)
+				die("only one output file allowed");
+			output_file = optarg;
+			break;
+		case 'n':
+			convert_compress = 0;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+
+	if ((argc - optind) >= 2)
+		usage(argv);
+
+	if (!input_file)
+		input_file = default_input_file;
+	if (!output_file)
+		output_file = default_output_file;
+
+	handle = tracecmd_open(input_file);
+	if (!handle)
+		die("error reading %s", input_file);
+
+	if (tracecmd_get_flags(handle) & TRACECMD_FL_LATENCY)
+		die("trace-cmd convert does not work with latency traces\n");
+
+	pevent = tracecmd_get_pevent(handle);
+
+	convert_file = output_file;
+	convert_fp = fopen(output_file, "w");
+	if (!convert_fp)
+		die("can't create %s", output_file);
+
+	trace_hash_init(&convert_tables, 128);
+	for (d = 0; d < CONVERT_NR_DICTS; d++)
+		trace_hash_init(&convert_dicts[d].hash, 1024);
+
+	convert_write(CONVERT_MAGIC, 8);
+	version = htole32(CONVERT_VERSION);
+	convert_write(&version, 4);
+
+	while ((record = tracecmd_read_next_data(handle, &cpu))) {
+		event = pevent_find_event(pevent,
+					  pevent_data_type(pevent, record));
+		if (!event) {
+			skipped++;
+			free_record(record);
+			continue;
+		}
+
+		table = find_table(event);
+		add_row(table, pevent, record);
+		if (table->nr_rows == CONVERT_CHUNK_ROWS)
+			write_chunk(table);
+
+		free_record(record);
+	}
+
+	finish_tables();
+	write_dicts();
+	write_block(CONVERT_BLOCK_END, NULL);
+
+	if (fclose(convert_fp))
+		die("Failed writing to %s", output_file);
+
+	if (skipped)
+		warning("skipped %llu records of unknown events", skipped);
+
+	free_dicts();
+	free(convert_scratch.data);
+
+	tracecmd_close(handle);
+}
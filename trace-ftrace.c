@@ -45,17 +45,6 @@ struct pevent_plugin_option trace_ftrace_options[] = {
 static struct pevent_plugin_option *fgraph_tail = &trace_ftrace_options[0];
 static struct pevent_plugin_option *fgraph_depth = &trace_ftrace_options[1];
 
-static void find_long_size(struct tracecmd_ftrace *finfo)
-{
-	finfo->long_size = tracecmd_long_size(finfo->handle);
-}
-
-#define long_size_check(handle)				\
-	do {						\
-		if (!finfo->long_size)				\
-			find_long_size(finfo);		\
-	} while (0)
-
 static int find_ret_event(struct tracecmd_ftrace *finfo, struct pevent *pevent)
 {
 	struct event_format *event;
@@ -393,8 +382,6 @@ trace_stack_handler(struct trace_seq *s, struct pevent_record *record,
 
 	trace_seq_puts(s, "<stack trace>\n");
 
-	long_size_check(finfo);
-
 	for (data += field->offset; data < record->data + record->size;
 	     data += finfo->long_size) {
 		addr = pevent_read_number(event->pevent, data, finfo->long_size);
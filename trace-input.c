@@ -35,6 +35,9 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "trace-cmd-local.h"
 #include "kbuffer.h"
@@ -48,6 +51,9 @@
 /* for debugging read instead of mmap */
 static int force_read = 0;
 
+/* Max number of freed records kept by a handle for reuse */
+#define RECORD_POOL_MAX 1024
+
 struct page {
 	struct list_head	list;
 	off64_t			offset;
@@ -71,8 +77,113 @@ struct cpu_data {
 	struct pevent_record	*next;
 	struct page		*page;
 	struct kbuffer		*kbuf;
+	/* whole cpu data section, when mapped at once */
+	void			*map;
+	size_t			map_size;
+	void			*data;
+	/* timestamps of the pages, loaded from the page index */
+	unsigned long long	*page_ts;
+	unsigned long long	nr_pages;
+	/* summaries of the pages, loaded from the page events */
+	struct page_summary	*page_summary;
+	unsigned int		*page_ids;
+	/* file offsets of the chunks of compressed data, and their end */
+	unsigned long long	*chunks;
+	unsigned int		nr_chunks;
+	unsigned int		chunk_pages;
 	int			cpu;
 	int			pipe_fd;
+	bool			merge_skip;
+	/* read ahead by a read thread, see tracecmd_start_read_threads() */
+	struct read_worker	*worker;
+	struct read_chunk	*chunk;		/* being read by the consumer */
+	struct read_chunk	*queue;		/* protected by worker->lock */
+	struct read_chunk	*queue_tail;
+	int			nr_queued;
+	bool			queue_done;
+	unsigned long long	read_offset;	/* next page of the worker */
+	bool			read_skipped;	/* last record was skipped */
+};
+
+/*
+ * Number of uncompressed chunks kept around, on top of one for each
+ * CPU that the reads of the handle go through in turn.
+ */
+#define CHUNK_CACHE_EXTRA	8
+
+/* An uncompressed chunk of the data of a CPU */
+struct chunk_cache {
+	void			*data;
+	size_t			size;
+	int			cpu;
+	unsigned int		chunk;
+	unsigned long		last_used;
+};
+
+/* The events of a page, see tracecmd_set_read_events() */
+struct page_summary {
+	unsigned long long	last_ts;
+	unsigned int		ids;	/* index into page_ids */
+	unsigned int		nr_ids;
+};
+
+/* The records read ahead from a single page */
+struct read_chunk {
+	struct read_chunk	*next;
+	int			nr;
+	int			pos;
+	struct pevent_record	*records[];
+};
+
+/* A CPU in the merge heap, keyed by the time of its next record */
+struct merge_node {
+	unsigned long long	ts;
+	int			cpu;
+};
+
+/* The CPUs ordered by the time of their next record */
+struct merge_heap {
+	struct merge_node	*nodes;
+	int			nr;
+	int			*pos;		/* in nodes, -1 if not in it */
+	int			*dirty;		/* CPUs that moved */
+	int			nr_dirty;
+	bool			*is_dirty;
+};
+
+/* The position of a tracecmd_iter on a CPU */
+struct iter_cpu {
+	struct page		*page;
+	struct kbuffer		*kbuf;
+	struct pevent_record	*next;
+};
+
+struct tracecmd_iter {
+	struct tracecmd_input	*handle;
+	struct iter_cpu		*cpus;
+	struct merge_heap	merge;
+};
+
+/* Max number of pages a read thread reads ahead of a CPU */
+#define READ_QUEUE_MAX	16
+
+struct read_worker {
+	struct tracecmd_input	*handle;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		space;	/* a queue has room */
+	pthread_cond_t		ready;	/* a queue has data */
+	struct kbuffer		*kbuf;
+	int			*cpus;
+	int			nr_cpus;
+	bool			stop;
+	bool			started;
+	/* records to reuse, only used by the thread */
+	struct pevent_record	*free_records;
+	/* freed records handed over by the consumer, under the lock */
+	struct pevent_record	*given_records;
+	struct pevent_record	*given_tail;
+	int			nr_given_records;
 };
 
 struct input_buffer_instance {
@@ -94,8 +205,31 @@ struct tracecmd_input {
 	bool			use_trace_clock;
 	bool			read_page;
 	bool			use_pipe;
+	bool			map_sections;
+	bool			compressed;
 	struct cpu_data 	*cpu_data;
+	struct chunk_cache	*chunk_cache;	/* of compressed data */
+	int			nr_chunk_cache;
+	unsigned long		chunk_clock;
+	/* freed records to reuse, linked by their priv pointer */
+	struct pevent_record	*free_records;
+	int			nr_free_records;
+	struct read_worker	*read_workers;
+	int			nr_read_workers;
+	tracecmd_read_filter_func read_filter;
+	void			*read_filter_data;
+	struct merge_heap	merge;
 	unsigned long long	ts_offset;
+	unsigned long long	page_index;	/* file offset of page index */
+	unsigned long long	page_events;	/* file offset of page events */
+	unsigned char		*read_events;	/* bitmap of events to read */
+	int			nr_read_events;
+	unsigned char		*pid_events;	/* bitmap of events for read_pids */
+	int			nr_pid_events;
+	int			*read_pids;	/* sorted */
+	int			nr_read_pids;
+	int			pid_offset;	/* of common_pid in the events */
+	int			read_follow;	/* see tracecmd_set_read_follow() */
 	char *			cpustats;
 	char *			uname;
 	struct input_buffer_instance	*buffers;
@@ -175,6 +309,27 @@ static const char *show_records(struct list_head *pages)
 #endif
 
 static int init_cpu(struct tracecmd_input *handle, int cpu);
+static struct pevent_record *
+read_threads_next(struct tracecmd_input *handle, int cpu);
+
+/*
+ * The iterator of a CPU was moved, its position in the merge heap
+ * needs to be updated before the next record is taken from it.
+ */
+static inline void merge_heap_mark(struct merge_heap *heap, int cpu)
+{
+	if (!heap->nodes || heap->is_dirty[cpu])
+		return;
+
+	heap->is_dirty[cpu] = true;
+	heap->dirty[heap->nr_dirty++] = cpu;
+}
+
+/* The same, for the merge heap of tracecmd_read_next_data() */
+static inline void merge_mark_dirty(struct tracecmd_input *handle, int cpu)
+{
+	merge_heap_mark(&handle->merge, cpu);
+}
 
 static int do_read(struct tracecmd_input *handle, void *data, int size)
 {
@@ -328,6 +483,7 @@ static int read_header_files(struct tracecmd_input *handle)
 	 * use that instead, since it represents the kernel.
 	 */
 	handle->long_size = pevent->header_page_size_size;
+	handle->finfo.long_size = handle->long_size;
 
 	if (do_read_check(handle, buf, 13))
 		return -1;
@@ -441,7 +597,8 @@ static int read_event_file(struct tracecmd_input *handle,
 			printf("%.*s\n", (int)size, buf);
 		}
 	} else {
-		if (pevent_parse_event(pevent, buf, size, system))
+		/* Formats are parsed when the event is first used */
+		if (pevent_parse_event_lazy(pevent, buf, size, system))
 			pevent->parsing_failures = 1;
 	}
 	free(buf);
@@ -792,6 +949,186 @@ static int read_page(struct tracecmd_input *handle, off64_t offset,
 	return 0;
 }
 
+#ifndef NO_ZLIB
+/* Returns chunk @chunk of @cpu uncompressed */
+static void *get_chunk(struct tracecmd_input *handle, int cpu,
+		       unsigned int chunk)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct chunk_cache *cache;
+	struct chunk_cache *entry = NULL;
+	unsigned long long start;
+	size_t size;
+	uLongf len;
+	void *buf;
+	int i;
+
+	if (!handle->chunk_cache) {
+		handle->nr_chunk_cache = handle->cpus + CHUNK_CACHE_EXTRA;
+		handle->chunk_cache = calloc(handle->nr_chunk_cache,
+					     sizeof(*handle->chunk_cache));
+		if (!handle->chunk_cache)
+			return NULL;
+	}
+
+	for (i = 0; i < handle->nr_chunk_cache; i++) {
+		cache = &handle->chunk_cache[i];
+		if (cache->data && cache->cpu == cpu && cache->chunk == chunk) {
+			cache->last_used = ++handle->chunk_clock;
+			return cache->data;
+		}
+		/* Replace the least recently used chunk */
+		if (!entry || !cache->data ||
+		    (entry->data && cache->last_used < entry->last_used))
+			entry = cache;
+	}
+
+	size = (size_t)cpu_data->chunk_pages * handle->page_size;
+	if (entry->size < size) {
+		free(entry->data);
+		entry->size = 0;
+		entry->data = malloc(size);
+		if (!entry->data)
+			return NULL;
+		entry->size = size;
+	}
+	/* Not valid until it is uncompressed */
+	entry->cpu = -1;
+
+	start = cpu_data->chunks[chunk];
+	buf = malloc(cpu_data->chunks[chunk + 1] - start);
+	if (!buf)
+		return NULL;
+
+	if (pread(handle->fd, buf, cpu_data->chunks[chunk + 1] - start,
+		  start) != cpu_data->chunks[chunk + 1] - start)
+		goto fail;
+
+	/* The last chunk may be short */
+	memset(entry->data, 0, size);
+	len = size;
+	if (uncompress(entry->data, &len, buf,
+		       cpu_data->chunks[chunk + 1] - start) != Z_OK)
+		goto fail;
+	free(buf);
+
+	entry->cpu = cpu;
+	entry->chunk = chunk;
+	entry->last_used = ++handle->chunk_clock;
+
+	return entry->data;
+
+ fail:
+	warning("could not uncompress chunk %u of CPU %d", chunk, cpu);
+	free(buf);
+	return NULL;
+}
+
+static int read_compressed_page(struct tracecmd_input *handle, int cpu,
+				off64_t offset, void *map)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long page;
+	void *data;
+
+	page = (offset - cpu_data->file_offset) / handle->page_size;
+	data = get_chunk(handle, cpu, page / cpu_data->chunk_pages);
+	if (!data)
+		return -1;
+
+	memcpy(map, data + (page % cpu_data->chunk_pages) * handle->page_size,
+	       handle->page_size);
+	return 0;
+}
+
+/*
+ * Read the table of the compressed chunks of a CPU, that is at
+ * @section in the file.
+ */
+static int read_chunk_table(struct tracecmd_input *handle, int cpu,
+			    unsigned long long section)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long chunk_size;
+	unsigned long long *chunks;
+	off64_t save_seek;
+	unsigned int nr_chunks;
+	unsigned int pages;
+	unsigned int i;
+	int ret = -1;
+
+	save_seek = lseek64(handle->fd, 0, SEEK_CUR);
+
+	if (lseek64(handle->fd, section, SEEK_SET) == (off64_t)-1)
+		goto out;
+
+	pages = read4(handle);
+	nr_chunks = read4(handle);
+	chunk_size = (unsigned long long)pages * handle->page_size;
+	if (!pages || pages > 4096 ||
+	    nr_chunks != (cpu_data->file_size + chunk_size - 1) / chunk_size)
+		goto out;
+
+	chunks = malloc((nr_chunks + 1) * sizeof(*chunks));
+	if (!chunks)
+		goto out;
+
+	if (do_read_check(handle, chunks, (nr_chunks + 1) * 8)) {
+		free(chunks);
+		goto out;
+	}
+
+	for (i = 0; i <= nr_chunks; i++) {
+		chunks[i] = __data2host8(handle->pevent, chunks[i]);
+		if ((i && chunks[i] < chunks[i - 1]) ||
+		    chunks[i] > handle->total_file_size) {
+			free(chunks);
+			goto out;
+		}
+	}
+
+	cpu_data->chunks = chunks;
+	cpu_data->nr_chunks = nr_chunks;
+	cpu_data->chunk_pages = pages;
+	ret = 0;
+ out:
+	lseek64(handle->fd, save_seek, SEEK_SET);
+	return ret;
+}
+#else
+static int read_compressed_page(struct tracecmd_input *handle, int cpu,
+				off64_t offset, void *map)
+{
+	return -1;
+}
+
+static int read_chunk_table(struct tracecmd_input *handle, int cpu,
+			    unsigned long long section)
+{
+	warning("trace-cmd was built without zlib, can not read compressed data");
+	return -1;
+}
+#endif
+
+static void free_chunks(struct tracecmd_input *handle)
+{
+	int cpu;
+	int i;
+
+	for (cpu = 0; handle->cpu_data && cpu < handle->cpus; cpu++) {
+		free(handle->cpu_data[cpu].chunks);
+		handle->cpu_data[cpu].chunks = NULL;
+	}
+
+	if (!handle->chunk_cache)
+		return;
+
+	for (i = 0; i < handle->nr_chunk_cache; i++)
+		free(handle->chunk_cache[i].data);
+	free(handle->chunk_cache);
+	handle->chunk_cache = NULL;
+}
+
 static struct page *allocate_page(struct tracecmd_input *handle,
 				  int cpu, off64_t offset)
 {
@@ -814,7 +1151,16 @@ static struct page *allocate_page(struct tracecmd_input *handle,
 	page->offset = offset;
 	page->handle = handle;
 
-	if (handle->read_page) {
+	if (handle->map_sections) {
+		page->map = cpu_data->data + (offset - cpu_data->file_offset);
+	} else if (handle->compressed) {
+		page->map = malloc(handle->page_size);
+		if (page->map &&
+		    read_compressed_page(handle, cpu, offset, page->map) < 0) {
+			free(page->map);
+			page->map = NULL;
+		}
+	} else if (handle->read_page) {
 		page->map = malloc(handle->page_size);
 		if (page->map) {
 			ret = read_page(handle, offset, cpu, page->map);
@@ -850,9 +1196,10 @@ static void __free_page(struct tracecmd_input *handle, struct page *page)
 	if (page->ref_count)
 		return;
 
-	if (handle->read_page)
+	/* Pages of a mapped cpu section are unmapped on close */
+	if (handle->read_page || handle->compressed)
 		free(page->map);
-	else
+	else if (!handle->map_sections)
 		munmap(page->map, handle->page_size);
 
 	list_del(&page->list);
@@ -870,12 +1217,53 @@ static void free_page(struct tracecmd_input *handle, int cpu)
 	handle->cpu_data[cpu].page = NULL;
 }
 
+/*
+ * Records of the CPU iterators are allocated for every event read,
+ * keep the freed ones around instead of going back to malloc.
+ */
+static struct pevent_record *alloc_record(struct tracecmd_input *handle)
+{
+	struct pevent_record *record = handle->free_records;
+
+	if (record) {
+		handle->free_records = record->priv;
+		handle->nr_free_records--;
+	} else {
+		record = malloc(sizeof(*record));
+		if (!record)
+			return NULL;
+	}
+	memset(record, 0, sizeof(*record));
+
+	return record;
+}
+
+static void free_record_pool(struct tracecmd_input *handle)
+{
+	struct pevent_record *record;
+
+	while ((record = handle->free_records)) {
+		handle->free_records = record->priv;
+		free(record);
+	}
+	handle->nr_free_records = 0;
+}
+
 static void __free_record(struct pevent_record *record)
 {
 	if (record->priv) {
 		struct page *page = record->priv;
+		struct tracecmd_input *handle = page->handle;
+
 		remove_record(page, record);
-		__free_page(page->handle, page);
+		__free_page(handle, page);
+
+		if (handle->nr_free_records < RECORD_POOL_MAX) {
+			record->priv = handle->free_records;
+			handle->free_records = record;
+			handle->nr_free_records++;
+			return;
+		}
 	}
 
 	free(record);
@@ -923,6 +1311,7 @@ static void free_next(struct tracecmd_input *handle, int cpu)
 		return;
 
 	handle->cpu_data[cpu].next = NULL;
+	merge_mark_dirty(handle, cpu);
 
 	record->locked = 0;
 	free_record(record);
@@ -943,6 +1332,8 @@ static int update_page_info(struct tracecmd_input *handle, int cpu)
 		return -1;
 	}
 
+	merge_mark_dirty(handle, cpu);
+
 	kbuffer_load_subbuffer(kbuf, ptr);
 	if (kbuffer_subbuffer_size(kbuf) > handle->page_size)
 		die("bad page read, with size of %d",
@@ -1002,6 +1393,171 @@ static int get_page(struct tracecmd_input *handle, int cpu,
 	return 0;
 }
 
+/*
+ * Read the summaries of the pages of a CPU from the page events
+ * that were saved at the end of the file.
+ */
+static int load_page_events(struct tracecmd_input *handle, int cpu)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct page_summary *summary = NULL;
+	unsigned long long nr_pages;
+	unsigned long long offset;
+	unsigned long long size = 0;
+	unsigned long long ts;
+	unsigned long long i;
+	unsigned int *ids = NULL;
+	unsigned int nr_ids;
+	unsigned int pos = 0;
+	off64_t save_seek;
+	int ret = -1;
+	int c;
+
+	save_seek = lseek64(handle->fd, 0, SEEK_CUR);
+
+	/* Skip the summaries of the CPUs before this one */
+	offset = handle->page_events;
+	for (c = 0; c <= cpu; c++) {
+		if (lseek64(handle->fd, offset, SEEK_SET) == (off64_t)-1)
+			goto out;
+		size = read8(handle);
+		offset += 8 + size;
+	}
+
+	nr_pages = (cpu_data->file_size + handle->page_size - 1) /
+		handle->page_size;
+
+	/* Each page takes at least 3 words */
+	if (size % 4 || size / 4 < nr_pages * 3 ||
+	    size > handle->total_file_size)
+		goto out;
+
+	ids = malloc(size);
+	summary = malloc(nr_pages * sizeof(*summary));
+	if (!ids || (nr_pages && !summary))
+		goto out;
+
+	if (do_read_check(handle, ids, size))
+		goto out;
+
+	size /= 4;
+	for (i = 0; i < nr_pages; i++) {
+		if (pos + 3 > size)
+			goto out;
+		memcpy(&ts, ids + pos, 8);
+		nr_ids = __data2host4(handle->pevent, ids[pos + 2]);
+		pos += 3;
+		if (nr_ids > size - pos)
+			goto out;
+
+		summary[i].last_ts = __data2host8(handle->pevent, ts);
+		summary[i].ids = pos;
+		summary[i].nr_ids = nr_ids;
+		for (; nr_ids; nr_ids--, pos++)
+			ids[pos] = __data2host4(handle->pevent, ids[pos]);
+	}
+
+	cpu_data->page_summary = summary;
+	cpu_data->page_ids = ids;
+	ret = 0;
+
+ out:
+	if (ret < 0) {
+		free(summary);
+		free(ids);
+	}
+	lseek64(handle->fd, save_seek, SEEK_SET);
+	return ret;
+}
+
+/* Can page @nr of @cpu hold any of the events to read? */
+static bool page_has_read_events(struct tracecmd_input *handle, int cpu,
+				 unsigned long long nr)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct page_summary *summary = &cpu_data->page_summary[nr];
+	unsigned int *ids = cpu_data->page_ids + summary->ids;
+	unsigned int i;
+
+	for (i = 0; i < summary->nr_ids; i++) {
+		if (ids[i] < handle->nr_read_events &&
+		    handle->read_events[ids[i] / 8] & (1 << (ids[i] % 8)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Returns the offset of the first page at or after @offset that can
+ * hold the events set by tracecmd_set_read_events(), or the end of
+ * the CPU data if there is none.
+ */
+static unsigned long long
+next_read_page(struct tracecmd_input *handle, int cpu,
+	       unsigned long long offset)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long end = cpu_data->file_offset + cpu_data->file_size;
+	unsigned long long nr;
+
+	for (; offset < end; offset += handle->page_size) {
+		nr = (offset - cpu_data->file_offset) / handle->page_size;
+		if (page_has_read_events(handle, cpu, nr))
+			break;
+	}
+
+	return offset < end ? offset : end;
+}
+
+static inline bool test_read_bit(unsigned char *map, int nr, int id)
+{
+	return id < nr && map[id / 8] & (1 << (id % 8));
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+	int pa = *(const int *)a;
+	int pb = *(const int *)b;
+
+	return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * Should the event at @data be skipped before a record is made for
+ * it? See tracecmd_set_read_events(), tracecmd_set_read_pids() and
+ * tracecmd_set_read_follow(). @skipped tells if the event before it
+ * on the CPU was skipped, and is updated for the next one.
+ */
+static inline bool skip_read_event(struct tracecmd_input *handle, void *data,
+				   bool *skipped)
+{
+	int id;
+	int pid;
+
+	if (!handle->read_events && !handle->pid_events)
+		return false;
+
+	id = data2host2(handle->pevent, data);
+	if (*skipped && id == handle->read_follow)
+		return true;
+
+	*skipped = true;
+
+	if (handle->read_events &&
+	    !test_read_bit(handle->read_events, handle->nr_read_events, id))
+		return true;
+
+	if (test_read_bit(handle->pid_events, handle->nr_pid_events, id)) {
+		pid = data2host4(handle->pevent, data + handle->pid_offset);
+		if (!bsearch(&pid, handle->read_pids, handle->nr_read_pids,
+			     sizeof(pid), cmp_pid))
+			return true;
+	}
+
+	*skipped = false;
+	return false;
+}
+
 static int get_next_page(struct tracecmd_input *handle, int cpu)
 {
 	off64_t offset;
@@ -1018,6 +1574,18 @@ static int get_next_page(struct tracecmd_input *handle, int cpu)
 
 	offset = handle->cpu_data[cpu].offset + handle->page_size;
 
+	if (handle->read_events && handle->page_events) {
+		offset = next_read_page(handle, cpu, offset);
+		if (offset == handle->cpu_data[cpu].file_offset +
+		    handle->cpu_data[cpu].file_size) {
+			handle->cpu_data[cpu].offset = 0;
+			return 0;
+		}
+		/* The events of the pages passed over were skipped */
+		if (offset != handle->cpu_data[cpu].offset + handle->page_size)
+			handle->cpu_data[cpu].read_skipped = true;
+	}
+
 	return get_page(handle, cpu, offset);
 }
 
@@ -1181,6 +1749,7 @@ int tracecmd_refresh_record(struct tracecmd_input *handle,
 
 	record->data = kbuffer_read_at_offset(cpu_data->kbuf, index, &record->ts);
 	cpu_data->timestamp = record->ts;
+	merge_mark_dirty(handle, cpu);
 
 	return 0;
 }
@@ -1266,39 +1835,135 @@ tracecmd_read_cpu_last(struct tracecmd_input *handle, int cpu)
 	return record;
 }
 
-/**
- * tracecmd_set_cpu_to_timestamp - set the CPU iterator to a given time
- * @handle: input handle for the trace.dat file
- * @cpu: the CPU pointer to set
- * @ts: the timestamp to set the CPU at.
- *
- * This sets the CPU iterator used by tracecmd_read_data and
- * tracecmd_peek_data to a location in the CPU storage near
- * a given timestamp. It will try to set the iterator to a time before
- * the time stamp and not actually at a given time.
- *
- * To use this to find a record in a time field, call this function
- * first, than iterate with tracecmd_read_data to find the records
- * you need.
+/*
+ * Read the page timestamps of a CPU from the page index that
+ * was saved at the end of the file.
  */
-int
-tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
-			      unsigned long long ts)
+static int load_page_index(struct tracecmd_input *handle, int cpu)
 {
 	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
-	off64_t start, end, next;
+	unsigned long long nr_pages = 0;
+	unsigned long long offset;
+	unsigned long long i;
+	off64_t save_seek;
+	int ret = -1;
+	int c;
 
-	if (cpu < 0 || cpu >= handle->cpus) {
-		errno = -EINVAL;
-		return -1;
+	save_seek = lseek64(handle->fd, 0, SEEK_CUR);
+
+	if (lseek64(handle->fd, handle->page_index, SEEK_SET) == (off64_t)-1)
+		goto out;
+
+	/* Skip the page timestamps of the CPUs before this one */
+	offset = handle->page_index + handle->cpus * 8;
+	for (c = 0; c < handle->cpus; c++) {
+		nr_pages = read8(handle);
+		if (c == cpu)
+			break;
+		offset += nr_pages * 8;
 	}
 
-	if (!cpu_data->size)
-		return -1;
+	if (nr_pages != (cpu_data->file_size + handle->page_size - 1) /
+	    handle->page_size)
+		goto out;
 
-	if (!cpu_data->page) {
-		if (init_cpu(handle, cpu))
-		    return -1;
+	cpu_data->page_ts = malloc(nr_pages * sizeof(*cpu_data->page_ts));
+	if (!cpu_data->page_ts)
+		goto out;
+
+	if (lseek64(handle->fd, offset, SEEK_SET) == (off64_t)-1 ||
+	    do_read_check(handle, cpu_data->page_ts, nr_pages * 8)) {
+		free(cpu_data->page_ts);
+		cpu_data->page_ts = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		cpu_data->page_ts[i] = __data2host8(handle->pevent,
+						    cpu_data->page_ts[i]);
+	cpu_data->nr_pages = nr_pages;
+	ret = 0;
+
+ out:
+	lseek64(handle->fd, save_seek, SEEK_SET);
+	return ret;
+}
+
+/*
+ * Use the page index to move the CPU iterator to the last page
+ * that starts before @ts.
+ */
+static int set_cpu_to_timestamp_index(struct tracecmd_input *handle,
+				      int cpu, unsigned long long ts)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	unsigned long long start = 0;
+	unsigned long long end;
+	unsigned long long mid;
+	int ret;
+
+	if (!cpu_data->page_ts && load_page_index(handle, cpu) < 0) {
+		/* Bad index, do not use it again */
+		handle->page_index = 0;
+		return -1;
+	}
+
+	end = cpu_data->nr_pages;
+	while (start < end) {
+		mid = start + (end - start) / 2;
+		if (cpu_data->page_ts[mid] + handle->ts_offset < ts)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	if (start)
+		start--;
+
+	ret = get_page(handle, cpu, cpu_data->file_offset +
+		       start * handle->page_size);
+	if (ret < 0)
+		return -1;
+
+	/* Set to the first record on the page */
+	if (ret)
+		update_page_info(handle, cpu);
+
+	return 0;
+}
+
+/**
+ * tracecmd_set_cpu_to_timestamp - set the CPU iterator to a given time
+ * @handle: input handle for the trace.dat file
+ * @cpu: the CPU pointer to set
+ * @ts: the timestamp to set the CPU at.
+ *
+ * This sets the CPU iterator used by tracecmd_read_data and
+ * tracecmd_peek_data to a location in the CPU storage near
+ * a given timestamp. It will try to set the iterator to a time before
+ * the time stamp and not actually at a given time.
+ *
+ * To use this to find a record in a time field, call this function
+ * first, than iterate with tracecmd_read_data to find the records
+ * you need.
+ */
+int
+tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
+			      unsigned long long ts)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	off64_t start, end, next;
+
+	if (cpu < 0 || cpu >= handle->cpus) {
+		errno = -EINVAL;
+		return -1;
+	}
+
+	if (!cpu_data->size)
+		return -1;
+
+	if (!cpu_data->page) {
+		if (init_cpu(handle, cpu))
+		    return -1;
 	}
 
 	if (cpu_data->timestamp == ts) {
@@ -1313,6 +1978,10 @@ tracecmd_set_cpu_to_timestamp(struct tracecmd_input *handle, int cpu,
 		return 0;
 	}
 
+	if (handle->page_index &&
+	    set_cpu_to_timestamp_index(handle, cpu, ts) == 0)
+		return 0;
+
 	/* Set to the first record on current page */
 	update_page_info(handle, cpu);
 
@@ -1525,252 +2194,1558 @@ tracecmd_translate_data(struct tracecmd_input *handle,
  * If a ring buffer page is available, and the need to parse it
  * without having a handle, then this function can be used.
  *
- * The @pevent needs to be initialized to have the page header information
- * already available.
+ * The @pevent needs to be initialized to have the page header information
+ * already available.
+ *
+ * The @last_record is used to know where to read the next record from.
+ * If @last_record is NULL, the first record on the page will be read.
+ *
+ * Returns:
+ *  A newly allocated record that must be freed with free_record() if
+ *  a record is found. Otherwise NULL is returned if the record is bad
+ *  or no more records exist.
+ */
+struct pevent_record *
+tracecmd_read_page_record(struct pevent *pevent, void *page, int size,
+			  struct pevent_record *last_record)
+{
+	unsigned long long ts;
+	struct kbuffer *kbuf;
+	struct pevent_record *record = NULL;
+	enum kbuffer_long_size long_size;
+	enum kbuffer_endian endian;
+	void *ptr;
+
+	if (pevent->file_bigendian)
+		endian = KBUFFER_ENDIAN_BIG;
+	else
+		endian = KBUFFER_ENDIAN_LITTLE;
+
+	if (pevent->header_page_size_size == 8)
+		long_size = KBUFFER_LSIZE_8;
+	else
+		long_size = KBUFFER_LSIZE_4;
+
+	kbuf = kbuffer_alloc(long_size, endian);
+	if (!kbuf)
+		return NULL;
+
+	kbuffer_load_subbuffer(kbuf, page);
+	if (kbuffer_subbuffer_size(kbuf) > size) {
+		warning("tracecmd_read_page_record: page_size > size");
+		goto out_free;
+	}
+
+	if (last_record) {
+		if (last_record->data < page || last_record->data >= (page + size)) {
+			warning("tracecmd_read_page_record: bad last record (size=%u)",
+				last_record->size);
+			goto out_free;
+		}
+
+		do {
+			ptr = kbuffer_next_event(kbuf, NULL);
+			if (!ptr)
+				break;
+		} while (ptr < last_record->data);
+		if (ptr != last_record->data) {
+			warning("tracecmd_read_page_record: could not find last_record");
+			goto out_free;
+		}
+	}
+
+	ptr = kbuffer_read_event(kbuf, &ts);
+	if (!ptr)
+		goto out_free;
+
+	record = malloc(sizeof(*record));
+	if (!record)
+		return NULL;
+	memset(record, 0, sizeof(*record));
+
+	record->ts = ts;
+	record->size = kbuffer_event_size(kbuf);
+	record->record_size = kbuffer_curr_size(kbuf);
+	record->cpu = 0;
+	record->data = ptr;
+	record->ref_count = 1;
+
+ out_free:
+	kbuffer_free(kbuf);
+	return record;
+}
+
+/**
+ * tracecmd_peek_data - return the record at the current location.
+ * @handle: input handle for the trace.dat file
+ * @cpu: the CPU to pull from
+ *
+ * This returns the record at the current location of the CPU
+ * iterator. It does not increment the CPU iterator.
+ */
+struct pevent_record *
+tracecmd_peek_data(struct tracecmd_input *handle, int cpu)
+{
+	struct pevent_record *record;
+	unsigned long long ts;
+	struct kbuffer *kbuf;
+	struct page *page;
+	int index;
+	void *data;
+
+	if (cpu >= handle->cpus)
+		return NULL;
+
+	page = handle->cpu_data[cpu].page;
+	kbuf = handle->cpu_data[cpu].kbuf;
+
+	/* Hack to work around function graph read ahead */
+	tracecmd_curr_thread_handle = handle;
+
+	if (handle->read_workers && !handle->cpu_data[cpu].next) {
+		record = read_threads_next(handle, cpu);
+		if (record) {
+			record->locked = 1;
+			handle->cpu_data[cpu].next = record;
+			handle->cpu_data[cpu].timestamp = record->ts;
+		}
+		return record;
+	}
+
+	if (handle->cpu_data[cpu].next) {
+
+		record = handle->cpu_data[cpu].next;
+		if (!record->data)
+			die("Something freed the record");
+
+		if (handle->cpu_data[cpu].timestamp == record->ts)
+			return record;
+
+		/*
+		 * The timestamp changed, which means the cached
+		 * record is no longer valid. Reread a new record.
+		 */
+		free_next(handle, cpu);
+	}
+
+read_again:
+	if (!page) {
+		if (handle->use_pipe) {
+			get_next_page(handle, cpu);
+			page = handle->cpu_data[cpu].page;
+		}
+		if (!page)
+			return NULL;
+	}
+
+	data = kbuffer_read_event(kbuf, &ts);
+	if (!data) {
+		if (get_next_page(handle, cpu))
+			return NULL;
+		page = handle->cpu_data[cpu].page;
+		goto read_again;
+	}
+
+	if (skip_read_event(handle, data, &handle->cpu_data[cpu].read_skipped)) {
+		kbuffer_next_event(kbuf, NULL);
+		goto read_again;
+	}
+
+	handle->cpu_data[cpu].timestamp = ts + handle->ts_offset;
+
+	index = kbuffer_curr_offset(kbuf);
+
+	record = alloc_record(handle);
+	if (!record)
+		return NULL;
+
+	record->ts = handle->cpu_data[cpu].timestamp;
+	record->size = kbuffer_event_size(kbuf);
+	record->cpu = cpu;
+	record->data = data;
+	record->offset = handle->cpu_data[cpu].offset + index;
+	record->missed_events = kbuffer_missed_events(kbuf);
+	record->ref_count = 1;
+	record->locked = 1;
+
+	handle->cpu_data[cpu].next = record;
+
+	record->record_size = kbuffer_curr_size(kbuf);
+	record->priv = page;
+	add_record(page, record);
+	page->ref_count++;
+
+	kbuffer_next_event(kbuf, NULL);
+
+	return record;
+}
+
+/**
+ * tracecmd_read_data - read the next record and increment
+ * @handle: input handle for the trace.dat file
+ * @cpu: the CPU to pull from
+ *
+ * This returns the record at the current location of the CPU
+ * iterator and increments the CPU iterator.
+ *
+ * The record returned must be freed.
+ */
+struct pevent_record *
+tracecmd_read_data(struct tracecmd_input *handle, int cpu)
+{
+	struct pevent_record *record;
+
+	record = tracecmd_peek_data(handle, cpu);
+	handle->cpu_data[cpu].next = NULL;
+	merge_mark_dirty(handle, cpu);
+	if (record) {
+		record->locked = 0;
+#if DEBUG_RECORD
+		record->alloc_addr = (unsigned long)__builtin_return_address(0);
+#endif
+	}
+	return record;
+}
+
+/**
+ * tracecmd_read_batch - read the records of a CPU a page at a time
+ * @handle: input handle for the trace.dat file
+ * @cpu: the CPU to pull from
+ * @records: array to fill with the records read
+ * @max: the number of entries in @records
+ *
+ * Reads up to @max records at the current location of the CPU
+ * iterator, all from the same page, and increments the CPU iterator
+ * past them. This is the same as calling tracecmd_read_data() for
+ * each of them, without allocating and freeing a record per event.
+ *
+ * The records are filled in place and must not be freed with
+ * free_record(). Their data is only valid until the next read or
+ * seek on this CPU.
+ *
+ * Returns the number of records read, 0 if there are no more
+ * records on the CPU, or -1 on error.
+ */
+int tracecmd_read_batch(struct tracecmd_input *handle, int cpu,
+			struct pevent_record *records, int max)
+{
+	struct cpu_data *cpu_data;
+	struct pevent_record *record;
+	unsigned long long ts;
+	struct kbuffer *kbuf;
+	void *data;
+	int nr = 0;
+
+	if (cpu < 0 || cpu >= handle->cpus || max <= 0 ||
+	    handle->read_workers)
+		return -1;
+
+	cpu_data = &handle->cpu_data[cpu];
+	kbuf = cpu_data->kbuf;
+
+	/* A record already peeked at is the first one returned */
+	record = cpu_data->next;
+	if (record) {
+		if (cpu_data->timestamp == record->ts) {
+			records[nr] = *record;
+			records[nr].ref_count = 0;
+			records[nr].locked = 0;
+			records[nr].priv = NULL;
+			nr++;
+		}
+		free_next(handle, cpu);
+	}
+
+	/* Only move to the next page if nothing was taken from this one */
+	for (;;) {
+		if (!cpu_data->page) {
+			if (handle->use_pipe)
+				get_next_page(handle, cpu);
+			if (!cpu_data->page)
+				return nr;
+		}
+		while (nr < max && (data = kbuffer_read_event(kbuf, &ts))) {
+			if (skip_read_event(handle, data,
+					    &cpu_data->read_skipped)) {
+				kbuffer_next_event(kbuf, NULL);
+				continue;
+			}
+			record = &records[nr++];
+			memset(record, 0, sizeof(*record));
+			record->ts = ts + handle->ts_offset;
+			record->size = kbuffer_event_size(kbuf);
+			record->record_size = kbuffer_curr_size(kbuf);
+			record->cpu = cpu;
+			record->data = data;
+			record->offset = cpu_data->offset +
+				kbuffer_curr_offset(kbuf);
+			record->missed_events = kbuffer_missed_events(kbuf);
+
+			cpu_data->timestamp = record->ts;
+			kbuffer_next_event(kbuf, NULL);
+		}
+		if (nr)
+			break;
+		if (get_next_page(handle, cpu))
+			return -1;
+	}
+
+	merge_mark_dirty(handle, cpu);
+
+	return nr;
+}
+
+/* Order by time, and by CPU number for records of the same time */
+static inline int merge_before(struct merge_node *a, struct merge_node *b)
+{
+	return a->ts < b->ts || (a->ts == b->ts && a->cpu < b->cpu);
+}
+
+static void merge_set(struct merge_heap *heap, int pos,
+		      struct merge_node *node)
+{
+	heap->nodes[pos] = *node;
+	heap->pos[node->cpu] = pos;
+}
+
+static void merge_sift(struct merge_heap *heap, int pos)
+{
+	struct merge_node *nodes = heap->nodes;
+	struct merge_node node = nodes[pos];
+	int parent;
+	int child;
+
+	while (pos) {
+		parent = (pos - 1) / 2;
+		if (!merge_before(&node, &nodes[parent]))
+			break;
+		merge_set(heap, pos, &nodes[parent]);
+		pos = parent;
+	}
+
+	for (;;) {
+		child = pos * 2 + 1;
+		if (child >= heap->nr)
+			break;
+		if (child + 1 < heap->nr &&
+		    merge_before(&nodes[child + 1], &nodes[child]))
+			child++;
+		if (!merge_before(&nodes[child], &node))
+			break;
+		merge_set(heap, pos, &nodes[child]);
+		pos = child;
+	}
+
+	merge_set(heap, pos, &node);
+}
+
+/*
+ * Put @cpu where its next @record goes in the heap, or remove it
+ * if @record is NULL.
+ */
+static void merge_heap_update(struct merge_heap *heap, int cpu,
+			      struct pevent_record *record)
+{
+	struct merge_node node;
+	int pos = heap->pos[cpu];
+
+	if (!record) {
+		/* Nothing more to read on this CPU, remove it */
+		if (pos < 0)
+			return;
+		heap->pos[cpu] = -1;
+		if (pos == --heap->nr)
+			return;
+		merge_set(heap, pos, &heap->nodes[heap->nr]);
+		merge_sift(heap, pos);
+		return;
+	}
+
+	node.ts = record->ts;
+	node.cpu = cpu;
+
+	if (pos < 0)
+		pos = heap->nr++;
+	merge_set(heap, pos, &node);
+	merge_sift(heap, pos);
+}
+
+/* Returns the next CPU that moved, or -1 if there are no more */
+static inline int merge_heap_next_dirty(struct merge_heap *heap)
+{
+	int cpu;
+
+	if (!heap->nr_dirty)
+		return -1;
+
+	cpu = heap->dirty[--heap->nr_dirty];
+	heap->is_dirty[cpu] = false;
+
+	return cpu;
+}
+
+static int merge_heap_init(struct merge_heap *heap, int cpus)
+{
+	int cpu;
+
+	heap->nodes = malloc(sizeof(*heap->nodes) * cpus);
+	heap->pos = malloc(sizeof(*heap->pos) * cpus);
+	heap->dirty = malloc(sizeof(*heap->dirty) * cpus);
+	heap->is_dirty = malloc(sizeof(*heap->is_dirty) * cpus);
+	if (!heap->nodes || !heap->pos || !heap->dirty || !heap->is_dirty) {
+		free(heap->nodes);
+		free(heap->pos);
+		free(heap->dirty);
+		free(heap->is_dirty);
+		memset(heap, 0, sizeof(*heap));
+		return -1;
+	}
+
+	heap->nr = 0;
+	heap->nr_dirty = 0;
+
+	/* Have all CPUs added on the first read */
+	for (cpu = 0; cpu < cpus; cpu++) {
+		heap->pos[cpu] = -1;
+		heap->is_dirty[cpu] = false;
+		merge_heap_mark(heap, cpu);
+	}
+
+	return 0;
+}
+
+static void merge_heap_free(struct merge_heap *heap)
+{
+	free(heap->nodes);
+	free(heap->pos);
+	free(heap->dirty);
+	free(heap->is_dirty);
+	memset(heap, 0, sizeof(*heap));
+}
+
+static void merge_update(struct tracecmd_input *handle, int cpu)
+{
+	struct pevent_record *record = NULL;
+
+	if (!handle->cpu_data[cpu].merge_skip)
+		record = tracecmd_peek_data(handle, cpu);
+
+	merge_heap_update(&handle->merge, cpu, record);
+}
+
+static int merge_init(struct tracecmd_input *handle)
+{
+	return merge_heap_init(&handle->merge, handle->cpus);
+}
+
+static void merge_free(struct tracecmd_input *handle)
+{
+	merge_heap_free(&handle->merge);
+}
+
+/*
+ * Pipes can not be kept in the heap, as a CPU that is empty
+ * now may have data later. Just look at all of them.
+ */
+static struct pevent_record *
+read_next_data_scan(struct tracecmd_input *handle, int *rec_cpu)
+{
+	unsigned long long ts;
+	struct pevent_record *record;
+	int first_record = 1;
+	int next;
+	int cpu;
+
+	next = -1;
+	ts = 0;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (handle->cpu_data[cpu].merge_skip)
+			continue;
+		record = tracecmd_peek_data(handle, cpu);
+		if (record && (first_record || record->ts < ts)) {
+			ts = record->ts;
+			next = cpu;
+			first_record = 0;
+		}
+	}
+
+	if (next >= 0) {
+		if (rec_cpu)
+			*rec_cpu = next;
+		return tracecmd_read_data(handle, next);
+	}
+
+	return NULL;
+}
+
+/**
+ * tracecmd_read_next_data - read the next record
+ * @handle: input handle to the trace.dat file
+ * @rec_cpu: return pointer to the CPU that the record belongs to
+ *
+ * This returns the next record by time. This is different than
+ * tracecmd_read_data in that it looks at all CPUs. The CPUs are
+ * kept in a heap ordered by the time stamp of their next record,
+ * and the record with the earliest time stamp is returned.
+ * If @rec_cpu is not NULL it gets the CPU id the record was
+ * on. The CPU cursor of the returned record is moved to the
+ * next record.
+ *
+ * Multiple reads of this function will return a serialized list
+ * of all records for all CPUs in order of time stamp.
+ *
+ * The record returned must be freed.
+ */
+struct pevent_record *
+tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu)
+{
+	int cpu;
+
+	if (rec_cpu)
+		*rec_cpu = -1;
+
+	if (handle->use_pipe ||
+	    (!handle->merge.nodes && merge_init(handle) < 0))
+		return read_next_data_scan(handle, rec_cpu);
+
+	/*
+	 * Update the CPUs that moved since the last read. This
+	 * includes the CPU of the last record returned. Peeking a
+	 * CPU may mark it again, so loop until they are all done.
+	 */
+	while ((cpu = merge_heap_next_dirty(&handle->merge)) >= 0)
+		merge_update(handle, cpu);
+
+	if (!handle->merge.nr)
+		return NULL;
+
+	cpu = handle->merge.nodes[0].cpu;
+	if (rec_cpu)
+		*rec_cpu = cpu;
+
+	return tracecmd_read_data(handle, cpu);
+}
+
+/**
+ * tracecmd_set_read_cpus - limit the CPUs read by tracecmd_read_next_data
+ * @handle: input handle to the trace.dat file
+ * @cpus: array of CPUs terminated by -1, or NULL to read all CPUs
+ *
+ * After this call, tracecmd_read_next_data() only returns records
+ * of the CPUs in @cpus. CPUs that are not in the file are ignored.
+ */
+void tracecmd_set_read_cpus(struct tracecmd_input *handle, const int *cpus)
+{
+	int cpu;
+	int i;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++)
+		handle->cpu_data[cpu].merge_skip = cpus != NULL;
+
+	for (i = 0; cpus && cpus[i] >= 0; i++) {
+		if (cpus[i] < handle->cpus)
+			handle->cpu_data[cpus[i]].merge_skip = false;
+	}
+
+	/* Rebuild the heap on the next read */
+	merge_free(handle);
+}
+
+static void free_page_events(struct tracecmd_input *handle)
+{
+	int cpu;
+
+	for (cpu = 0; handle->cpu_data && cpu < handle->cpus; cpu++) {
+		free(handle->cpu_data[cpu].page_summary);
+		free(handle->cpu_data[cpu].page_ids);
+		handle->cpu_data[cpu].page_summary = NULL;
+		handle->cpu_data[cpu].page_ids = NULL;
+	}
+}
+
+/**
+ * tracecmd_set_read_events - skip the records of events not given
+ * @handle: input handle to the trace.dat file
+ * @ids: array of event ids terminated by -1, or NULL to read all events
+ *
+ * After this call, the reads of the CPUs skip the records of the
+ * events that are not in @ids, before a record is made for them.
+ * When the file has a summary of the events on each page, the pages
+ * that hold none of the events in @ids are not read at all. The page
+ * a CPU is currently on is not skipped.
+ *
+ * This must be called before tracecmd_start_read_threads().
+ *
+ * Returns 0 if pages will be skipped, or -1 if the file does not
+ * have the summaries, in which case all pages are read.
+ */
+int tracecmd_set_read_events(struct tracecmd_input *handle, const int *ids)
+{
+	struct format_field *field;
+	struct event_format *event;
+	int max = -1;
+	int cpu;
+	int i;
+
+	free(handle->read_events);
+	handle->read_events = NULL;
+	handle->nr_read_events = 0;
+
+	if (!ids || handle->read_workers)
+		return -1;
+
+	/* The events are told apart by their common_type */
+	if (ids[0] >= 0) {
+		event = pevent_find_event(handle->pevent, ids[0]);
+		field = event ? pevent_find_common_field(event, "common_type") : NULL;
+		if (!field || field->offset || field->size != 2)
+			return -1;
+	}
+
+	for (i = 0; ids[i] >= 0; i++) {
+		if (ids[i] > max)
+			max = ids[i];
+	}
+
+	handle->nr_read_events = max + 1;
+	handle->read_events = calloc(max / 8 + 1, 1);
+	if (!handle->read_events)
+		return -1;
+
+	for (i = 0; ids[i] >= 0; i++)
+		handle->read_events[ids[i] / 8] |= 1 << (ids[i] % 8);
+
+	if (!handle->page_events)
+		return -1;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (handle->cpu_data[cpu].page_summary ||
+		    !handle->cpu_data[cpu].file_size)
+			continue;
+		if (load_page_events(handle, cpu) < 0) {
+			/* Bad summaries, do not use them again */
+			free_page_events(handle);
+			handle->page_events = 0;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * tracecmd_set_read_pids - skip the records of events for other tasks
+ * @handle: input handle to the trace.dat file
+ * @ids: array of event ids terminated by -1, or NULL to read all tasks
+ * @pids: array of pids terminated by -1
+ *
+ * After this call, the reads of the CPUs skip the records of the
+ * events in @ids whose common_pid is not in @pids, before a record
+ * is made for them.
+ *
+ * This must be called before tracecmd_start_read_threads().
+ *
+ * Returns 0 on success, or -1 if the records can not be told
+ * apart by pid, in which case they are all read.
+ */
+int tracecmd_set_read_pids(struct tracecmd_input *handle, const int *ids,
+			   const int *pids)
+{
+	struct format_field *field;
+	struct event_format *event;
+	int max = -1;
+	int i;
+
+	free(handle->pid_events);
+	free(handle->read_pids);
+	handle->pid_events = NULL;
+	handle->nr_pid_events = 0;
+	handle->read_pids = NULL;
+	handle->nr_read_pids = 0;
+
+	if (!ids || ids[0] < 0 || handle->read_workers)
+		return -1;
+
+	event = pevent_find_event(handle->pevent, ids[0]);
+	field = event ? pevent_find_common_field(event, "common_pid") : NULL;
+	if (!field || field->size != 4)
+		return -1;
+	handle->pid_offset = field->offset;
+
+	for (i = 0; pids[i] >= 0; i++)
+		;
+	handle->read_pids = malloc(sizeof(*pids) * (i + 1));
+	if (!handle->read_pids)
+		return -1;
+	memcpy(handle->read_pids, pids, sizeof(*pids) * i);
+	qsort(handle->read_pids, i, sizeof(*pids), cmp_pid);
+	handle->nr_read_pids = i;
+
+	for (i = 0; ids[i] >= 0; i++) {
+		if (ids[i] > max)
+			max = ids[i];
+	}
+
+	handle->pid_events = calloc(max / 8 + 1, 1);
+	if (!handle->pid_events) {
+		free(handle->read_pids);
+		handle->read_pids = NULL;
+		handle->nr_read_pids = 0;
+		return -1;
+	}
+	handle->nr_pid_events = max + 1;
+
+	for (i = 0; ids[i] >= 0; i++)
+		handle->pid_events[ids[i] / 8] |= 1 << (ids[i] % 8);
+
+	return 0;
+}
+
+/**
+ * tracecmd_set_read_follow - skip an event along with the one before it
+ * @handle: input handle to the trace.dat file
+ * @id: the event id, or -1 to not skip any
+ *
+ * Some events, like the kernel stack traces, belong to the event
+ * that was recorded right before them on the same CPU. After this
+ * call, a record of event @id is skipped when the event before it
+ * was skipped by tracecmd_set_read_events() or tracecmd_set_read_pids().
+ */
+void tracecmd_set_read_follow(struct tracecmd_input *handle, int id)
+{
+	handle->read_follow = id;
+}
+
+/*
+ * Read the records of the next page of a CPU for a read thread.
+ * The CPU data is mapped as a whole, so this does not touch the
+ * pages or the iterator of the CPU that the consumer may be using.
+ * The records get a page of their own, that is not on the list of
+ * pages of the CPU, so that the record helpers that look at the page
+ * (like tracecmd_record_at_buffer_start()) work for them.
+ */
+static struct read_chunk *
+read_worker_page(struct read_worker *worker, int cpu)
+{
+	struct tracecmd_input *handle = worker->handle;
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct kbuffer *kbuf = worker->kbuf;
+	struct pevent_record *record;
+	struct read_chunk *chunk;
+	struct page *page;
+	unsigned long long offset;
+	unsigned long long ts;
+	void *data;
+
+	offset = cpu_data->read_offset;
+	cpu_data->read_offset += handle->page_size;
+	if (handle->read_events && handle->page_events)
+		cpu_data->read_offset = next_read_page(handle, cpu,
+			cpu_data->file_offset + cpu_data->read_offset) -
+			cpu_data->file_offset;
+
+	kbuffer_load_subbuffer(kbuf, cpu_data->data + offset);
+	if (kbuffer_subbuffer_size(kbuf) > handle->page_size)
+		die("bad page read, with size of %d",
+		    kbuffer_subbuffer_size(kbuf));
+
+	/* An event takes at least 8 bytes */
+	chunk = malloc_or_die(sizeof(*chunk) + sizeof(record) *
+			      (handle->page_size / 8));
+	chunk->next = NULL;
+	chunk->nr = 0;
+	chunk->pos = 0;
+
+	page = malloc_or_die(sizeof(*page));
+	memset(page, 0, sizeof(*page));
+	list_head_init(&page->list);
+	page->offset = cpu_data->file_offset + offset;
+	page->handle = handle;
+	page->map = cpu_data->data + offset;
+
+	while ((data = kbuffer_read_event(kbuf, &ts))) {
+		if (skip_read_event(handle, data, &cpu_data->read_skipped)) {
+			kbuffer_next_event(kbuf, NULL);
+			continue;
+		}
+
+		record = worker->free_records;
+		if (record)
+			worker->free_records = record->priv;
+		else
+			record = malloc_or_die(sizeof(*record));
+		memset(record, 0, sizeof(*record));
+
+		record->ts = ts + handle->ts_offset;
+		record->size = kbuffer_event_size(kbuf);
+		record->record_size = kbuffer_curr_size(kbuf);
+		record->cpu = cpu;
+		record->data = data;
+		record->offset = cpu_data->file_offset + offset +
+			kbuffer_curr_offset(kbuf);
+		record->missed_events = kbuffer_missed_events(kbuf);
+		record->ref_count = 1;
+
+		kbuffer_next_event(kbuf, NULL);
+
+		if (handle->read_filter &&
+		    !handle->read_filter(handle, record,
+					 handle->read_filter_data)) {
+			/* Dropped, as if it was skipped */
+			cpu_data->read_skipped = true;
+			record->priv = worker->free_records;
+			worker->free_records = record;
+			continue;
+		}
+		record->priv = page;
+		add_record(page, record);
+		page->ref_count++;
+		chunk->records[chunk->nr++] = record;
+	}
+
+	/* The events of the pages passed over were skipped */
+	if (cpu_data->read_offset != offset + handle->page_size)
+		cpu_data->read_skipped = true;
+
+	if (!chunk->nr) {
+		free(page);
+		free(chunk);
+		return NULL;
+	}
+
+	return chunk;
+}
+
+static void *read_worker_thread(void *data)
+{
+	struct read_worker *worker = data;
+	struct tracecmd_input *handle = worker->handle;
+	struct cpu_data *cpu_data;
+	struct read_chunk *chunk;
+	int cpu;
+	int i;
+
+	pthread_mutex_lock(&worker->lock);
+
+	while (!worker->stop) {
+		/* Read ahead the CPU that has the least queued */
+		cpu = -1;
+		for (i = 0; i < worker->nr_cpus; i++) {
+			cpu_data = &handle->cpu_data[worker->cpus[i]];
+			if (cpu_data->queue_done ||
+			    cpu_data->nr_queued >= READ_QUEUE_MAX)
+				continue;
+			if (cpu < 0 ||
+			    cpu_data->nr_queued < handle->cpu_data[cpu].nr_queued)
+				cpu = worker->cpus[i];
+		}
+
+		if (cpu < 0) {
+			for (i = 0; i < worker->nr_cpus; i++) {
+				if (!handle->cpu_data[worker->cpus[i]].queue_done)
+					break;
+			}
+			/* All done */
+			if (i == worker->nr_cpus)
+				break;
+			pthread_cond_wait(&worker->space, &worker->lock);
+			continue;
+		}
+
+		/* Take the records that the consumer is done with */
+		if (worker->given_records) {
+			worker->given_tail->priv = worker->free_records;
+			worker->free_records = worker->given_records;
+			worker->given_records = NULL;
+			worker->given_tail = NULL;
+			worker->nr_given_records = 0;
+		}
+
+		pthread_mutex_unlock(&worker->lock);
+		chunk = read_worker_page(worker, cpu);
+		pthread_mutex_lock(&worker->lock);
+
+		cpu_data = &handle->cpu_data[cpu];
+		if (chunk) {
+			if (cpu_data->queue_tail)
+				cpu_data->queue_tail->next = chunk;
+			else
+				cpu_data->queue = chunk;
+			cpu_data->queue_tail = chunk;
+			cpu_data->nr_queued++;
+		}
+		if (cpu_data->read_offset >= cpu_data->file_size)
+			cpu_data->queue_done = true;
+
+		pthread_cond_broadcast(&worker->ready);
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+/*
+ * Hand the records freed by the consumer over to a read thread, so that
+ * it does not need to malloc the records of every page it reads.
+ * Must be called with the lock of @worker held.
+ */
+static void read_worker_give_records(struct tracecmd_input *handle,
+				     struct read_worker *worker)
+{
+	struct pevent_record *record;
+
+	while (handle->free_records &&
+	       worker->nr_given_records < RECORD_POOL_MAX) {
+		record = handle->free_records;
+		handle->free_records = record->priv;
+		handle->nr_free_records--;
+
+		record->priv = worker->given_records;
+		if (!worker->given_records)
+			worker->given_tail = record;
+		worker->given_records = record;
+		worker->nr_given_records++;
+	}
+}
+
+/*
+ * Take the next record of a CPU that was read ahead, waiting
+ * for its read thread if it has not got there yet.
+ */
+static struct pevent_record *
+read_threads_next(struct tracecmd_input *handle, int cpu)
+{
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct read_worker *worker = cpu_data->worker;
+	struct read_chunk *chunk = cpu_data->chunk;
+
+	if (chunk && chunk->pos == chunk->nr) {
+		free(chunk);
+		chunk = cpu_data->chunk = NULL;
+	}
+
+	if (!chunk) {
+		if (!worker)
+			return NULL;
+
+		pthread_mutex_lock(&worker->lock);
+		while (!cpu_data->queue && !cpu_data->queue_done)
+			pthread_cond_wait(&worker->ready, &worker->lock);
+
+		chunk = cpu_data->queue;
+		if (chunk) {
+			cpu_data->queue = chunk->next;
+			if (!cpu_data->queue)
+				cpu_data->queue_tail = NULL;
+			cpu_data->nr_queued--;
+			pthread_cond_signal(&worker->space);
+		}
+		read_worker_give_records(handle, worker);
+		pthread_mutex_unlock(&worker->lock);
+
+		if (!chunk)
+			return NULL;
+		cpu_data->chunk = chunk;
+	}
+
+	return chunk->records[chunk->pos++];
+}
+
+static void free_record_list(struct pevent_record *record)
+{
+	struct pevent_record *next;
+
+	for (; record; record = next) {
+		next = record->priv;
+		free(record);
+	}
+}
+
+static void free_read_chunks(struct read_chunk *chunk)
+{
+	struct read_chunk *next;
+
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		while (chunk->pos < chunk->nr)
+			free_record(chunk->records[chunk->pos++]);
+		free(chunk);
+	}
+}
+
+/**
+ * tracecmd_start_read_threads - read and decode the CPUs in threads
+ * @handle: input handle for the trace.dat file
+ * @nr_threads: the number of threads to use
+ * @filter: if not NULL, called on each record by the threads
+ * @data: data passed to @filter
+ *
+ * Starts @nr_threads threads that each own a set of the CPUs, and
+ * read ahead the records of these CPUs from the start of the data.
+ * tracecmd_peek_data(), tracecmd_read_data() and
+ * tracecmd_read_next_data() then return the records that were read
+ * ahead, in the same order as without the threads.
+ *
+ * If @filter is given, records that it returns zero for are dropped
+ * by the threads. It is called concurrently by all the threads.
+ *
+ * Only CPUs selected by tracecmd_set_read_cpus() are read. The CPU
+ * iterators can not be moved by the seek functions while the threads
+ * are running.
+ *
+ * Returns 0 on success, or -1 if the threads can not be used with
+ * this handle, in which case the records are read as before.
+ */
+int tracecmd_start_read_threads(struct tracecmd_input *handle, int nr_threads,
+				tracecmd_read_filter_func filter, void *data)
+{
+	struct pevent *pevent = handle->pevent;
+	enum kbuffer_long_size long_size;
+	enum kbuffer_endian endian;
+	struct pevent_record *record;
+	struct read_worker *worker;
+	int nr_cpus = 0;
+	int cpu;
+	int i;
+
+	/* The threads need the CPU data mapped as a whole */
+	if (handle->read_workers || handle->use_pipe ||
+	    !handle->map_sections || nr_threads < 1)
+		return -1;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		if (handle->cpu_data[cpu].file_size &&
+		    !handle->cpu_data[cpu].merge_skip)
+			nr_cpus++;
+	}
+	if (!nr_cpus)
+		return -1;
+	if (nr_threads > nr_cpus)
+		nr_threads = nr_cpus;
+
+	/*
+	 * Some of the pevent fields are set up on first use, do
+	 * that before the threads can race to it. The filters may
+	 * look up functions, which sorts and indexes the function map.
+	 */
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		record = tracecmd_peek_data(handle, cpu);
+		if (record) {
+			pevent_data_type(pevent, record);
+			pevent_data_pid(pevent, record);
+			pevent_data_comm_from_pid(pevent, 0);
+			break;
+		}
+	}
+	pevent_find_function(pevent, 0);
+
+	for (cpu = 0; cpu < handle->cpus; cpu++)
+		free_next(handle, cpu);
+	merge_free(handle);
+
+	if (handle->long_size == 8)
+		long_size = KBUFFER_LSIZE_8;
+	else
+		long_size = KBUFFER_LSIZE_4;
+
+	if (pevent->file_bigendian)
+		endian = KBUFFER_ENDIAN_BIG;
+	else
+		endian = KBUFFER_ENDIAN_LITTLE;
+
+	handle->read_workers = calloc(nr_threads, sizeof(*handle->read_workers));
+	if (!handle->read_workers)
+		return -1;
+	handle->nr_read_workers = nr_threads;
+	handle->read_filter = filter;
+	handle->read_filter_data = data;
+
+	for (i = 0; i < nr_threads; i++) {
+		worker = &handle->read_workers[i];
+		worker->handle = handle;
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->space, NULL);
+		pthread_cond_init(&worker->ready, NULL);
+		worker->cpus = malloc(sizeof(*worker->cpus) * nr_cpus);
+		worker->kbuf = kbuffer_alloc(long_size, endian);
+		if (!worker->cpus || !worker->kbuf)
+			goto fail;
+		if (pevent->old_format)
+			kbuffer_set_old_format(worker->kbuf);
+	}
+
+	/* Hand out the CPUs round robin */
+	for (i = 0, cpu = 0; cpu < handle->cpus; cpu++) {
+		struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+
+		if (!cpu_data->file_size || cpu_data->merge_skip)
+			continue;
+
+		worker = &handle->read_workers[i++ % nr_threads];
+		worker->cpus[worker->nr_cpus++] = cpu;
+		cpu_data->worker = worker;
+		cpu_data->read_offset = 0;
+		cpu_data->queue_done = false;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		worker = &handle->read_workers[i];
+		if (pthread_create(&worker->thread, NULL,
+				   read_worker_thread, worker))
+			goto fail;
+		worker->started = true;
+	}
+
+	return 0;
+
+ fail:
+	tracecmd_stop_read_threads(handle);
+	return -1;
+}
+
+/**
+ * tracecmd_stop_read_threads - stop the threads reading ahead
+ * @handle: input handle for the trace.dat file
+ *
+ * Stops the threads started by tracecmd_start_read_threads() and
+ * frees the records they read ahead. The CPU iterators need to be
+ * set (for example with tracecmd_set_all_cpus_to_timestamp()) before
+ * reading records again.
+ */
+void tracecmd_stop_read_threads(struct tracecmd_input *handle)
+{
+	struct read_worker *worker;
+	struct cpu_data *cpu_data;
+	int cpu;
+	int i;
+
+	if (!handle->read_workers)
+		return;
+
+	for (i = 0; i < handle->nr_read_workers; i++) {
+		worker = &handle->read_workers[i];
+		if (!worker->started)
+			continue;
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = true;
+		pthread_cond_broadcast(&worker->space);
+		pthread_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+	}
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		free_next(handle, cpu);
+		free_read_chunks(cpu_data->chunk);
+		free_read_chunks(cpu_data->queue);
+		cpu_data->chunk = NULL;
+		cpu_data->queue = NULL;
+		cpu_data->queue_tail = NULL;
+		cpu_data->nr_queued = 0;
+		cpu_data->worker = NULL;
+	}
+
+	for (i = 0; i < handle->nr_read_workers; i++) {
+		worker = &handle->read_workers[i];
+		pthread_mutex_destroy(&worker->lock);
+		pthread_cond_destroy(&worker->space);
+		pthread_cond_destroy(&worker->ready);
+		kbuffer_free(worker->kbuf);
+		free(worker->cpus);
+		free_record_list(worker->free_records);
+		free_record_list(worker->given_records);
+	}
+
+	free(handle->read_workers);
+	handle->read_workers = NULL;
+	handle->nr_read_workers = 0;
+	handle->read_filter = NULL;
+	handle->read_filter_data = NULL;
+	merge_free(handle);
+}
+
+static void iter_put_page(struct tracecmd_iter *iter, int cpu)
+{
+	struct iter_cpu *icpu = &iter->cpus[cpu];
+
+	if (icpu->next) {
+		icpu->next->locked = 0;
+		free_record(icpu->next);
+		icpu->next = NULL;
+	}
+	if (icpu->page) {
+		__free_page(iter->handle, icpu->page);
+		icpu->page = NULL;
+	}
+}
+
+/*
+ * Move the iterator of a CPU to the page at @offset. The pages are
+ * taken from the page cache of the handle, which is shared with the
+ * CPU iterators of the handle and the other tracecmd_iters.
+ */
+static int iter_get_page(struct tracecmd_iter *iter, int cpu, off64_t offset)
+{
+	struct tracecmd_input *handle = iter->handle;
+	struct iter_cpu *icpu = &iter->cpus[cpu];
+	struct page *page;
+
+	page = allocate_page(handle, cpu, offset);
+	if (!page)
+		return -1;
+
+	iter_put_page(iter, cpu);
+	icpu->page = page;
+
+	kbuffer_load_subbuffer(icpu->kbuf, page->map);
+	if (kbuffer_subbuffer_size(icpu->kbuf) > handle->page_size)
+		die("bad page read, with size of %d",
+		    kbuffer_subbuffer_size(icpu->kbuf));
+
+	return 0;
+}
+
+/* Time stamp of the start of the page at @offset */
+static int iter_page_ts(struct tracecmd_iter *iter, int cpu, off64_t offset,
+			unsigned long long *ts)
+{
+	if (iter_get_page(iter, cpu, offset) < 0)
+		return -1;
+
+	*ts = kbuffer_timestamp(iter->cpus[cpu].kbuf) + iter->handle->ts_offset;
+	return 0;
+}
+
+static int iter_set_cpu_to_timestamp(struct tracecmd_iter *iter, int cpu,
+				     unsigned long long ts)
+{
+	struct tracecmd_input *handle = iter->handle;
+	struct cpu_data *cpu_data = &handle->cpu_data[cpu];
+	struct pevent_record *record;
+	unsigned long long page_ts;
+	unsigned long long start = 0;
+	unsigned long long end;
+	unsigned long long mid;
+
+	iter_put_page(iter, cpu);
+
+	if (!cpu_data->file_size)
+		return 0;
+
+	if (handle->page_events && !cpu_data->page_summary &&
+	    load_page_events(handle, cpu) < 0) {
+		free_page_events(handle);
+		handle->page_events = 0;
+	}
+
+	if (cpu_data->page_summary) {
+		/* Go right to the first page that ends at or after @ts */
+		end = (cpu_data->file_size + handle->page_size - 1) /
+			handle->page_size;
+		while (start < end) {
+			mid = start + (end - start) / 2;
+			if (cpu_data->page_summary[mid].last_ts +
+			    handle->ts_offset < ts)
+				start = mid + 1;
+			else
+				end = mid;
+		}
+		if (start && start * handle->page_size >= cpu_data->file_size)
+			start--;
+		goto found;
+	}
+
+	if (handle->page_index && !cpu_data->page_ts &&
+	    load_page_index(handle, cpu) < 0)
+		handle->page_index = 0;
+
+	/* Find the last page that starts before @ts */
+	if (handle->page_index)
+		end = cpu_data->nr_pages;
+	else
+		end = (cpu_data->file_size + handle->page_size - 1) /
+			handle->page_size;
+	while (start < end) {
+		mid = start + (end - start) / 2;
+		if (handle->page_index)
+			page_ts = cpu_data->page_ts[mid] + handle->ts_offset;
+		else if (iter_page_ts(iter, cpu, cpu_data->file_offset +
+				      mid * handle->page_size, &page_ts) < 0)
+			return -1;
+		if (page_ts < ts)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	if (start)
+		start--;
+
+ found:
+	if (iter_get_page(iter, cpu, cpu_data->file_offset +
+			  start * handle->page_size) < 0)
+		return -1;
+
+	/* Skip to the first record at or after @ts */
+	while ((record = tracecmd_iter_peek_data(iter, cpu)) &&
+	       record->ts < ts) {
+		iter->cpus[cpu].next = NULL;
+		record->locked = 0;
+		free_record(record);
+	}
+
+	return 0;
+}
+
+/**
+ * tracecmd_iter_new - create an iterator over the records of a handle
+ * @handle: input handle for the trace.dat file
+ * @cpus: array of CPUs terminated by -1, or NULL for all CPUs
+ * @ts: the time stamp to start at
+ *
+ * Unlike the CPU iterators of the handle, that there is only one of,
+ * any number of tracecmd_iters can be created on a handle, each
+ * with its own position. They share the pages that the handle has
+ * mapped, so iterators reading the same region do not map the pages
+ * again. The iterators of a handle must be used from the same thread.
  *
- * The @last_record is used to know where to read the next record from.
- * If @last_record is NULL, the first record on the page will be read.
+ * The iterator starts at the first record of each CPU in @cpus that
+ * is at or after @ts.
  *
- * Returns:
- *  A newly allocated record that must be freed with free_record() if
- *  a record is found. Otherwise NULL is returned if the record is bad
- *  or no more records exist.
+ * Returns the iterator, which must be freed with tracecmd_iter_free(),
+ * or NULL on error.
  */
-struct pevent_record *
-tracecmd_read_page_record(struct pevent *pevent, void *page, int size,
-			  struct pevent_record *last_record)
+struct tracecmd_iter *
+tracecmd_iter_new(struct tracecmd_input *handle, const int *cpus,
+		  unsigned long long ts)
 {
-	unsigned long long ts;
-	struct kbuffer *kbuf;
-	struct pevent_record *record = NULL;
+	struct pevent *pevent = handle->pevent;
 	enum kbuffer_long_size long_size;
 	enum kbuffer_endian endian;
-	void *ptr;
+	struct tracecmd_iter *iter;
+	int cpu;
+	int i;
 
-	if (pevent->file_bigendian)
-		endian = KBUFFER_ENDIAN_BIG;
-	else
-		endian = KBUFFER_ENDIAN_LITTLE;
+	if (handle->use_pipe || !handle->cpu_data)
+		return NULL;
 
-	if (pevent->header_page_size_size == 8)
+	iter = malloc(sizeof(*iter));
+	if (!iter)
+		return NULL;
+	iter->handle = handle;
+	iter->cpus = calloc(handle->cpus, sizeof(*iter->cpus));
+	if (!iter->cpus) {
+		free(iter);
+		return NULL;
+	}
+	if (merge_heap_init(&iter->merge, handle->cpus) < 0) {
+		free(iter->cpus);
+		free(iter);
+		return NULL;
+	}
+
+	if (handle->long_size == 8)
 		long_size = KBUFFER_LSIZE_8;
 	else
 		long_size = KBUFFER_LSIZE_4;
 
-	kbuf = kbuffer_alloc(long_size, endian);
-	if (!kbuf)
-		return NULL;
+	if (pevent->file_bigendian)
+		endian = KBUFFER_ENDIAN_BIG;
+	else
+		endian = KBUFFER_ENDIAN_LITTLE;
 
-	kbuffer_load_subbuffer(kbuf, page);
-	if (kbuffer_subbuffer_size(kbuf) > size) {
-		warning("tracecmd_read_page_record: page_size > size");
-		goto out_free;
+	for (i = 0; cpus ? cpus[i] >= 0 : i < handle->cpus; i++) {
+		cpu = cpus ? cpus[i] : i;
+		if (cpu >= handle->cpus || iter->cpus[cpu].kbuf)
+			continue;
+		iter->cpus[cpu].kbuf = kbuffer_alloc(long_size, endian);
+		if (!iter->cpus[cpu].kbuf)
+			goto fail;
+		if (pevent->old_format)
+			kbuffer_set_old_format(iter->cpus[cpu].kbuf);
 	}
 
-	if (last_record) {
-		if (last_record->data < page || last_record->data >= (page + size)) {
-			warning("tracecmd_read_page_record: bad last record (size=%u)",
-				last_record->size);
-			goto out_free;
-		}
+	if (tracecmd_iter_set_timestamp(iter, ts) < 0)
+		goto fail;
 
-		do {
-			ptr = kbuffer_next_event(kbuf, NULL);
-			if (!ptr)
-				break;
-		} while (ptr < last_record->data);
-		if (ptr != last_record->data) {
-			warning("tracecmd_read_page_record: could not find last_record");
-			goto out_free;
-		}
-	}
+	return iter;
 
-	ptr = kbuffer_read_event(kbuf, &ts);
-	if (!ptr)
-		goto out_free;
+ fail:
+	tracecmd_iter_free(iter);
+	return NULL;
+}
 
-	record = malloc(sizeof(*record));
-	if (!record)
-		return NULL;
-	memset(record, 0, sizeof(*record));
+/**
+ * tracecmd_iter_free - free an iterator
+ * @iter: the iterator created by tracecmd_iter_new()
+ *
+ * Records read from the iterator stay valid, and still need to be
+ * freed with free_record().
+ */
+void tracecmd_iter_free(struct tracecmd_iter *iter)
+{
+	int cpu;
 
-	record->ts = ts;
-	record->size = kbuffer_event_size(kbuf);
-	record->record_size = kbuffer_curr_size(kbuf);
-	record->cpu = 0;
-	record->data = ptr;
-	record->ref_count = 1;
+	if (!iter)
+		return;
 
- out_free:
-	kbuffer_free(kbuf);
-	return record;
+	for (cpu = 0; cpu < iter->handle->cpus; cpu++) {
+		if (!iter->cpus[cpu].kbuf)
+			continue;
+		iter_put_page(iter, cpu);
+		kbuffer_free(iter->cpus[cpu].kbuf);
+	}
+	merge_heap_free(&iter->merge);
+	free(iter->cpus);
+	free(iter);
 }
 
 /**
- * tracecmd_peek_data - return the record at the current location.
- * @handle: input handle for the trace.dat file
+ * tracecmd_iter_set_timestamp - move an iterator to a given time
+ * @iter: the iterator created by tracecmd_iter_new()
+ * @ts: the time stamp to move to
+ *
+ * Sets each CPU of @iter to its first record at or after @ts.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tracecmd_iter_set_timestamp(struct tracecmd_iter *iter,
+				unsigned long long ts)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < iter->handle->cpus; cpu++) {
+		if (!iter->cpus[cpu].kbuf)
+			continue;
+		merge_heap_mark(&iter->merge, cpu);
+		if (iter_set_cpu_to_timestamp(iter, cpu, ts) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * tracecmd_iter_peek_data - return the record at an iterator location
+ * @iter: the iterator created by tracecmd_iter_new()
  * @cpu: the CPU to pull from
  *
- * This returns the record at the current location of the CPU
- * iterator. It does not increment the CPU iterator.
+ * The same as tracecmd_peek_data(), for the position of @iter.
+ * The record returned must not be freed.
  */
 struct pevent_record *
-tracecmd_peek_data(struct tracecmd_input *handle, int cpu)
+tracecmd_iter_peek_data(struct tracecmd_iter *iter, int cpu)
 {
+	struct tracecmd_input *handle = iter->handle;
 	struct pevent_record *record;
+	struct iter_cpu *icpu;
+	struct cpu_data *cpu_data;
 	unsigned long long ts;
-	struct kbuffer *kbuf;
-	struct page *page;
-	int index;
+	off64_t offset;
 	void *data;
 
-	if (cpu >= handle->cpus)
+	if (cpu < 0 || cpu >= handle->cpus)
 		return NULL;
 
-	page = handle->cpu_data[cpu].page;
-	kbuf = handle->cpu_data[cpu].kbuf;
-
-	/* Hack to work around function graph read ahead */
-	tracecmd_curr_thread_handle = handle;
-
-	if (handle->cpu_data[cpu].next) {
-
-		record = handle->cpu_data[cpu].next;
-		if (!record->data)
-			die("Something freed the record");
-
-		if (handle->cpu_data[cpu].timestamp == record->ts)
-			return record;
+	icpu = &iter->cpus[cpu];
+	if (icpu->next)
+		return icpu->next;
+	if (!icpu->page)
+		return NULL;
 
-		/*
-		 * The timestamp changed, which means the cached
-		 * record is no longer valid. Reread a new record.
-		 */
-		free_next(handle, cpu);
-	}
+	cpu_data = &handle->cpu_data[cpu];
 
-read_again:
-	if (!page) {
-		if (handle->use_pipe) {
-			get_next_page(handle, cpu);
-			page = handle->cpu_data[cpu].page;
-		}
-		if (!page)
+	while (!(data = kbuffer_read_event(icpu->kbuf, &ts))) {
+		offset = icpu->page->offset + handle->page_size;
+		if (offset >= cpu_data->file_offset + cpu_data->file_size) {
+			iter_put_page(iter, cpu);
 			return NULL;
-	}
-
-	data = kbuffer_read_event(kbuf, &ts);
-	if (!data) {
-		if (get_next_page(handle, cpu))
+		}
+		if (iter_get_page(iter, cpu, offset) < 0)
 			return NULL;
-		page = handle->cpu_data[cpu].page;
-		goto read_again;
 	}
 
-	handle->cpu_data[cpu].timestamp = ts + handle->ts_offset;
-
-	index = kbuffer_curr_offset(kbuf);
-
-	record = malloc(sizeof(*record));
+	record = alloc_record(handle);
 	if (!record)
 		return NULL;
-	memset(record, 0, sizeof(*record));
 
-	record->ts = handle->cpu_data[cpu].timestamp;
-	record->size = kbuffer_event_size(kbuf);
+	record->ts = ts + handle->ts_offset;
+	record->size = kbuffer_event_size(icpu->kbuf);
+	record->record_size = kbuffer_curr_size(icpu->kbuf);
 	record->cpu = cpu;
 	record->data = data;
-	record->offset = handle->cpu_data[cpu].offset + index;
-	record->missed_events = kbuffer_missed_events(kbuf);
+	record->offset = icpu->page->offset + kbuffer_curr_offset(icpu->kbuf);
+	record->missed_events = kbuffer_missed_events(icpu->kbuf);
 	record->ref_count = 1;
 	record->locked = 1;
+	record->priv = icpu->page;
+	add_record(icpu->page, record);
+	icpu->page->ref_count++;
 
-	handle->cpu_data[cpu].next = record;
-
-	record->record_size = kbuffer_curr_size(kbuf);
-	record->priv = page;
-	add_record(page, record);
-	page->ref_count++;
+	kbuffer_next_event(icpu->kbuf, NULL);
 
-	kbuffer_next_event(kbuf, NULL);
+	icpu->next = record;
 
 	return record;
 }
 
 /**
- * tracecmd_read_data - read the next record and increment
- * @handle: input handle for the trace.dat file
+ * tracecmd_iter_read_data - read the next record of a CPU of an iterator
+ * @iter: the iterator created by tracecmd_iter_new()
  * @cpu: the CPU to pull from
  *
- * This returns the record at the current location of the CPU
- * iterator and increments the CPU iterator.
- *
+ * The same as tracecmd_read_data(), for the position of @iter.
  * The record returned must be freed.
  */
 struct pevent_record *
-tracecmd_read_data(struct tracecmd_input *handle, int cpu)
+tracecmd_iter_read_data(struct tracecmd_iter *iter, int cpu)
 {
 	struct pevent_record *record;
 
-	record = tracecmd_peek_data(handle, cpu);
-	handle->cpu_data[cpu].next = NULL;
+	record = tracecmd_iter_peek_data(iter, cpu);
 	if (record) {
+		iter->cpus[cpu].next = NULL;
 		record->locked = 0;
+		merge_heap_mark(&iter->merge, cpu);
 #if DEBUG_RECORD
 		record->alloc_addr = (unsigned long)__builtin_return_address(0);
 #endif
 	}
+
 	return record;
 }
 
 /**
- * tracecmd_read_next_data - read the next record
- * @handle: input handle to the trace.dat file
+ * tracecmd_iter_read_next_data - read the next record of an iterator
+ * @iter: the iterator created by tracecmd_iter_new()
  * @rec_cpu: return pointer to the CPU that the record belongs to
  *
- * This returns the next record by time. This is different than
- * tracecmd_read_data in that it looks at all CPUs. It does a peek
- * at each CPU and the record with the earliest time stame is
- * returned. If @rec_cpu is not NULL it gets the CPU id the record was
- * on. The CPU cursor of the returned record is moved to the
- * next record.
- *
- * Multiple reads of this function will return a serialized list
- * of all records for all CPUs in order of time stamp.
- *
+ * The same as tracecmd_read_next_data(), for the position of @iter
+ * and only over its CPUs. The CPUs are kept in a heap of their own.
  * The record returned must be freed.
  */
 struct pevent_record *
-tracecmd_read_next_data(struct tracecmd_input *handle, int *rec_cpu)
+tracecmd_iter_read_next_data(struct tracecmd_iter *iter, int *rec_cpu)
 {
-	unsigned long long ts;
-	struct pevent_record *record;
-	int first_record = 1;
-	int next;
 	int cpu;
 
 	if (rec_cpu)
 		*rec_cpu = -1;
 
-	next = -1;
-	ts = 0;
+	/* Update the CPUs that moved since the last read */
+	while ((cpu = merge_heap_next_dirty(&iter->merge)) >= 0)
+		merge_heap_update(&iter->merge, cpu,
+				  tracecmd_iter_peek_data(iter, cpu));
 
-	for (cpu = 0; cpu < handle->cpus; cpu++) {
-		record = tracecmd_peek_data(handle, cpu);
-		if (record && (first_record || record->ts < ts)) {
-			ts = record->ts;
-			next = cpu;
-			first_record = 0;
-		}
-	}
+	if (!iter->merge.nr)
+		return NULL;
 
-	if (next >= 0) {
-		if (rec_cpu)
-			*rec_cpu = next;
-		return tracecmd_read_data(handle, next);
-	}
+	cpu = iter->merge.nodes[0].cpu;
+	if (rec_cpu)
+		*rec_cpu = cpu;
 
-	return NULL;
+	return tracecmd_iter_read_data(iter, cpu);
 }
 
 /**
@@ -1900,6 +3875,8 @@ static int init_cpu(struct tracecmd_input *handle, int cpu)
 	}
 
 	cpu_data->page = allocate_page(handle, cpu, cpu_data->offset);
+	if (!cpu_data->page && handle->compressed)
+		return -1;
 	if (!cpu_data->page && !handle->read_page) {
 		perror("mmap");
 		fprintf(stderr, "Can not mmap file, will read instead\n");
@@ -1929,6 +3906,71 @@ static int init_cpu(struct tracecmd_input *handle, int cpu)
 	return 0;
 }
 
+static void unmap_cpu_sections(struct tracecmd_input *handle)
+{
+	struct cpu_data *cpu_data;
+	int cpu;
+
+	if (!handle->cpu_data)
+		return;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		if (!cpu_data->map)
+			continue;
+		munmap(cpu_data->map, cpu_data->map_size);
+		cpu_data->map = NULL;
+		cpu_data->data = NULL;
+	}
+	handle->map_sections = false;
+}
+
+/*
+ * Map the data section of each CPU with a single mmap, and have
+ * allocate_page() hand out pointers into it. This saves a mmap and
+ * munmap system call for every page that is read. If any of the
+ * sections can not be mapped (like running out of address space
+ * on 32 bit machines), fall back to mapping page by page.
+ */
+static int map_cpu_sections(struct tracecmd_input *handle)
+{
+	struct cpu_data *cpu_data;
+	unsigned long long start;
+	long host_page_size;
+	int cpu;
+
+	/* Do not eat up the address space of 32 bit machines */
+	if (sizeof(long) < 8)
+		return -1;
+
+	host_page_size = sysconf(_SC_PAGESIZE);
+	if (host_page_size <= 0)
+		return -1;
+
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		cpu_data = &handle->cpu_data[cpu];
+		if (!cpu_data->file_size)
+			continue;
+
+		/* mmap wants the offset aligned to the host page size */
+		start = cpu_data->file_offset & ~(host_page_size - 1);
+		cpu_data->map_size = cpu_data->file_offset - start +
+			cpu_data->file_size;
+		cpu_data->map = mmap(NULL, cpu_data->map_size, PROT_READ,
+				     MAP_PRIVATE, handle->fd, start);
+		if (cpu_data->map == MAP_FAILED) {
+			cpu_data->map = NULL;
+			unmap_cpu_sections(handle);
+			return -1;
+		}
+		cpu_data->data = cpu_data->map + (cpu_data->file_offset - start);
+	}
+
+	handle->map_sections = true;
+
+	return 0;
+}
+
 static int handle_options(struct tracecmd_input *handle)
 {
 	unsigned long long offset;
@@ -2004,6 +4046,16 @@ static int handle_options(struct tracecmd_input *handle)
 			hook->next = handle->hooks;
 			handle->hooks = hook;
 			break;
+		case TRACECMD_OPTION_PAGE_INDEX:
+			/* Zero if the writer failed to save the index */
+			offset = *(unsigned long long *)buf;
+			handle->page_index = __data2host8(handle->pevent, offset);
+			break;
+		case TRACECMD_OPTION_PAGE_EVENTS:
+			/* Zero if the writer failed to save the summaries */
+			offset = *(unsigned long long *)buf;
+			handle->page_events = __data2host8(handle->pevent, offset);
+			break;
 		default:
 			warning("unknown option %d", option);
 			break;
@@ -2046,8 +4098,10 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		return 1;
 	}
 
-	/* We expect this to be flyrecord */
-	if (strncmp(buf, "flyrecord", 9) != 0)
+	/* We expect this to be flyrecord, or flychunks if compressed */
+	if (strncmp(buf, "flychunks", 9) == 0)
+		handle->compressed = true;
+	else if (strncmp(buf, "flyrecord", 9) != 0)
 		return -1;
 
 	handle->cpu_data = malloc(sizeof(*handle->cpu_data) * handle->cpus);
@@ -2069,6 +4123,7 @@ static int read_cpu_data(struct tracecmd_input *handle)
 		endian = KBUFFER_ENDIAN_LITTLE;
 
 	for (cpu = 0; cpu < handle->cpus; cpu++) {
+		unsigned long long section = 0;
 		unsigned long long offset;
 
 		handle->cpu_data[cpu].cpu = cpu;
@@ -2081,11 +4136,22 @@ static int read_cpu_data(struct tracecmd_input *handle)
 
 		offset = read8(handle);
 		size = read8(handle);
+		/*
+		 * The offset of compressed data only tells the pages apart,
+		 * the data itself is in the section that follows.
+		 */
+		if (handle->compressed)
+			section = read8(handle);
 
 		handle->cpu_data[cpu].file_offset = offset;
 		handle->cpu_data[cpu].file_size = size;
 
-		if (size && (offset + size > handle->total_file_size)) {
+		if (handle->compressed) {
+			if (size && read_chunk_table(handle, cpu, section) < 0) {
+				errno = EINVAL;
+				goto out_free;
+			}
+		} else if (size && (offset + size > handle->total_file_size)) {
 			/* this happens if the file got truncated */
 			printf("File possibly truncated. "
 				"Need at least %llu, but file size is %zu.\n",
@@ -2093,7 +4159,12 @@ static int read_cpu_data(struct tracecmd_input *handle)
 			errno = EINVAL;
 			goto out_free;
 		}
+	}
+
+	if (!handle->read_page && !handle->compressed)
+		map_cpu_sections(handle);
 
+	for (cpu = 0; cpu < handle->cpus; cpu++) {
 		if (init_cpu(handle, cpu))
 			goto out_free;
 	}
@@ -2101,11 +4172,13 @@ static int read_cpu_data(struct tracecmd_input *handle)
 	return 0;
 
  out_free:
-	for ( ; cpu >= 0; cpu--) {
+	for (cpu = handle->cpus - 1; cpu >= 0; cpu--) {
 		free_page(handle, cpu);
 		kbuffer_free(handle->cpu_data[cpu].kbuf);
 		handle->cpu_data[cpu].kbuf = NULL;
 	}
+	unmap_cpu_sections(handle);
+	free_chunks(handle);
 	return -1;
 }
 
@@ -2225,7 +4298,7 @@ int tracecmd_make_pipe(struct tracecmd_input *handle, int cpu, int fd, int cpus)
 
 	if (!handle->cpus) {
 		handle->cpus = cpus;
-		handle->cpu_data = malloc(sizeof(*handle->cpu_data) * handle->cpus);
+		handle->cpu_data = calloc(handle->cpus, sizeof(*handle->cpu_data));
 		if (!handle->cpu_data)
 			return -1;
 	}
@@ -2377,6 +4450,7 @@ struct tracecmd_input *tracecmd_alloc_fd(int fd)
 
 	handle->fd = fd;
 	handle->ref = 1;
+	handle->read_follow = -1;
 
 	if (do_read_check(handle, buf, 3))
 		goto failed_read;
@@ -2536,6 +4610,8 @@ void tracecmd_close(struct tracecmd_input *handle)
 	if (--handle->ref)
 		return;
 
+	tracecmd_stop_read_threads(handle);
+
 	for (cpu = 0; cpu < handle->cpus; cpu++) {
 		/* The tracecmd_peek_data may have cached a record */
 		free_next(handle, cpu);
@@ -2548,6 +4624,17 @@ void tracecmd_close(struct tracecmd_input *handle)
 					cpu, show_records(&handle->cpu_data[cpu].pages));
 		}
 	}
+	unmap_cpu_sections(handle);
+
+	for (cpu = 0; handle->cpu_data && cpu < handle->cpus; cpu++)
+		free(handle->cpu_data[cpu].page_ts);
+	free_page_events(handle);
+	free(handle->read_events);
+	free(handle->pid_events);
+	free(handle->read_pids);
+	free_chunks(handle);
+	merge_free(handle);
+	free_record_pool(handle);
 
 	free(handle->cpustats);
 	free(handle->cpu_data);
@@ -2915,6 +5002,25 @@ tracecmd_buffer_instance_handle(struct tracecmd_input *handle, int indx)
 	new_handle->parent = handle;
 	new_handle->cpustats = NULL;
 	new_handle->hooks = NULL;
+	/* The page index only covers the top level buffer */
+	new_handle->page_index = 0;
+	new_handle->page_events = 0;
+	new_handle->read_events = NULL;
+	new_handle->nr_read_events = 0;
+	new_handle->pid_events = NULL;
+	new_handle->nr_pid_events = 0;
+	new_handle->read_pids = NULL;
+	new_handle->nr_read_pids = 0;
+	new_handle->read_follow = -1;
+	new_handle->compressed = false;
+	new_handle->chunk_cache = NULL;
+	new_handle->nr_chunk_cache = 0;
+	memset(&new_handle->merge, 0, sizeof(new_handle->merge));
+	new_handle->free_records = NULL;
+	new_handle->nr_free_records = 0;
+	new_handle->read_workers = NULL;
+	new_handle->nr_read_workers = 0;
+	new_handle->read_filter = NULL;
 	if (handle->uname)
 		/* Ignore if fails to malloc, no biggy */
 		new_handle->uname = strdup(handle->uname);
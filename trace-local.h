@@ -58,6 +58,8 @@ void trace_report(int argc, char **argv);
 
 void trace_split(int argc, char **argv);
 
+void trace_convert(int argc, char **argv);
+
 void trace_listen(int argc, char **argv);
 
 void trace_restore(int argc, char **argv);
@@ -34,11 +34,20 @@
 #include <ctype.h>
 #include <errno.h>
 #include <glob.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "trace-cmd-local.h"
+#include "kbuffer.h"
 #include "list.h"
 #include "version.h"
 
+#ifdef WARN_NO_ZLIB
+# warning "zlib not found, trace.dat files can not be compressed "	\
+	"(install zlib-devel and try again)"
+#endif
+
 /* We can't depend on the host size for size_t, all must be 64 bit */
 typedef unsigned long long	tsize_t;
 typedef long long		stsize_t;
@@ -64,6 +73,7 @@ struct tracecmd_output {
 	char		*tracing_dir;
 	int		options_written;
 	int		nr_options;
+	bool		compress;
 	struct list_head options;
 };
 
@@ -1028,11 +1038,362 @@ out_free:
 	return NULL;
 }
 
+/*
+ * Save the timestamp of each page of CPU data at the end of the
+ * file, and point the page index option at it. This lets the reader
+ * find the page holding a given time without searching through the
+ * data itself.
+ *
+ * The index holds the number of pages for each CPU, followed by
+ * the timestamps of the pages of each CPU in order. The timestamps
+ * are copied as is from the page headers.
+ */
+static int save_page_index(struct tracecmd_output *handle,
+			   struct tracecmd_option *option,
+			   int cpus, char * const *cpu_data_files,
+			   unsigned long long *sizes)
+{
+	unsigned long long *page_ts;
+	unsigned long long nr_pages;
+	unsigned long long endian8;
+	unsigned long long i;
+	off64_t offset;
+	int fd;
+	int cpu;
+
+	offset = lseek64(handle->fd, 0, SEEK_END);
+	if (offset == (off64_t)-1)
+		return -1;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		nr_pages = (sizes[cpu] + handle->page_size - 1) / handle->page_size;
+		endian8 = convert_endian_8(handle, nr_pages);
+		if (do_write_check(handle, &endian8, 8))
+			return -1;
+	}
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		nr_pages = (sizes[cpu] + handle->page_size - 1) / handle->page_size;
+		if (!nr_pages)
+			continue;
+
+		page_ts = malloc(nr_pages * sizeof(*page_ts));
+		if (!page_ts)
+			return -1;
+
+		fd = open(cpu_data_files[cpu], O_RDONLY | O_LARGEFILE);
+		if (fd < 0)
+			goto out_free;
+
+		for (i = 0; i < nr_pages; i++) {
+			if (lseek64(fd, i * handle->page_size, SEEK_SET) == (off64_t)-1 ||
+			    read(fd, &page_ts[i], 8) != 8) {
+				close(fd);
+				goto out_free;
+			}
+		}
+		close(fd);
+
+		if (do_write_check(handle, page_ts, nr_pages * sizeof(*page_ts)))
+			goto out_free;
+
+		free(page_ts);
+	}
+
+	endian8 = convert_endian_8(handle, offset);
+	return tracecmd_update_option(handle, option, 8, &endian8);
+
+ out_free:
+	free(page_ts);
+	return -1;
+}
+
+/* Event ids are the common_type of the events, which is 16 bits */
+#define MAX_PAGE_EVENT_ID	(1 << 16)
+
+static int cmp_event_ids(const void *a, const void *b)
+{
+	unsigned int id_a = *(const unsigned int *)a;
+	unsigned int id_b = *(const unsigned int *)b;
+
+	return id_a < id_b ? -1 : id_a > id_b;
+}
+
+static struct kbuffer *alloc_output_kbuffer(struct tracecmd_output *handle)
+{
+	enum kbuffer_long_size long_size;
+	enum kbuffer_endian endian;
+	int bigendian;
+
+	if (handle->pevent) {
+		bigendian = pevent_is_file_bigendian(handle->pevent);
+		long_size = handle->pevent->header_page_size_size == 8 ?
+			KBUFFER_LSIZE_8 : KBUFFER_LSIZE_4;
+	} else {
+		bigendian = tracecmd_host_bigendian();
+		long_size = sizeof(long) == 8 ? KBUFFER_LSIZE_8 : KBUFFER_LSIZE_4;
+	}
+	endian = bigendian ? KBUFFER_ENDIAN_BIG : KBUFFER_ENDIAN_LITTLE;
+
+	return kbuffer_alloc(long_size, endian);
+}
+
+/*
+ * Save a summary of each page of CPU data at the end of the file,
+ * and point the page events option at it. This lets the reader skip
+ * the pages that hold none of the events it is looking for.
+ *
+ * For each CPU, the size of its summary is saved, followed by the
+ * summary itself. For each page of the CPU, that holds the timestamp
+ * of the last event of the page (8 bytes) and the number of event
+ * ids on the page (4 bytes), followed by the sorted ids (4 bytes
+ * each). The id is the common_type at the start of each event.
+ */
+static int save_page_events(struct tracecmd_output *handle,
+			    struct tracecmd_option *option,
+			    int cpus, char * const *cpu_data_files,
+			    unsigned long long *sizes)
+{
+	unsigned long long nr_pages;
+	unsigned long long endian8;
+	unsigned long long last_ts;
+	unsigned long long ts;
+	unsigned long long i;
+	unsigned char *seen = NULL;
+	unsigned int *ids = NULL;
+	unsigned int *buf = NULL;
+	struct kbuffer *kbuf;
+	unsigned short id;
+	void *page = NULL;
+	off64_t offset;
+	void *data;
+	size_t alloc_buf = 0;
+	size_t nr_buf;
+	int nr_ids;
+	int ret = -1;
+	int fd = -1;
+	int cpu;
+	int j;
+
+	offset = lseek64(handle->fd, 0, SEEK_END);
+	if (offset == (off64_t)-1)
+		return -1;
+
+	kbuf = alloc_output_kbuffer(handle);
+	if (!kbuf)
+		return -1;
+
+	seen = calloc(MAX_PAGE_EVENT_ID / 8, 1);
+	ids = malloc(MAX_PAGE_EVENT_ID * sizeof(*ids));
+	page = malloc(handle->page_size);
+	if (!seen || !ids || !page)
+		goto out;
+
+	for (cpu = 0; cpu < cpus; cpu++) {
+		nr_pages = (sizes[cpu] + handle->page_size - 1) / handle->page_size;
+
+		nr_buf = 0;
+
+		fd = open(cpu_data_files[cpu], O_RDONLY | O_LARGEFILE);
+		if (fd < 0)
+			goto out;
+
+		for (i = 0; i < nr_pages; i++) {
+			memset(page, 0, handle->page_size);
+			if (pread(fd, page, handle->page_size,
+				  i * handle->page_size) < 8)
+				goto out;
+
+			kbuffer_load_subbuffer(kbuf, page);
+			if (kbuffer_subbuffer_size(kbuf) > handle->page_size)
+				goto out;
+
+			last_ts = kbuffer_timestamp(kbuf);
+			nr_ids = 0;
+			while ((data = kbuffer_read_event(kbuf, &ts))) {
+				last_ts = ts;
+				id = *(unsigned short *)data;
+				if (handle->pevent)
+					id = __data2host2(handle->pevent, id);
+				if (!(seen[id / 8] & (1 << (id % 8)))) {
+					seen[id / 8] |= 1 << (id % 8);
+					ids[nr_ids++] = id;
+				}
+				kbuffer_next_event(kbuf, NULL);
+			}
+			qsort(ids, nr_ids, sizeof(*ids), cmp_event_ids);
+
+			if (nr_buf + 3 + nr_ids > alloc_buf) {
+				unsigned int *tmp;
+
+				alloc_buf = (nr_buf + 3 + nr_ids) * 2;
+				tmp = realloc(buf, alloc_buf * sizeof(*buf));
+				if (!tmp)
+					goto out;
+				buf = tmp;
+			}
+
+			endian8 = convert_endian_8(handle, last_ts);
+			memcpy(buf + nr_buf, &endian8, 8);
+			buf[nr_buf + 2] = convert_endian_4(handle, nr_ids);
+			nr_buf += 3;
+			for (j = 0; j < nr_ids; j++) {
+				buf[nr_buf++] = convert_endian_4(handle, ids[j]);
+				seen[ids[j] / 8] = 0;
+			}
+		}
+		close(fd);
+		fd = -1;
+
+		endian8 = convert_endian_8(handle, nr_buf * sizeof(*buf));
+		if (do_write_check(handle, &endian8, 8) ||
+		    do_write_check(handle, buf, nr_buf * sizeof(*buf)))
+			goto out;
+	}
+
+	endian8 = convert_endian_8(handle, offset);
+	ret = tracecmd_update_option(handle, option, 8, &endian8);
+ out:
+	if (fd >= 0)
+		close(fd);
+	kbuffer_free(kbuf);
+	free(seen);
+	free(ids);
+	free(page);
+	free(buf);
+	return ret;
+}
+
+/* Number of pages that are compressed together */
+#define CHUNK_PAGES	16
+
+/**
+ * tracecmd_output_set_compress - compress the CPU data that is appended
+ * @handle: output handle for the trace.dat file
+ *
+ * The CPU data appended to the file after this call is saved in
+ * chunks of pages that are each compressed on their own, so that
+ * the reader can still go to any page without uncompressing the
+ * data before it.
+ *
+ * Returns 0 on success, or -1 if trace-cmd was built without zlib.
+ */
+int tracecmd_output_set_compress(struct tracecmd_output *handle)
+{
+#ifdef NO_ZLIB
+	return -1;
+#else
+	handle->compress = true;
+	return 0;
+#endif
+}
+
+#ifndef NO_ZLIB
+/*
+ * Save the data of a CPU compressed, in chunks of CHUNK_PAGES pages.
+ * The section starts with the number of pages per chunk and the
+ * number of chunks (4 bytes each), followed by the file offsets of
+ * each chunk and of the end of the last chunk (8 bytes each), and
+ * then the chunks themselves.
+ *
+ * Returns the offset of the section in the file, or -1 on error.
+ */
+static off64_t compress_cpu_file(struct tracecmd_output *handle,
+				 const char *file, unsigned long long size)
+{
+	unsigned long long chunk_size = CHUNK_PAGES * handle->page_size;
+	unsigned long long *offsets = NULL;
+	unsigned long long got;
+	unsigned long long len;
+	unsigned char *out = NULL;
+	unsigned char *in = NULL;
+	unsigned int nr_chunks;
+	unsigned int i;
+	off64_t section;
+	off64_t ret = -1;
+	uLongf out_size;
+	ssize_t r;
+	int endian4;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return -1;
+
+	section = lseek64(handle->fd, 0, SEEK_END);
+	if (section == (off64_t)-1)
+		goto out;
+
+	nr_chunks = (size + chunk_size - 1) / chunk_size;
+	offsets = malloc((nr_chunks + 1) * sizeof(*offsets));
+	in = malloc(chunk_size);
+	out = malloc(compressBound(chunk_size));
+	if (!offsets || !in || !out)
+		goto out;
+
+	endian4 = convert_endian_4(handle, CHUNK_PAGES);
+	if (do_write_check(handle, &endian4, 4))
+		goto out;
+	endian4 = convert_endian_4(handle, nr_chunks);
+	if (do_write_check(handle, &endian4, 4))
+		goto out;
+
+	/* The chunk offsets are written after the chunks */
+	offsets[0] = section + 8 + (nr_chunks + 1) * 8;
+	if (lseek64(handle->fd, offsets[0], SEEK_SET) == (off64_t)-1)
+		goto out;
+
+	for (i = 0; i < nr_chunks; i++) {
+		len = size - (unsigned long long)i * chunk_size;
+		if (len > chunk_size)
+			len = chunk_size;
+		for (got = 0; got < len; got += r) {
+			r = read(fd, in + got, len - got);
+			if (r <= 0)
+				goto out;
+		}
+
+		out_size = compressBound(chunk_size);
+		if (compress2(out, &out_size, in, len, Z_BEST_SPEED) != Z_OK)
+			goto out;
+		if (do_write_check(handle, out, out_size))
+			goto out;
+		offsets[i + 1] = offsets[i] + out_size;
+	}
+
+	for (i = 0; i <= nr_chunks; i++)
+		offsets[i] = convert_endian_8(handle, offsets[i]);
+
+	if (lseek64(handle->fd, section + 8, SEEK_SET) == (off64_t)-1 ||
+	    do_write_check(handle, offsets, (nr_chunks + 1) * 8) ||
+	    lseek64(handle->fd, 0, SEEK_END) == (off64_t)-1)
+		goto out;
+
+	ret = section;
+ out:
+	close(fd);
+	free(offsets);
+	free(in);
+	free(out);
+	return ret;
+}
+#else
+static off64_t compress_cpu_file(struct tracecmd_output *handle,
+				 const char *file, unsigned long long size)
+{
+	return -1;
+}
+#endif
+
 static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
+				      struct tracecmd_option *index_option,
+				      struct tracecmd_option *events_option,
 				      int cpus, char * const *cpu_data_files)
 {
 	off64_t *offsets = NULL;
+	off64_t *tables = NULL;
 	unsigned long long *sizes = NULL;
+	off64_t section;
 	off64_t offset;
 	unsigned long long endian8;
 	off64_t check_size;
@@ -1041,7 +1402,7 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	int ret;
 	int i;
 
-	if (do_write_check(handle, "flyrecord", 10))
+	if (do_write_check(handle, handle->compress ? "flychunks" : "flyrecord", 10))
 		goto out_free;
 
 	offsets = malloc_or_die(sizeof(*offsets) * cpus);
@@ -1050,11 +1411,12 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	sizes = malloc_or_die(sizeof(*sizes) * cpus);
 	if (!sizes)
 		goto out_free;
+	tables = malloc_or_die(sizeof(*tables) * cpus);
 
 	offset = lseek64(handle->fd, 0, SEEK_CUR);
 
 	/* hold any extra data for data */
-	offset += cpus * (16);
+	offset += cpus * (handle->compress ? 24 : 16);
 
 	/*
 	 * Unfortunately, the trace_clock data was placed after the
@@ -1097,12 +1459,46 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 		endian8 = convert_endian_8(handle, sizes[i]);
 		if (do_write_check(handle, &endian8, 8))
 			goto out_free;
+
+		/*
+		 * Compressed data is not where offsets[i] says, which is
+		 * only used to tell the pages apart. The offset of the
+		 * compressed section is filled in when it is written.
+		 */
+		if (handle->compress) {
+			tables[i] = lseek64(handle->fd, 0, SEEK_CUR);
+			endian8 = 0;
+			if (do_write_check(handle, &endian8, 8))
+				goto out_free;
+		}
 	}
 
 	if (save_tracing_file_data(handle, "trace_clock") < 0)
 		goto out_free;
 
 	for (i = 0; i < cpus; i++) {
+		if (handle->compress) {
+			section = compress_cpu_file(handle, cpu_data_files[i],
+						    sizes[i]);
+			if (section < 0) {
+				warning("could not compress '%s'",
+					cpu_data_files[i]);
+				goto out_free;
+			}
+			offset = lseek64(handle->fd, 0, SEEK_END);
+			fprintf(stderr, "CPU%d data compressed at offset=0x%llx\n",
+				i, (unsigned long long) section);
+			fprintf(stderr, "    %llu bytes in size, %llu compressed\n",
+				sizes[i], (unsigned long long)(offset - section));
+
+			endian8 = convert_endian_8(handle, section);
+			if (lseek64(handle->fd, tables[i], SEEK_SET) == (off64_t)-1 ||
+			    do_write_check(handle, &endian8, 8) ||
+			    lseek64(handle->fd, 0, SEEK_END) == (off64_t)-1)
+				goto out_free;
+			continue;
+		}
+
 		fprintf(stderr, "CPU%d data recorded at offset=0x%llx\n",
 			i, (unsigned long long) offsets[i]);
 		offset = lseek64(handle->fd, offsets[i], SEEK_SET);
@@ -1120,22 +1516,41 @@ static int __tracecmd_append_cpu_data(struct tracecmd_output *handle,
 		fprintf(stderr, "    %llu bytes in size\n", (unsigned long long)check_size);
 	}
 
+	if (index_option &&
+	    save_page_index(handle, index_option, cpus, cpu_data_files, sizes) < 0)
+		warning("could not save the page index");
+
+	if (events_option &&
+	    save_page_events(handle, events_option, cpus, cpu_data_files, sizes) < 0)
+		warning("could not save the page events");
+
 	free(offsets);
 	free(sizes);
+	free(tables);
 
 	return 0;
 
  out_free:
 	free(offsets);
 	free(sizes);
+	free(tables);
 	return -1;
 }
 
 int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 			     int cpus, char * const *cpu_data_files)
 {
+	struct tracecmd_option *events_option;
+	struct tracecmd_option *index_option;
+	unsigned long long offset = 0;
 	int endian4;
 
+	/* The offsets of the page indexes are filled in after the data */
+	index_option = tracecmd_add_option(handle, TRACECMD_OPTION_PAGE_INDEX,
+					   8, &offset);
+	events_option = tracecmd_add_option(handle, TRACECMD_OPTION_PAGE_EVENTS,
+					    8, &offset);
+
 	endian4 = convert_endian_4(handle, cpus);
 	if (do_write_check(handle, &endian4, 4))
 		return -1;
@@ -1143,7 +1558,8 @@ int tracecmd_append_cpu_data(struct tracecmd_output *handle,
 	if (add_options(handle) < 0)
 		return -1;
 
-	return __tracecmd_append_cpu_data(handle, cpus, cpu_data_files);
+	return __tracecmd_append_cpu_data(handle, index_option, events_option,
+					  cpus, cpu_data_files);
 }
 
 int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
@@ -1172,7 +1588,8 @@ int tracecmd_append_buffer_cpu_data(struct tracecmd_output *handle,
 		return -1;
 	}
 
-	return __tracecmd_append_cpu_data(handle, cpus, cpu_data_files);
+	return __tracecmd_append_cpu_data(handle, NULL, NULL,
+					  cpus, cpu_data_files);
 }
 
 int tracecmd_attach_cpu_data_fd(int fd, int cpus, char * const *cpu_data_files)
@@ -172,50 +172,13 @@ static int task_plot_match_time(struct graph_info *ginfo, struct graph_plot *plo
 	return ret;
 }
 
-struct offset_cache {
-	guint64 *offsets;
-};
-
-static struct offset_cache *save_offsets(struct graph_info *ginfo)
-{
-	struct offset_cache *offsets;
-	struct pevent_record *record;
-	int cpu;
-
-	offsets = malloc_or_die(sizeof(*offsets));
-	offsets->offsets = malloc_or_die(sizeof(*offsets->offsets) * ginfo->cpus);
-	memset(offsets->offsets, 0, sizeof(*offsets->offsets) * ginfo->cpus);
-
-	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-		record = tracecmd_peek_data(ginfo->handle, cpu);
-		if (record)
-			offsets->offsets[cpu] = record->offset;
-	}
-
-	return offsets;
-}
-
-static void restore_offsets(struct graph_info *ginfo, struct offset_cache *offsets)
-{
-	struct pevent_record *record;
-	int cpu;
-
-	for (cpu = 0; cpu < ginfo->cpus; cpu++) {
-		if (offsets->offsets[cpu])
-			tracecmd_set_cursor(ginfo->handle, cpu, offsets->offsets[cpu]);
-		else {
-			/* end of cpu, make sure it stays the end */
-			record = tracecmd_read_cpu_last(ginfo->handle, cpu);
-			free_record(record);
-		}
-	}
-
-	free(offsets->offsets);
-	free(offsets);
-}
-
+/*
+ * Read on from the cursors of the handle, or from @iter if it is not
+ * NULL, to the first record of @pid after @time.
+ */
 static struct pevent_record *
-find_record(struct graph_info *ginfo, gint pid, guint64 time)
+next_matching_record(struct graph_info *ginfo, struct tracecmd_iter *iter,
+		     gint pid, guint64 time)
 {
 	struct pevent_record *record = NULL;
 	gboolean is_wakeup;
@@ -225,12 +188,13 @@ find_record(struct graph_info *ginfo, gint pid, guint64 time)
 	int rec_pid;
 	int next_cpu;
 
-	set_cpus_to_time(ginfo, time);
-
 	do {
 		free_record(record);
 
-		record = tracecmd_read_next_data(ginfo->handle, &next_cpu);
+		if (iter)
+			record = tracecmd_iter_read_next_data(iter, &next_cpu);
+		else
+			record = tracecmd_read_next_data(ginfo->handle, &next_cpu);
 		if (!record)
 			return NULL;
 
@@ -240,6 +204,34 @@ find_record(struct graph_info *ginfo, gint pid, guint64 time)
 		/* Use +1 to make sure we have a match first */
 	} while (!(record->ts > time && match));
 
+	return record;
+}
+
+static struct pevent_record *
+find_record(struct graph_info *ginfo, gint pid, guint64 time)
+{
+	set_cpus_to_time(ginfo, time);
+
+	return next_matching_record(ginfo, NULL, pid, time);
+}
+
+/*
+ * Same as find_record(), but with its own iterator, so that the
+ * cursor of the handle that is used for plotting is left alone.
+ */
+static struct pevent_record *
+find_record_iter(struct graph_info *ginfo, gint pid, guint64 time)
+{
+	struct tracecmd_iter *iter;
+	struct pevent_record *record;
+
+	iter = tracecmd_iter_new(ginfo->handle, NULL, time);
+	if (!iter)
+		return NULL;
+
+	record = next_matching_record(ginfo, iter, pid, time);
+
+	tracecmd_iter_free(iter);
 
 	return record;
 }
@@ -252,7 +244,6 @@ static int task_plot_display_last_event(struct graph_info *ginfo,
 	struct task_plot_info *task_info = plot->private;
 	struct event_format *event;
 	struct pevent_record *record;
-	struct offset_cache *offsets;
 	gboolean is_sched;
 	gboolean is_wakeup;
 	int sched_pid;
@@ -262,16 +253,7 @@ static int task_plot_display_last_event(struct graph_info *ginfo,
 
 	pid = task_info->pid;
 
-	/*
-	 * Get the next record so we know can save its offset and
-	 * reset the cursor, not to mess up the plotting
-	 */
-	offsets = save_offsets(ginfo);
-
-	record = find_record(ginfo, pid, time);
-
-	restore_offsets(ginfo, offsets);
-
+	record = find_record_iter(ginfo, pid, time);
 	if (!record)
 		return 0;
 
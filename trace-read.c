@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "trace-local.h"
 #include "trace-hash.h"
@@ -57,6 +58,14 @@ struct event_str {
 	const char		*event;
 };
 
+/* An event whose handler registers the comms of the pids it shows */
+struct comm_event {
+	int			id;
+	struct format_field	*pid[2];
+};
+
+#define NR_COMM_EVENTS	3
+
 struct handle_list {
 	struct list_head	list;
 	struct tracecmd_input	*handle;
@@ -66,6 +75,8 @@ struct handle_list {
 	struct pevent_record	*record;
 	struct filter		*event_filters;
 	struct filter		*event_filter_out;
+	struct comm_event	comm_events[NR_COMM_EVENTS];
+	int			idle_comm;
 };
 static struct list_head handle_list;
 
@@ -92,6 +103,10 @@ static int max_file_size;
 
 static int instances;
 
+static int read_threads;
+static int print_threads;
+static int filter_comm;
+
 static int *filter_cpus;
 static int nr_filter_cpus;
 
@@ -103,6 +118,9 @@ static int stacktrace_id;
 
 static int profile;
 
+/* stdio buffer for report output that does not go to a tty */
+#define REPORT_OUTPUT_BUF	(256 * 1024)
+
 static int buffer_breaks = 0;
 static int debug = 0;
 
@@ -341,6 +359,9 @@ static void add_filter(const char *filter, int neg)
 	ftr->next = NULL;
 	ftr->neg = neg;
 
+	if (strstr(filter, "COMM"))
+		filter_comm = 1;
+
 	/* must maintain order of command line */
 	*filter_next = ftr;
 	filter_next = &ftr->next;
@@ -602,7 +623,8 @@ static unsigned long long max_rt_time;
 static unsigned long long min_rt_lat = -1;
 static unsigned long long min_rt_time;
 
-static void add_sched(unsigned int val, unsigned long long end, int rt)
+static void add_sched(struct trace_seq *s, unsigned int val,
+		      unsigned long long end, int rt)
 {
 	struct trace_hash_item *item;
 	unsigned int key = trace_hash(val);
@@ -637,7 +659,7 @@ static void add_sched(unsigned int val, unsigned long long end, int rt)
 		}
 	}
 
-	printf(" Latency: %llu.%03llu usecs", cal / 1000, cal % 1000);
+	trace_seq_printf(s, " Latency: %llu.%03llu usecs", cal / 1000, cal % 1000);
 
 	total_wakeup_lat += cal;
 	wakeup_lat_count++;
@@ -651,7 +673,8 @@ static void add_sched(unsigned int val, unsigned long long end, int rt)
 	free(info);
 }
 
-static void process_wakeup(struct pevent *pevent, struct pevent_record *record)
+static void process_wakeup(struct pevent *pevent, struct pevent_record *record,
+			   struct trace_seq *s)
 {
 	unsigned long long val;
 	int id;
@@ -684,7 +707,7 @@ static void process_wakeup(struct pevent *pevent, struct pevent_record *record)
 			rt = 0;
 		if (pevent_read_number_field(sched_task, record->data, &val))
 			return;
-		add_sched(val, record->ts, rt);
+		add_sched(s, val, record->ts, rt);
 	}
 }
 
@@ -739,13 +762,45 @@ static void finish_wakeup(void)
 	trace_hash_free(&wakeup_hash);
 }
 
+/*
+ * Formats the record the way report shows it, without the trailing
+ * new line. Called from the -j print threads as well.
+ */
+static void print_record_text(struct tracecmd_input *handle,
+			      struct pevent_record *record,
+			      struct trace_seq *s)
+{
+	struct pevent *pevent = tracecmd_get_pevent(handle);
+	unsigned int start = s->len;
+	int cpu = record->cpu;
+	bool use_trace_clock;
+
+	if (record->missed_events > 0)
+		trace_seq_printf(s, "CPU:%d [%lld EVENTS DROPPED]\n",
+				 cpu, record->missed_events);
+	else if (record->missed_events < 0)
+		trace_seq_printf(s, "CPU:%d [EVENTS DROPPED]\n", cpu);
+	if (buffer_breaks || debug) {
+		if (tracecmd_record_at_buffer_start(handle, record)) {
+			trace_seq_printf(s, "CPU:%d [SUBBUFFER START]", cpu);
+			if (debug)
+				trace_seq_printf(s, " [%lld]",
+						 tracecmd_page_ts(handle, record));
+			trace_seq_putc(s, '\n');
+		}
+	}
+	use_trace_clock = tracecmd_get_use_trace_clock(handle);
+	pevent_print_event(pevent, s, record, use_trace_clock);
+	if (s->len > start && *(s->buffer + s->len - 1) == '\n')
+		s->len--;
+}
+
 void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record,
 		     int profile)
 {
+	static struct trace_seq s;
 	struct pevent *pevent;
-	struct trace_seq s;
 	int cpu = record->cpu;
-	bool use_trace_clock;
 
 	pevent = tracecmd_get_pevent(handle);
 
@@ -756,25 +811,19 @@ void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record
 		return;
 	}
 
-	trace_seq_init(&s);
-	if (record->missed_events > 0)
-		trace_seq_printf(&s, "CPU:%d [%lld EVENTS DROPPED]\n",
-				 cpu, record->missed_events);
-	else if (record->missed_events < 0)
-		trace_seq_printf(&s, "CPU:%d [EVENTS DROPPED]\n", cpu);
-	if (buffer_breaks || debug) {
-		if (tracecmd_record_at_buffer_start(handle, record)) {
-			trace_seq_printf(&s, "CPU:%d [SUBBUFFER START]", cpu);
-			if (debug)
-				trace_seq_printf(&s, " [%lld]",
-						 tracecmd_page_ts(handle, record));
-			trace_seq_putc(&s, '\n');
-		}
+	/*
+	 * The same trace_seq is reused for every record, so the buffer
+	 * only gets allocated (and grown) a handful of times per report.
+	 */
+	if (s.buffer && s.state == TRACE_SEQ__GOOD)
+		trace_seq_reset(&s);
+	else {
+		/* First record, or the last one ran out of memory */
+		free(s.buffer);
+		trace_seq_init(&s);
 	}
-	use_trace_clock = tracecmd_get_use_trace_clock(handle);
-	pevent_print_event(pevent, &s, record, use_trace_clock);
-	if (s.len && *(s.buffer + s.len - 1) == '\n')
-		s.len--;
+
+	print_record_text(handle, record, &s);
 	if (debug) {
 		struct kbuffer *kbuf;
 		struct kbuffer_raw_info info;
@@ -813,13 +862,21 @@ void trace_show_data(struct tracecmd_input *handle, struct pevent_record *record
 			}
 		}
 	}
-		
-	trace_seq_do_printf(&s);
-	trace_seq_destroy(&s);
 
-	process_wakeup(pevent, record);
+	if (s.state != TRACE_SEQ__GOOD) {
+		trace_seq_do_printf(&s);
+		process_wakeup(pevent, record, &s);
+		printf("\n");
+		return;
+	}
+
+	/* Nothing past a nul was ever printed, keep it that way */
+	s.len = strnlen(s.buffer, s.len);
 
-	printf("\n");
+	process_wakeup(pevent, record, &s);
+	trace_seq_putc(&s, '\n');
+
+	fwrite(s.buffer, 1, s.len, stdout);
 }
 
 static void read_rest(void)
@@ -895,7 +952,7 @@ test_stacktrace(struct handle_list *handles, struct pevent_record *record,
 			info->nr_cpus = tracecmd_cpus(h->handle);
 
 			info->cpus = malloc_or_die(sizeof(*info->cpus) * info->nr_cpus);
-			memset(info->cpus, 0, sizeof(*info->cpus));
+			memset(info->cpus, 0, sizeof(*info->cpus) * info->nr_cpus);
 
 			pevent = tracecmd_get_pevent(h->handle);
 			event = pevent_find_event_by_name(pevent, "ftrace",
@@ -942,6 +999,194 @@ test_stacktrace(struct handle_list *handles, struct pevent_record *record,
 	return 0;
 }
 
+/*
+ * Called by the read threads to drop the records that
+ * get_next_record() would drop without looking at them.
+ */
+static int filter_record(struct tracecmd_input *handle,
+			 struct pevent_record *record, void *data)
+{
+	struct handle_list *handles = data;
+	int ret;
+
+	ret = test_filters(handles->event_filters, record, 0);
+	switch (ret) {
+	case FILTER_NOEXIST:
+		/* May be a stack trace */
+		return 1;
+	case FILTER_NONE:
+	case FILTER_MATCH:
+		ret = test_filters(handles->event_filter_out, record, 1);
+		return ret != FILTER_MATCH;
+	}
+
+	return 0;
+}
+
+static void start_read_threads(struct handle_list *handles)
+{
+	tracecmd_read_filter_func filter = filter_record;
+	struct pevent *pevent;
+
+	pevent = tracecmd_get_pevent(handles->handle);
+
+	/*
+	 * The function graph output looks ahead at the next record
+	 * of the CPU, which must not be filtered out from under it.
+	 * The comms are registered by the plugins as records are
+	 * printed, so filters on them can not run in the threads.
+	 */
+	if (filter_comm ||
+	    (!handles->event_filters && !handles->event_filter_out) ||
+	    pevent_find_event_by_name(pevent, "ftrace", "funcgraph_entry"))
+		filter = NULL;
+
+	tracecmd_start_read_threads(handles->handle, read_threads,
+				    filter, handles);
+}
+
+/* What the filters (-F) let through of an event, see set_read_events() */
+enum read_event_state {
+	READ_EVENT_NONE,	/* no filter passes any of its records */
+	READ_EVENT_PIDS,	/* only records of the pids found */
+	READ_EVENT_ALL,		/* any record may pass */
+};
+
+/*
+ * Find the pids that the filter of an event limits common_pid to,
+ * and add them to @pids. Returns false if the filter does not limit
+ * the pids.
+ */
+static bool add_read_pids(struct event_filter *event_filter, int id,
+			  int **pids, int *nr_pids)
+{
+	unsigned long long *values;
+	int nr;
+	int i;
+
+	nr = pevent_filter_field_values(event_filter, id, "common_pid",
+					&values);
+	if (nr < 0)
+		return false;
+
+	for (i = 0; i < nr; i++) {
+		/* Tasks do not have negative pids */
+		if (values[i] > INT_MAX)
+			break;
+	}
+	if (i < nr) {
+		free(values);
+		return false;
+	}
+
+	*pids = realloc(*pids, sizeof(**pids) * (*nr_pids + nr + 1));
+	if (!*pids)
+		die("malloc");
+	for (i = 0; i < nr; i++)
+		(*pids)[(*nr_pids)++] = values[i];
+
+	free(values);
+	return true;
+}
+
+/*
+ * Let the reader skip the records that the filters (-F) would drop
+ * without looking at them: those of events that no filter can pass,
+ * and those of tasks that a filter limits common_pid to exclude.
+ * Pages with none of the events passed are not read at all.
+ */
+static void set_read_events(struct handle_list *handles)
+{
+	struct event_filter *event_filter;
+	struct filter *filter;
+	struct pevent *pevent;
+	unsigned char *state = NULL;
+	int nr_state = 0;
+	int nr_pid_ids = 0;
+	int *pid_ids = NULL;
+	int nr_pids = 0;
+	int *pids = NULL;
+	int nr_ids = 0;
+	int *ids = NULL;
+	int id;
+	int i;
+
+	pevent = tracecmd_get_pevent(handles->handle);
+
+	/* The function graph output looks ahead at the next record */
+	if (!handles->event_filters ||
+	    pevent_find_event_by_name(pevent, "ftrace", "funcgraph_entry"))
+		return;
+
+	for (filter = handles->event_filters; filter; filter = filter->next) {
+		event_filter = filter->filter;
+		/* A filter without events lets everything through */
+		if (!event_filter->filters)
+			goto out;
+
+		for (i = 0; i < event_filter->filters; i++) {
+			id = event_filter->event_filters[i].event_id;
+			if (id < 0)
+				goto out;
+			if (id >= nr_state) {
+				state = realloc(state, id + 1);
+				if (!state)
+					die("malloc");
+				memset(state + nr_state, READ_EVENT_NONE,
+				       id + 1 - nr_state);
+				nr_state = id + 1;
+			}
+
+			/* An event passes if any of the filters passes it */
+			if (state[id] == READ_EVENT_ALL)
+				continue;
+			if (pevent_filter_event_has_trivial(event_filter, id,
+							    FILTER_TRIVIAL_FALSE))
+				continue;
+			if (add_read_pids(event_filter, id, &pids, &nr_pids))
+				state[id] = READ_EVENT_PIDS;
+			else
+				state[id] = READ_EVENT_ALL;
+		}
+	}
+
+	ids = malloc_or_die(sizeof(*ids) * (nr_state + 2));
+	pid_ids = malloc_or_die(sizeof(*pid_ids) * (nr_state + 1));
+	for (id = 0; id < nr_state; id++) {
+		if (state[id] == READ_EVENT_NONE)
+			continue;
+		ids[nr_ids++] = id;
+		if (state[id] == READ_EVENT_PIDS)
+			pid_ids[nr_pid_ids++] = id;
+	}
+
+	/*
+	 * Stack traces follow the events they belong to, and are
+	 * only shown when that event is.
+	 */
+	if (stacktrace_id) {
+		if (stacktrace_id >= nr_state ||
+		    state[stacktrace_id] == READ_EVENT_NONE) {
+			ids[nr_ids++] = stacktrace_id;
+			tracecmd_set_read_follow(handles->handle, stacktrace_id);
+		}
+	}
+	ids[nr_ids] = -1;
+	pid_ids[nr_pid_ids] = -1;
+
+	tracecmd_set_read_events(handles->handle, ids);
+
+	if (nr_pid_ids) {
+		pids[nr_pids] = -1;
+		tracecmd_set_read_pids(handles->handle, pid_ids, pids);
+	}
+ out:
+	free(state);
+	free(pid_ids);
+	free(pids);
+	free(ids);
+}
+
 static struct pevent_record *get_next_record(struct handle_list *handles)
 {
 	struct pevent_record *record;
@@ -956,28 +1201,7 @@ static struct pevent_record *get_next_record(struct handle_list *handles)
 		return NULL;
 
 	do {
-		if (filter_cpus) {
-			long long last_stamp = -1;
-			struct pevent_record *precord;
-			int first_record = 1;
-			int next_cpu = -1;
-			int i;
-
-			for (i = 0; (cpu = filter_cpus[i]) >= 0; i++) {
-				precord = tracecmd_peek_data(handles->handle, cpu);
-				if (precord &&
-				    (first_record || precord->ts < last_stamp)) {
-					next_cpu = cpu;
-					last_stamp = precord->ts;
-					first_record = 0;
-				}
-			}
-			if (!first_record)
-				record = tracecmd_read_data(handles->handle, next_cpu);
-			else
-				record = NULL;
-		} else
-			record = tracecmd_read_next_data(handles->handle, &cpu);
+		record = tracecmd_read_next_data(handles->handle, &cpu);
 
 		if (record) {
 			ret = test_filters(handles->event_filters, record, 0);
@@ -1000,6 +1224,9 @@ static struct pevent_record *get_next_record(struct handle_list *handles)
 				}
 				/* fall through */
 			default:
+				/* Nor is the stack trace of this record shown */
+				if (stacktrace_id)
+					test_stacktrace(handles, record, 0);
 				free_record(record);
 			}
 		}
@@ -1035,6 +1262,243 @@ static void print_handle_file(struct handle_list *handles)
 		printf("%*s  ", max_file_size, "");
 }
 
+/* Records handed to the -j print threads at a time */
+#define PRINT_BATCH	4096
+
+struct print_slot {
+	struct handle_list	*handles;
+	struct pevent_record	*record;
+	unsigned int		start;
+	unsigned int		len;
+};
+
+struct print_thread {
+	pthread_t		thread;
+	struct trace_seq	s;
+	int			id;
+};
+
+static struct print_slot *print_slots;
+static int nr_print_slots;
+static struct print_thread *print_workers;
+static struct trace_seq print_wakeup_seq;
+
+/*
+ * Each thread formats the records of its own CPUs, in order, as
+ * plugins like the function one keep state per CPU.
+ */
+static void print_thread_slots(struct print_thread *pt)
+{
+	struct print_slot *slot;
+	int i;
+
+	for (i = 0; i < nr_print_slots; i++) {
+		slot = &print_slots[i];
+		if (slot->record->cpu % print_threads != pt->id)
+			continue;
+		slot->start = pt->s.len;
+		print_record_text(slot->handles->handle, slot->record, &pt->s);
+		if (pt->s.state != TRACE_SEQ__GOOD)
+			return;
+		/* Nothing past a nul was ever printed, keep it that way */
+		slot->len = strnlen(pt->s.buffer + slot->start,
+				    pt->s.len - slot->start);
+	}
+}
+
+static void *print_thread_func(void *data)
+{
+	print_thread_slots(data);
+	return NULL;
+}
+
+static void flush_print_slots(void)
+{
+	struct print_thread *pt;
+	struct print_slot *slot;
+	struct pevent *pevent;
+	int i;
+
+	if (!nr_print_slots)
+		return;
+
+	for (i = 0; i < print_threads; i++)
+		trace_seq_reset(&print_workers[i].s);
+
+	for (i = 1; i < print_threads; i++) {
+		if (pthread_create(&print_workers[i].thread, NULL,
+				   print_thread_func, &print_workers[i]))
+			die("Failed to create print thread");
+	}
+	print_thread_slots(&print_workers[0]);
+	for (i = 1; i < print_threads; i++)
+		pthread_join(print_workers[i].thread, NULL);
+
+	for (i = 0; i < print_threads; i++) {
+		if (print_workers[i].s.state != TRACE_SEQ__GOOD)
+			die("Can't allocate trace_seq buffer memory");
+	}
+
+	for (i = 0; i < nr_print_slots; i++) {
+		slot = &print_slots[i];
+		pt = &print_workers[slot->record->cpu % print_threads];
+
+		print_handle_file(slot->handles);
+		fwrite(pt->s.buffer + slot->start, 1, slot->len, stdout);
+		if (show_wakeup) {
+			pevent = tracecmd_get_pevent(slot->handles->handle);
+			trace_seq_reset(&print_wakeup_seq);
+			process_wakeup(pevent, slot->record, &print_wakeup_seq);
+			fwrite(print_wakeup_seq.buffer, 1,
+			       print_wakeup_seq.len, stdout);
+		}
+		putchar('\n');
+		free_record(slot->record);
+	}
+	nr_print_slots = 0;
+}
+
+/*
+ * The sched_switch plugin registers the comms of the tasks it
+ * shows. A record that adds a comm must be printed after all the
+ * records before it and before all the ones after it.
+ */
+static int record_adds_comm(struct handle_list *handles,
+			    struct pevent_record *record)
+{
+	struct pevent *pevent = tracecmd_get_pevent(handles->handle);
+	struct comm_event *cevent;
+	unsigned long long pid;
+	int ret = 0;
+	int id;
+	int i, p;
+
+	id = pevent_data_type(pevent, record);
+	for (i = 0; i < NR_COMM_EVENTS; i++) {
+		cevent = &handles->comm_events[i];
+		if (cevent->id != id)
+			continue;
+		for (p = 0; p < 2 && cevent->pid[p]; p++) {
+			if (pevent_read_number_field(cevent->pid[p],
+						     record->data, &pid))
+				continue;
+			/* pid 0 always shows as <idle>, but can be added once */
+			if (!(int)pid) {
+				if (!handles->idle_comm)
+					ret = handles->idle_comm = 1;
+			} else if (!pevent_pid_is_registered(pevent, pid))
+				ret = 1;
+		}
+	}
+	return ret;
+}
+
+static void init_comm_event(struct handle_list *handles, int i,
+			    const char *name, const char *pid0,
+			    const char *pid1)
+{
+	struct pevent *pevent = tracecmd_get_pevent(handles->handle);
+	struct comm_event *cevent = &handles->comm_events[i];
+	struct event_format *event;
+
+	cevent->id = -1;
+	event = pevent_find_event_by_name(pevent, "sched", name);
+	if (!event || !event->handler)
+		return;
+	cevent->id = event->id;
+	cevent->pid[0] = pevent_find_field(event, pid0);
+	if (pid1)
+		cevent->pid[1] = pevent_find_field(event, pid1);
+}
+
+/*
+ * Returns true if the records can be formatted by the -j threads.
+ * Otherwise the report is printed one record at a time as before.
+ */
+static int init_print_threads(struct list_head *handle_list)
+{
+	struct handle_list *handles;
+	struct pevent *pevent;
+	int i;
+
+	if (print_threads < 2 || profile || debug || buffer_breaks)
+		return 0;
+
+	list_for_each_entry(handles, handle_list, list) {
+		pevent = tracecmd_get_pevent(handles->handle);
+		/*
+		 * The latency format caches what it learned from the
+		 * first record, and the function graph output reads
+		 * ahead in the handle it is printed from.
+		 */
+		if (pevent_is_latency_format(pevent) ||
+		    pevent_find_event_by_name(pevent, "ftrace",
+					      "funcgraph_entry"))
+			return 0;
+	}
+
+	list_for_each_entry(handles, handle_list, list) {
+		pevent = tracecmd_get_pevent(handles->handle);
+		if (pevent_prepare_print_threads(pevent))
+			die("Failed to allocate memory for print threads");
+		init_comm_event(handles, 0, "sched_switch",
+				"prev_pid", "next_pid");
+		init_comm_event(handles, 1, "sched_wakeup", "pid", NULL);
+		init_comm_event(handles, 2, "sched_wakeup_new", "pid", NULL);
+	}
+
+	print_slots = malloc_or_die(sizeof(*print_slots) * PRINT_BATCH);
+	print_workers = malloc_or_die(sizeof(*print_workers) * print_threads);
+	for (i = 0; i < print_threads; i++) {
+		trace_seq_init(&print_workers[i].s);
+		print_workers[i].id = i;
+	}
+	trace_seq_init(&print_wakeup_seq);
+
+	return 1;
+}
+
+static void free_print_threads(void)
+{
+	int i;
+
+	if (!print_workers)
+		return;
+
+	for (i = 0; i < print_threads; i++)
+		trace_seq_destroy(&print_workers[i].s);
+	trace_seq_destroy(&print_wakeup_seq);
+	free(print_workers);
+	free(print_slots);
+	print_workers = NULL;
+	print_slots = NULL;
+}
+
+/* Takes the record of @handles to be printed by the -j threads */
+static void queue_handle_record(struct handle_list *handles)
+{
+	struct pevent_record *record = handles->record;
+	struct print_slot *slot;
+
+	if (record_adds_comm(handles, record)) {
+		flush_print_slots();
+		print_handle_file(handles);
+		trace_show_data(handles->handle, record, 0);
+		free_handle_record(handles);
+		return;
+	}
+
+	test_save(record, record->cpu);
+
+	slot = &print_slots[nr_print_slots++];
+	slot->handles = handles;
+	slot->record = record;
+	handles->record = NULL;
+
+	if (nr_print_slots == PRINT_BATCH)
+		flush_print_slots();
+}
+
 static void free_filters(struct filter *event_filter)
 {
 	struct filter *filter;
@@ -1063,6 +1527,7 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	struct pevent_record *last_record;
 	struct event_format *event;
 	struct pevent *pevent;
+	int threaded;
 	int cpus;
 	int ret;
 
@@ -1114,7 +1579,8 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 			last_hook->next = tracecmd_hooks(handles->handle);
 		else
 			hooks = tracecmd_hooks(handles->handle);
-		trace_init_profile(handles->handle, hooks, global);
+		if (profile)
+			trace_init_profile(handles->handle, hooks, global);
 
 		process_filters(handles);
 
@@ -1142,6 +1608,21 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 	if (otype != OUTPUT_NORMAL)
 		return;
 
+	if (filter_cpus) {
+		list_for_each_entry(handles, handle_list, list)
+			tracecmd_set_read_cpus(handles->handle, filter_cpus);
+	}
+
+	list_for_each_entry(handles, handle_list, list)
+		set_read_events(handles);
+
+	if (read_threads) {
+		list_for_each_entry(handles, handle_list, list)
+			start_read_threads(handles);
+	}
+
+	threaded = init_print_threads(handle_list);
+
 	do {
 		last_handle = NULL;
 		last_record = NULL;
@@ -1154,13 +1635,20 @@ static void read_data_info(struct list_head *handle_list, enum output_type otype
 				last_handle = handles;
 			}
 		}
-		if (last_record) {
+		if (last_record && threaded) {
+			queue_handle_record(last_handle);
+		} else if (last_record) {
 			print_handle_file(last_handle);
 			trace_show_data(last_handle->handle, last_record, profile);
 			free_handle_record(last_handle);
 		}
 	} while (last_record);
 
+	if (threaded) {
+		flush_print_slots();
+		free_print_threads();
+	}
+
 	if (profile)
 		trace_profile();
 
@@ -1321,6 +1809,7 @@ static void add_hook(const char *arg)
 }
 
 enum {
+	OPT_read_threads = 241,
 	OPT_bycomm	= 242,
 	OPT_debug	= 243,
 	OPT_uname	= 244,
@@ -1380,6 +1869,13 @@ void trace_report (int argc, char **argv)
 
 	signal(SIGINT, sig_end);
 
+	/*
+	 * When not writing to a terminal, let stdio collect a good chunk
+	 * of formatted records before each write().
+	 */
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, REPORT_OUTPUT_BUF);
+
 	for (;;) {
 		int option_index = 0;
 		static struct option long_options[] = {
@@ -1399,11 +1895,13 @@ void trace_report (int argc, char **argv)
 			{"profile", no_argument, NULL, OPT_profile},
 			{"uname", no_argument, NULL, OPT_uname},
 			{"by-comm", no_argument, NULL, OPT_bycomm},
+			{"read-threads", required_argument, NULL,
+				OPT_read_threads},
 			{"help", no_argument, NULL, '?'},
 			{NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long (argc-1, argv+1, "+hi:H:feGpRr:tPNn:LlEwF:VvTqO:",
+		c = getopt_long (argc-1, argv+1, "+hi:H:feGpRr:tPNn:LlEwF:VvTqO:j:",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -1535,6 +2033,16 @@ void trace_report (int argc, char **argv)
 		case OPT_bycomm:
 			trace_profile_set_merge_like_comms();
 			break;
+		case 'j':
+			print_threads = atoi(optarg);
+			if (print_threads < 0)
+				die("bad number of threads %s", optarg);
+			break;
+		case OPT_read_threads:
+			read_threads = atoi(optarg);
+			if (read_threads < 0)
+				die("bad number of threads %s", optarg);
+			break;
 		default:
 			usage(argv);
 		}
@@ -1607,6 +2115,7 @@ void trace_report (int argc, char **argv)
 
 		ret = tracecmd_read_headers(handle);
 		if (check_event_parsing) {
+			pevent_parse_lazy_events(pevent);
 			if (ret || pevent->parsing_failures)
 				exit(EINVAL);
 			else
@@ -117,6 +117,8 @@ static struct func_list *graph_funcs;
 
 static int func_stack;
 
+static int compress;
+
 static int save_stdout = -1;
 
 struct filter_pids {
@@ -2740,6 +2742,9 @@ static void record_data(char *date2ts)
 		if (!handle)
 			die("Error creating output file");
 
+		if (compress && tracecmd_output_set_compress(handle) < 0)
+			warning("trace-cmd was built without zlib, not compressing");
+
 		if (date2ts)
 			tracecmd_add_option(handle, TRACECMD_OPTION_DATE,
 					    strlen(date2ts)+1, date2ts);
@@ -3789,6 +3794,7 @@ void update_first_instance(struct buffer_instance *instance, int topt)
 }
 
 enum {
+	OPT_compress	= 249,
 	OPT_bycomm	= 250,
 	OPT_stderr	= 251,
 	OPT_profile	= 252,
@@ -3985,6 +3991,7 @@ void trace_record (int argc, char **argv)
 			{"profile", no_argument, NULL, OPT_profile},
 			{"stderr", no_argument, NULL, OPT_stderr},
 			{"by-comm", no_argument, NULL, OPT_bycomm},
+			{"compress", no_argument, NULL, OPT_compress},
 			{"help", no_argument, NULL, '?'},
 			{NULL, 0, NULL, 0}
 		};
@@ -4224,6 +4231,9 @@ void trace_record (int argc, char **argv)
 		case OPT_bycomm:
 			trace_profile_set_merge_like_comms();
 			break;
+		case OPT_compress:
+			compress = 1;
+			break;
 		default:
 			usage(argv);
 		}
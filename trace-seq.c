@@ -96,14 +96,15 @@ static void expand_buffer(struct trace_seq *s)
 {
 	char *buf;
 
-	buf = realloc(s->buffer, s->buffer_size + TRACE_SEQ_BUF_SIZE);
+	/* Double the size so long outputs don't realloc on every page */
+	buf = realloc(s->buffer, s->buffer_size * 2);
 	if (WARN_ONCE(!buf, "Can't allocate trace_seq buffer memory")) {
 		s->state = TRACE_SEQ__MEM_ALLOC_FAILED;
 		return;
 	}
 
 	s->buffer = buf;
-	s->buffer_size += TRACE_SEQ_BUF_SIZE;
+	s->buffer_size *= 2;
 }
 
 /**
@@ -209,6 +210,29 @@ int trace_seq_puts(struct trace_seq *s, const char *str)
 	return len;
 }
 
+/**
+ * trace_seq_putmem - trace sequence printing of raw memory
+ * @s: trace sequence descriptor
+ * @mem: the memory to copy
+ * @len: the number of bytes to copy
+ *
+ * Like trace_seq_puts() but for data that is not nul terminated.
+ */
+int trace_seq_putmem(struct trace_seq *s, const void *mem, unsigned int len)
+{
+	TRACE_SEQ_CHECK_RET0(s);
+
+	while (len > ((s->buffer_size - 1) - s->len))
+		expand_buffer(s);
+
+	TRACE_SEQ_CHECK_RET0(s);
+
+	memcpy(s->buffer + s->len, mem, len);
+	s->len += len;
+
+	return len;
+}
+
 int trace_seq_putc(struct trace_seq *s, unsigned char c)
 {
 	TRACE_SEQ_CHECK_RET0(s);
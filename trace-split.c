@@ -40,6 +40,7 @@
 static unsigned int page_size;
 static const char *default_input_file = "trace.dat";
 static const char *input_file;
+static int compress;
 
 enum split_types {
 	SPLIT_NONE,
@@ -165,20 +166,51 @@ static void write_page(struct pevent *pevent,
 	write(cpu_data->fd, cpu_data->page, page_size);
 }
 
+/* Records of a single CPU are read a page at a time */
+#define BATCH_SIZE	64
+
+struct record_batch {
+	struct pevent_record	records[BATCH_SIZE];
+	int			nr;
+	int			next;
+};
+
 static struct pevent_record *read_record(struct tracecmd_input *handle,
-				  int percpu, int *cpu)
+					 struct record_batch *batch,
+					 int percpu, int *cpu)
 {
-	if (percpu)
-		return tracecmd_read_data(handle, *cpu);
+	if (!percpu)
+		return tracecmd_read_next_data(handle, cpu);
+
+	if (batch->next == batch->nr) {
+		batch->next = 0;
+		batch->nr = tracecmd_read_batch(handle, *cpu, batch->records,
+						BATCH_SIZE);
+		if (batch->nr < 0)
+			die("error reading the data of CPU %d", *cpu);
+		if (!batch->nr) {
+			batch->nr = 0;
+			return NULL;
+		}
+	}
 
-	return tracecmd_read_next_data(handle, cpu);
+	return &batch->records[batch->next++];
+}
+
+static void put_record(struct pevent_record *record, int percpu)
+{
+	/* Batched records belong to the batch */
+	if (!percpu)
+		free_record(record);
 }
 
 static void set_cpu_time(struct tracecmd_input *handle,
+			 struct record_batch *batch,
 			 int percpu, unsigned long long start, int cpu, int cpus)
 {
 	if (percpu) {
 		tracecmd_set_cpu_to_timestamp(handle, cpu, start);
+		batch->nr = batch->next = 0;
 		return;
 	}
 
@@ -194,6 +226,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 		     int count_limit, int percpu, int cpu,
 		     enum split_types type)
 {
+	struct record_batch batch = { .nr = 0, .next = 0 };
 	struct pevent_record *record;
 	struct pevent *pevent;
 	void *ptr;
@@ -225,13 +258,13 @@ static int parse_cpu(struct tracecmd_input *handle,
 	 * start time stamp.
 	 */
 
-	record = read_record(handle, percpu, &cpu);
+	record = read_record(handle, &batch, percpu, &cpu);
 
 	if (start) {
-		set_cpu_time(handle, percpu, start, cpu, cpus);
+		set_cpu_time(handle, &batch, percpu, start, cpu, cpus);
 		while (record && record->ts < start) {
-			free_record(record);
-			record = read_record(handle, percpu, &cpu);
+			put_record(record, percpu);
+			record = read_record(handle, &batch, percpu, &cpu);
 		}
 	} else if (record)
 		start = record->ts;
@@ -262,8 +295,8 @@ static int parse_cpu(struct tracecmd_input *handle,
 		cpu_data[cpu].offset = record->offset;
 
 		if (write_record(handle, record, &cpu_data[cpu], type)) {
-			free_record(record);
-			record = read_record(handle, percpu, &cpu);
+			put_record(record, percpu);
+			record = read_record(handle, &batch, percpu, &cpu);
 
 			/* if we hit the end of the cpu, clear the offset */
 			if (!record) {
@@ -281,7 +314,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 				if (record &&
 				    record->ts >
 				    (start + (unsigned long long)count_limit * 1000000000ULL)) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
@@ -289,7 +322,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 				if (record &&
 				    record->ts >
 				    (start + (unsigned long long)count_limit * 1000000ULL)) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
@@ -297,13 +330,13 @@ static int parse_cpu(struct tracecmd_input *handle,
 				if (record &&
 				    record->ts >
 				    (start + (unsigned long long)count_limit * 1000ULL)) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
 			case SPLIT_EVENTS:
 				if (++count >= count_limit) {
-					free_record(record);
+					put_record(record, percpu);
 					record = NULL;
 				}
 				break;
@@ -314,7 +347,7 @@ static int parse_cpu(struct tracecmd_input *handle,
 	}
 
 	if (record)
-		free_record(record);
+		put_record(record, percpu);
 
 	if (percpu) {
 		if (cpu_data[cpu].page) {
@@ -359,6 +392,10 @@ static double parse_file(struct tracecmd_input *handle,
 	base = basename(output);
 
 	ohandle = tracecmd_copy(handle, output_file);
+	if (!ohandle)
+		die("error creating %s", output_file);
+	if (compress && tracecmd_output_set_compress(ohandle) < 0)
+		die("trace-cmd was built without zlib, can not compress");
 
 	cpus = tracecmd_cpus(handle);
 	cpu_data = malloc_or_die(sizeof(*cpu_data) * cpus);
@@ -433,7 +470,7 @@ void trace_split (int argc, char **argv)
 	if (strcmp(argv[1], "split") != 0)
 		usage(argv);
 
-	while ((c = getopt(argc-1, argv+1, "+ho:i:s:m:u:e:p:rcC:")) >= 0) {
+	while ((c = getopt(argc-1, argv+1, "+ho:i:s:m:u:e:p:rcC:z")) >= 0) {
 		switch (c) {
 		case 'h':
 			usage(argv);
@@ -468,6 +505,9 @@ void trace_split (int argc, char **argv)
 		case 'C':
 			cpu = atoi(optarg);
 			break;
+		case 'z':
+			compress = 1;
+			break;
 		case 'o':
 			if (output)
 				die("only one output file allowed");
@@ -52,6 +52,7 @@ static struct usage_help usage_help[] = {
 		"          --profile enable tracing options needed for report --profile\n"
 		"          --func-stack perform a stack trace for function tracer\n"
 		"             (use with caution)\n"
+		"          --compress compress the data saved in the output file\n"
 	},
 	{
 		"start",
@@ -159,6 +160,8 @@ static struct usage_help usage_help[] = {
 		"          -H Allows users to hook two events together for timings\n"
 		"             (used with --profile)\n"
 		"          --by-comm used with --profile, merge events for related comms\n"
+		"          --read-threads <num> read and filter the CPU data with <num> threads\n"
+		"          -j <num> format the events with <num> threads\n"
 	},
 	{
 		"stream",
@@ -197,12 +200,21 @@ static struct usage_help usage_help[] = {
 		"          -p n  split file up by n pages\n"
 		"          -r    repeat from start to end\n"
 		"          -c    per cpu, that is -p 2 will be 2 pages for each CPU\n"
+		"          -z    compress the data of the output file(s)\n"
 		"          if option is specified, it will split the file\n"
 		"           up starting at start, and ending at end\n"
 		"          start - decimal start time in seconds (ex: 75678.923853)\n"
 		"                  if left out, will start at beginning of file\n"
 		"          end   - decimal end time in seconds\n"
 	},
+	{
+		"convert",
+		"write the events of a trace.dat file into a columnar file",
+		" %s convert [-i file][-o file][-n]\n"
+		"          -i input file [default trace.dat]\n"
+		"          -o output file [default trace.col]\n"
+		"          -n do not compress the columns\n"
+	},
 	{
 		"options",
 		"list the plugin options available for trace-cmd report",
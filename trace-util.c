@@ -410,36 +410,43 @@ void parse_proc_kallsyms(struct pevent *pevent,
 	char *func;
 	char *line;
 	char *next = NULL;
-	char *addr_str;
 	char *mod;
-	char ch;
+	char *p;
 
 	line = strtok_r(file, "\n", &next);
 	while (line) {
+		/* addr type func[\t[mod]] */
+		addr = strtoull(line, &p, 16);
+		while (isspace(*p))
+			p++;
+		if (!*p++)
+			goto next;
+		while (isspace(*p))
+			p++;
+		func = p;
+		while (*p && !isspace(*p))
+			p++;
+		if (p == func)
+			goto next;
+
 		mod = NULL;
-		errno = 0;
-		sscanf(line, "%ms %c %ms\t[%ms",
-			     &addr_str, &ch, &func, &mod);
-		if (errno) {
-			free(addr_str);
-			free(func);
-			free(mod);
-			perror("sscanf");
-			return;
+		if (*p) {
+			*p++ = 0;
+			while (isspace(*p))
+				p++;
+			if (*p == '[' && p[1]) {
+				mod = ++p;
+				while (*p && !isspace(*p))
+					p++;
+				/* truncate the extra ']' */
+				p[-1] = 0;
+			}
 		}
-		addr = strtoull(addr_str, NULL, 16);
-		free(addr_str);
-
-		/* truncate the extra ']' */
-		if (mod)
-			mod[strlen(mod) - 1] = 0;
 
 		/* Hack for arm arch that adds a lot of bogus '$a' functions */
 		if (func[0] != '$')
 			pevent_register_function(pevent, func, addr, mod);
-		free(func);
-		free(mod);
-
+ next:
 		line = strtok_r(NULL, "\n", &next);
 	}
 }
@@ -1276,8 +1283,11 @@ trace_util_load_plugins_dir(struct pevent *pevent, const char *suffix,
 	int ret;
 
 	ret = stat(path, &st);
-	if (ret < 0)
+	if (ret < 0) {
+		/* Plugin directories are optional, do not leave errno set */
+		errno = 0;
 		return;
+	}
 
 	if (!S_ISDIR(st.st_mode))
 		return;
@@ -1230,14 +1230,22 @@ static gboolean show_task(TraceViewStore *store, struct pevent *pevent,
 	return FALSE;
 }
 
+#define FILTER_BATCH	1024
+#define FILTER_BITS	(sizeof(unsigned long) * 8)
+
 static void update_filter_tasks(TraceViewStore *store)
 {
+	struct pevent_record *records[FILTER_BATCH];
+	unsigned long matches[FILTER_BATCH / FILTER_BITS];
 	struct tracecmd_input *handle;
 	struct pevent *pevent;
 	struct pevent_record *record;
+	TraceViewRecord *rec;
 	gint pid;
 	gint cpu;
+	gint nr;
 	gint i;
+	gint j;
 
 	handle = store->handle;
 	pevent = tracecmd_get_pevent(store->handle);
@@ -1267,30 +1275,41 @@ static void update_filter_tasks(TraceViewStore *store)
 	for (cpu = 0; cpu < store->cpus; cpu++) {
 		record = tracecmd_read_cpu_first(handle, cpu);
 
-		for (i = 0; i < store->cpu_items[cpu]; i++) {
+		for (i = 0; i < store->cpu_items[cpu]; i += nr) {
+
+			/* Match the records against the events a batch at a time */
+			for (nr = 0; nr < FILTER_BATCH &&
+				     i + nr < store->cpu_items[cpu]; nr++) {
+				g_assert(record->offset ==
+					 store->cpu_list[cpu][i + nr].offset);
+				records[nr] = record;
+				record = tracecmd_read_data(handle, cpu);
+			}
 
-			g_assert(record->offset == store->cpu_list[cpu][i].offset);
+			if (!store->all_events)
+				pevent_filter_match_batch(store->event_filter,
+							  records, nr, matches);
 
-			/* The record may be filtered by the events */
-			if (!store->all_events) {
-				int ret;
-				ret = pevent_filter_match(store->event_filter,
-							  record);
-				if (ret != FILTER_MATCH) {
-					store->cpu_list[cpu][i].visible = 0;
+			for (j = 0; j < nr; j++) {
+				rec = &store->cpu_list[cpu][i + j];
+
+				/* The record may be filtered by the events */
+				if (!store->all_events &&
+				    !(matches[j / FILTER_BITS] &
+				      (1UL << (j % FILTER_BITS)))) {
+					rec->visible = 0;
 					goto skip;
 				}
-			}
 
-			pid = pevent_data_pid(pevent, record);
-			if (show_task(store, pevent, record, pid))
-				store->cpu_list[cpu][i].visible = 1;
-			else
-				store->cpu_list[cpu][i].visible = 0;
+				pid = pevent_data_pid(pevent, records[j]);
+				if (show_task(store, pevent, records[j], pid))
+					rec->visible = 1;
+				else
+					rec->visible = 0;
 
  skip:
-			free_record(record);
-			record = tracecmd_read_data(handle, cpu);
+				free_record(records[j]);
+			}
 		}
 		g_assert(record == NULL);
 	}